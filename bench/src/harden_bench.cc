@@ -0,0 +1,68 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <stdint.h>
+
+#include <memory_pool.h>
+
+// Measures the cost of the hardening mode: build this file with and without _MEM_POOL_HARDEN_ (the
+// harden_bench and harden_bench_hardened targets) and compare.  Two patterns: a tight allocate/free
+// pair, which stays in L1, and batches of "batch" objects, which walk the free list through memory.
+
+struct object {
+    int_fast64_t payload[8];
+};
+
+template <class Fn>
+static double
+ns_per_op(const char *name, uint64_t ops, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / ops;
+    printf("%-24s %8.2f ns/op\n", name, ns);
+    return ns;
+}
+
+int
+main(int argc, char **argv) {
+    uint64_t rounds = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000000;
+    const std::size_t batch = 4096;
+
+#ifdef _MEM_POOL_HARDEN_
+    printf("hardened (encoded links, free fill)\n");
+#else
+    printf("plain\n");
+#endif
+
+    MemoryPool<object, 4096> pool;
+    std::vector<object *> held(batch);
+
+    ns_per_op("alloc/free pair", rounds * 2, [&] {
+        for (uint64_t i = 0; i < rounds; i++) {
+            object *o = pool.allocate();
+            o->payload[0] = static_cast<int_fast64_t>(i);
+            pool.deallocate(o);
+        }
+    });
+
+    ns_per_op("alloc/free batch", rounds / batch * batch * 2, [&] {
+        for (uint64_t r = 0; r < rounds / batch; r++) {
+            for (std::size_t i = 0; i < batch; i++) held[i] = pool.allocate();
+            for (std::size_t i = 0; i < batch; i++) pool.deallocate(held[i]);
+        }
+    });
+
+#ifdef _MEM_POOL_HARDEN_
+    pool.set_free_fill(false);
+    ns_per_op("batch, no free fill", rounds / batch * batch * 2, [&] {
+        for (uint64_t r = 0; r < rounds / batch; r++) {
+            for (std::size_t i = 0; i < batch; i++) held[i] = pool.allocate();
+            for (std::size_t i = 0; i < batch; i++) pool.deallocate(held[i]);
+        }
+    });
+#endif
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <pool.h>
+
+// Cost of each policy choice in pool.h, under the same symmetric alloc/free load as scaling_bench: every
+// thread allocates a few objects and frees them again.  Every row differs from the default Pool in exactly
+// one policy, so the rows compare like with like.  The hand-written pools do more than any Pool
+// configuration (budgets, overflow, elimination, flat combining...) and are measured by scaling_bench.
+
+struct object {
+    int_fast64_t payload[8];
+};
+
+static const int held_per_thread = 4;
+static const std::size_t capacity = 64 * held_per_thread;
+
+template <class Pool>
+static double
+mops(Pool &pool, int threads, uint64_t ops_per_thread) {
+    std::atomic<int> ready { 0 };
+    std::atomic<bool> go { false };
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            object *held[held_per_thread];
+            ready.fetch_add(1);
+            while (!go.load(std::memory_order_acquire)) { }
+
+            for (uint64_t i = 0; i < ops_per_thread; i += 2 * held_per_thread) {
+                for (int h = 0; h < held_per_thread; h++) {
+                    held[h] = pool.allocate();
+                    held[h]->payload[0] = static_cast<int_fast64_t>(i);
+                }
+                for (int h = 0; h < held_per_thread; h++) pool.deallocate(held[h]);
+            }
+        });
+    }
+
+    while (ready.load() != threads) std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &w : workers) w.join();
+    auto end = std::chrono::steady_clock::now();
+
+    double us = std::chrono::duration<double, std::micro>(end - start).count();
+    return static_cast<double>(ops_per_thread) * threads / us;
+}
+
+template <class Pool>
+static void
+row(const char *name, int threads, uint64_t ops) {
+    Pool pool(capacity);
+    printf("%-36s %8d %10.2f\n", name, threads, mops(pool, threads, ops));
+}
+
+int
+main(int argc, char **argv) {
+    uint64_t ops = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+
+    printf("%-36s %8s %10s\n", "pool", "threads", "Mops");
+    // Only meaningful on one thread, and locked_free_list's lock compiles away there
+    row<Pool<object, overlay_link, locked_free_list, segmented_growth<>, single_thread>>("single_thread", 1, ops);
+
+    for (int threads = 1; threads <= 16; threads *= 4) {
+        row<Pool<object>>("default (sharded tagged_free_list)", threads, ops);
+        row<Pool<object, inline_link>>("inline_link", threads, ops);
+        row<Pool<object, overlay_link, tagged_free_list>>("tagged_free_list", threads, ops);
+        row<Pool<object, overlay_link, locked_free_list>>("locked_free_list", threads, ops);
+        row<Pool<object, overlay_link, sharded_free_list<locked_free_list>>>("sharded locked_free_list", threads, ops);
+        row<Pool<object, overlay_link, sharded_free_list<tagged_free_list>, fixed_growth>>("fixed_growth", threads, ops);
+    }
+    return 0;
+}
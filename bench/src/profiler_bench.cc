@@ -0,0 +1,86 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include <stdint.h>
+
+#include <memory_pool.h>
+
+// Measures what PoolProfiler costs the pool's hot paths (sample rate from the command line, 1024 by
+// default).  The pool
+// first gets "resident" long-lived objects, so some samples stay live the whole time and every free has
+// to be told apart from a sampled one.  Same two patterns as harden_bench: a tight allocate/free pair
+// and batches of "batch" objects.
+
+struct object {
+    int_fast64_t payload[8];
+};
+
+template <class Fn>
+static double
+ns_per_op(const char *name, uint64_t ops, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / ops;
+    printf("%-32s %8.2f ns/op\n", name, ns);
+    return ns;
+}
+
+template <class Pool>
+static double
+pairs(const char *name, Pool &pool, uint64_t rounds) {
+    return ns_per_op(name, rounds * 2, [&] {
+        for (uint64_t i = 0; i < rounds; i++) {
+            object *o = pool.allocate();
+            o->payload[0] = static_cast<int_fast64_t>(i);
+            pool.deallocate(o);
+        }
+    });
+}
+
+template <class Pool>
+static double
+batches(const char *name, Pool &pool, uint64_t rounds, std::vector<object *> &held) {
+    const std::size_t batch = held.size();
+    return ns_per_op(name, rounds / batch * batch * 2, [&] {
+        for (uint64_t r = 0; r < rounds / batch; r++) {
+            for (std::size_t i = 0; i < batch; i++) held[i] = pool.allocate();
+            for (std::size_t i = 0; i < batch; i++) pool.deallocate(held[i]);
+        }
+    });
+}
+
+int
+main(int argc, char **argv) {
+    uint64_t rounds = argc > 1 ? strtoull(argv[1], nullptr, 10) : 5000000;
+    uint32_t rate = argc > 2 ? static_cast<uint32_t>(strtoul(argv[2], nullptr, 10)) : 1024;
+    const std::size_t resident = 1 << 20;
+
+    PoolProfiler profiler(rate);
+    MemoryPool<object, 4096> pool;
+    std::vector<object *> held(4096);
+
+    std::vector<object *> kept;
+    pool.set_profiler(&profiler);
+    for (std::size_t i = 0; i < resident; i++) kept.push_back(pool.allocate());
+    printf("sample rate 1/%u, %llu live samples\n", rate,
+           static_cast<unsigned long long>(profiler.stats().live_samples));
+
+    // Alternate so frequency scaling and warm-up hit both sides alike; keep the best of seven
+    double plain_pair = 1e9, sampled_pair = 1e9, plain_batch = 1e9, sampled_batch = 1e9;
+    for (int run = 0; run < 7; run++) {
+        pool.set_profiler(nullptr);
+        plain_pair = std::min(plain_pair, pairs("alloc/free pair", pool, rounds));
+        plain_batch = std::min(plain_batch, batches("alloc/free batch", pool, rounds, held));
+        pool.set_profiler(&profiler);
+        sampled_pair = std::min(sampled_pair, pairs("alloc/free pair, profiled", pool, rounds));
+        sampled_batch = std::min(sampled_batch, batches("alloc/free batch, profiled", pool, rounds, held));
+    }
+    printf("overhead: pair %+.1f%%, batch %+.1f%%\n", 100 * (sampled_pair / plain_pair - 1),
+           100 * (sampled_batch / plain_batch - 1));
+
+    for (object *o : kept) pool.deallocate(o);
+    return 0;
+}
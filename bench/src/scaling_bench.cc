@@ -0,0 +1,80 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <m_pool.h>
+
+// Throughput of the shared pools from 1 to 64 threads under symmetric alloc/free load: every thread
+// allocates a few objects and frees them again, so allocations and frees hit the pool head at the same
+// rate.  Compares LockFreeMemoryPool with and without the elimination array against MutexMemoryPool.
+
+struct object {
+    int_fast64_t payload[8];
+};
+
+static const int held_per_thread = 4;
+
+template <class Pool>
+static double
+mops(Pool &pool, int threads, uint64_t ops_per_thread) {
+    std::atomic<int> ready { 0 };
+    std::atomic<bool> go { false };
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&] {
+            object *held[held_per_thread];
+            ready.fetch_add(1);
+            while (!go.load(std::memory_order_acquire)) { }
+
+            for (uint64_t i = 0; i < ops_per_thread; i += 2 * held_per_thread) {
+                for (int h = 0; h < held_per_thread; h++) {
+                    held[h] = pool.allocate();
+                    held[h]->payload[0] = static_cast<int_fast64_t>(i);
+                }
+                for (int h = 0; h < held_per_thread; h++) pool.deallocate(held[h]);
+            }
+        });
+    }
+
+    while (ready.load() != threads) std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &w : workers) w.join();
+    auto end = std::chrono::steady_clock::now();
+
+    double us = std::chrono::duration<double, std::micro>(end - start).count();
+    return static_cast<double>(ops_per_thread) * threads / us;
+}
+
+int
+main(int argc, char **argv) {
+    uint64_t ops = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000000;
+    const std::size_t capacity = 64 * held_per_thread;
+
+    bool lock_free = LockFreeMemoryPool<object>::is_lock_free();
+    if (!lock_free) printf("16 byte CAS is not lock-free here, skipping LockFreeMemoryPool\n");
+
+    printf("%8s %16s %16s %16s\n", "threads", "lock-free Mops", "+elimination", "mutex Mops");
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        double plain = 0, eliminated = 0;
+        if (lock_free) {
+            LockFreeMemoryPool<object> a(capacity);
+            a.set_elimination(false);
+            plain = mops(a, threads, ops);
+
+            LockFreeMemoryPool<object> b(capacity);
+            eliminated = mops(b, threads, ops);
+        }
+        MutexMemoryPool<object> m(capacity);
+        double mutex = mops(m, threads, ops);
+
+        printf("%8d %16.2f %16.2f %16.2f\n", threads, plain, eliminated, mutex);
+    }
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+#include <thread_pool.h>
+
+// Throughput of ThreadPool::enqueue() + Future::get().  Build this file with and without
+// _THREAD_POOL_HEAP_TASKS_ (the thread_pool_bench and thread_pool_bench_heap targets) to compare the
+// per-thread task_memory pools against plain operator new for result slots, oversized closures and
+// boxed work stealing tasks.  Three patterns:
+//  - round trip: one enqueue, then wait for it, so every task pays the full hand-off latency;
+//  - batch: an external thread enqueues "batch" tasks, then collects them; the result slots are
+//    allocated by the submitter and freed by whichever side lets go last;
+//  - spawn: tasks enqueued from inside workers (work stealing) whose futures are dropped.
+// Then a fan-out of "fan_out" tasks submitted with an enqueue() loop against enqueue_bulk() and
+// submit_batch().  Besides the time it prints the context switches per fan-out: every futex wait and
+// every wakeup of a sleeping worker is one, so fewer lock hand-offs and notify calls show up there.  The
+// time includes a 200us pause per fan-out that lets the workers fall asleep again.
+
+struct payload {
+    int_fast64_t words[10];     // Too big for Task's inline storage: the closure goes to task_memory too
+};
+
+template <class Fn>
+static double
+ns_per_task(const char *name, uint64_t tasks, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / tasks;
+    printf("%-32s %8.1f ns/task %10.0f tasks/s\n", name, ns, 1e9 / ns);
+    return ns;
+}
+
+static void
+run(const char *mode_name, ThreadPool::scheduling mode, std::size_t ring, uint64_t rounds) {
+    const std::size_t batch = 1024;
+    std::size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    ThreadPool pool(threads, mode, ring);
+    char name[64];
+
+    snprintf(name, sizeof(name), "%s round trip", mode_name);
+    uint64_t trips = rounds / 16;
+    ns_per_task(name, trips, [&] {
+        for (uint64_t i = 0; i < trips; i++) pool.enqueue([i] { return i; }).get();
+    });
+
+    std::vector<Future<int_fast64_t>> futures;
+    futures.reserve(batch);
+    snprintf(name, sizeof(name), "%s batch", mode_name);
+    ns_per_task(name, rounds / batch * batch, [&] {
+        for (uint64_t r = 0; r < rounds / batch; r++) {
+            for (std::size_t i = 0; i < batch; i++) {
+                futures.push_back(pool.enqueue([](int_fast64_t x) { return x + 1; }, static_cast<int_fast64_t>(i)));
+            }
+            for (auto &f : futures) f.get();
+            futures.clear();
+        }
+    });
+
+    snprintf(name, sizeof(name), "%s batch, large closure", mode_name);
+    ns_per_task(name, rounds / batch * batch, [&] {
+        payload p = {};
+        for (uint64_t r = 0; r < rounds / batch; r++) {
+            for (std::size_t i = 0; i < batch; i++) {
+                p.words[0] = static_cast<int_fast64_t>(i);
+                futures.push_back(pool.enqueue([p] { return p.words[0]; }));
+            }
+            for (auto &f : futures) f.get();
+            futures.clear();
+        }
+    });
+
+    if (mode == ThreadPool::scheduling::work_stealing) {
+        // Binary fan-out from inside the workers: 2^depth leaves per tree.  The futures are dropped right
+        // away, so the result slots are freed by the worker that runs the task, usually not the one that
+        // allocated them.
+        const int depth = 12;
+        std::atomic<uint64_t> leaves { 0 };
+        std::function<void(int)> tree;
+        tree = [&](int d) {
+            if (d == 0) {
+                leaves.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            pool.enqueue(tree, d - 1);
+            pool.enqueue(tree, d - 1);
+        };
+        uint64_t trees = std::max<uint64_t>(1, rounds / (1 << depth));
+        snprintf(name, sizeof(name), "%s spawn", mode_name);
+        ns_per_task(name, trees * ((2 << depth) - 1), [&] {
+            for (uint64_t t = 0; t < trees; t++) {
+                leaves.store(0);
+                pool.enqueue(tree, depth);
+                while (leaves.load() != (1u << depth)) std::this_thread::yield();
+            }
+        });
+    }
+}
+
+static long
+context_switches() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+template <class Submit>
+static void
+fan_out(const char *name, uint64_t rounds, Submit submit) {
+    const std::size_t fan_out = 1000;
+    uint64_t batches = std::max<uint64_t>(1, rounds / fan_out);
+    std::vector<Future<int_fast64_t>> futures;
+    futures.reserve(fan_out);
+
+    long switches = context_switches();
+    ns_per_task(name, batches * fan_out, [&] {
+        for (uint64_t r = 0; r < batches; r++) {
+            submit(futures, fan_out);
+            for (auto &f : futures) f.get();
+            futures.clear();
+            // Let the workers go back to sleep, as between two requests of a server
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    });
+    printf("%-32s %8.1f context switches/fan-out\n", "", double(context_switches() - switches) / batches);
+}
+
+static void
+run_fan_out(const char *mode_name, ThreadPool::scheduling mode, std::size_t ring, uint64_t rounds) {
+    std::size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    ThreadPool pool(threads, mode, ring);
+    auto work = [](int_fast64_t x) { return x + 1; };
+    char name[64];
+
+    snprintf(name, sizeof(name), "%s enqueue loop", mode_name);
+    fan_out(name, rounds, [&](std::vector<Future<int_fast64_t>> &futures, std::size_t n) {
+        for (std::size_t i = 0; i < n; i++) futures.push_back(pool.enqueue(work, static_cast<int_fast64_t>(i)));
+    });
+
+    std::vector<std::function<int_fast64_t()>> calls;
+    for (std::size_t i = 0; i < 1000; i++) calls.push_back([i] { return static_cast<int_fast64_t>(i) + 1; });
+    snprintf(name, sizeof(name), "%s enqueue_bulk", mode_name);
+    fan_out(name, rounds, [&](std::vector<Future<int_fast64_t>> &futures, std::size_t n) {
+        futures = pool.enqueue_bulk(calls.begin(), calls.begin() + n);
+    });
+
+    snprintf(name, sizeof(name), "%s submit_batch", mode_name);
+    fan_out(name, rounds, [&](std::vector<Future<int_fast64_t>> &futures, std::size_t n) {
+        auto batch = pool.submit_batch();
+        batch.reserve(n);
+        for (std::size_t i = 0; i < n; i++) futures.push_back(batch.add(work, static_cast<int_fast64_t>(i)));
+        batch.submit();
+    });
+}
+
+int
+main(int argc, char **argv) {
+    uint64_t rounds = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+
+#ifdef _THREAD_POOL_HEAP_TASKS_
+    printf("operator new task memory\n");
+#else
+    printf("pooled task memory\n");
+#endif
+
+    run("shared queue", ThreadPool::scheduling::shared_queue, 0, rounds);
+    run("ring", ThreadPool::scheduling::shared_queue, 4096, rounds);
+    run("work stealing", ThreadPool::scheduling::work_stealing, 0, rounds);
+
+    run_fan_out("shared queue", ThreadPool::scheduling::shared_queue, 0, rounds);
+    run_fan_out("ring", ThreadPool::scheduling::shared_queue, 4096, rounds);
+    run_fan_out("work stealing", ThreadPool::scheduling::work_stealing, 0, rounds);
+    return 0;
+}
@@ -0,0 +1,1313 @@
+#ifndef __M_POOL_H__
+#define __M_POOL_H__
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory_budget.h"
+#include "pool_profiler.h"
+#include "pool_hardening.h"
+
+// 基础内存池接口
+template<typename T>
+class MemoryPoolBase {
+public:
+    virtual ~MemoryPoolBase() = default;
+    virtual T* allocate() = 0;
+    virtual void deallocate(T* ptr) = 0;
+
+    // 采样分析器（可选），为 nullptr 时不采样
+    void set_profiler(PoolProfiler* profiler) { profiler_ = profiler; }
+
+    // 当前线程遇到竞争（CAS 失败、拿不到锁）时计数到哪里，为 nullptr 时不计数。
+    // AdaptiveMemoryPool 调用后端期间把它指向调用线程在自己池子里的记录，所以计数按池子、按线程分开，
+    // 同一类型的其他池子上的竞争不会算进来
+    static uint32_t*& contention_counter() {
+        static thread_local uint32_t* counter = nullptr;
+        return counter;
+    }
+
+    // 池子用完之后的去处，默认没有（allocate() 返回 nullptr）。溢出的对象照常用 deallocate() 释放，
+    // 池子按地址范围认出不属于自己的指针，交回给分配它的地方。
+    // 必须在池子开始溢出之前设置，之后改变去处会把已经溢出的对象还错地方
+    void set_overflow_to_heap() { overflow_ = overflow_mode::heap; overflow_pool_ = nullptr; }
+    void set_overflow_to(MemoryPoolBase<T>* pool) { overflow_ = overflow_mode::pool; overflow_pool_ = pool; }
+
+    // 溢出计数，用来调整池子的大小：peak_live 就是 count 还差多少
+    struct overflow_stats_t {
+        uint64_t allocations = 0;       // 从溢出去处分配的次数
+        uint64_t deallocations = 0;
+        uint64_t live = 0;              // 还没有释放的溢出对象
+        uint64_t peak_live = 0;
+        uint64_t failures = 0;          // 池子用完并且没有去处（或者去处也失败），返回 nullptr 的次数
+    };
+
+    overflow_stats_t overflow_stats() const {
+        overflow_stats_t st;
+        st.allocations = overflow_allocations_.load(std::memory_order_relaxed);
+        st.deallocations = overflow_deallocations_.load(std::memory_order_relaxed);
+        st.live = overflow_live_.load(std::memory_order_relaxed);
+        st.peak_live = overflow_peak_.load(std::memory_order_relaxed);
+        st.failures = overflow_failures_.load(std::memory_order_relaxed);
+        return st;
+    }
+
+protected:
+    PoolProfiler* profiler_ = nullptr;
+
+    void note_contention() {
+        if (uint32_t* counter = contention_counter()) {
+            ++*counter;
+        }
+    }
+
+    // 池子用完时调用。只在慢路径上，计数器用原子变量就够了
+    T* overflow_allocate() {
+        T* result = nullptr;
+        if (overflow_ == overflow_mode::heap) {
+            void* p = nullptr;
+            if (posix_memalign(&p, alignof(T) > sizeof(void*) ? alignof(T) : sizeof(void*), sizeof(T)) == 0) {
+                result = static_cast<T*>(p);
+            }
+        } else if (overflow_ == overflow_mode::pool) {
+            result = overflow_pool_->allocate();
+        }
+        if (result == nullptr) {
+            overflow_failures_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        overflow_allocations_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t live = overflow_live_.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint64_t peak = overflow_peak_.load(std::memory_order_relaxed);
+        while (live > peak && !overflow_peak_.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+        return result;
+    }
+
+    // 不属于池子自己的内存的指针从这里还回去
+    void overflow_deallocate(T* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        overflow_deallocations_.fetch_add(1, std::memory_order_relaxed);
+        overflow_live_.fetch_sub(1, std::memory_order_relaxed);
+        if (overflow_ == overflow_mode::pool) {
+            overflow_pool_->deallocate(ptr);
+        } else {
+            free(ptr);
+        }
+    }
+
+#ifdef _MEM_POOL_HARDEN_
+    // 加固模式：空闲链表中的 next 指针与随机密钥异或后存放，见 pool_hardening.h
+    const uintptr_t link_key_ = pool_harden_key(this);
+#endif
+
+    // 相邻对象槽的间距：sizeof(T) 向上取整到指针的对齐，空闲槽里存放的 next 指针才是对齐的
+    // （比如 12 字节的 T，不取整的话每隔一个槽的 next 就落在 4 字节边界上）
+    static constexpr size_t slot_size = (sizeof(T) + alignof(void*) - 1) / alignof(void*) * alignof(void*);
+
+    // next 指针的编码与解码（异或，所以是同一个操作）
+    template<typename N>
+    N* xor_link(N* p) const {
+#ifdef _MEM_POOL_HARDEN_
+        return reinterpret_cast<N*>(reinterpret_cast<uintptr_t>(p) ^ link_key_);
+#else
+        return p;
+#endif
+    }
+
+    // 只检查已经通过 CAS 的 next，过期读取到的垃圾值不会走到这里
+    void check_link(const void* slot, const void* next) const {
+#ifdef _MEM_POOL_HARDEN_
+        if (next != nullptr && !pool_plausible_link(reinterpret_cast<uintptr_t>(next), alignof(void*))) {
+            pool_corruption("MemoryPoolBase", slot);
+        }
+#endif
+        (void)slot; (void)next;
+    }
+
+    // 对象槽所在的内存直接向内核 mmap，页面在第一次写入时才真正分配，
+    // 所以很大的池子只占用实际用到的那部分物理内存
+    static size_t region_bytes(size_t count) {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return (slot_size * count + page - 1) / page * page;
+    }
+
+    static void* map_region(size_t count) {
+        void* p = mmap(nullptr, region_bytes(count), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("mmap failed.");
+        }
+        // 从未分配过的槽位也算空闲，ASan 下同样不允许访问
+        POOL_POISON(p, slot_size * count);
+        return p;
+    }
+
+    static void unmap_region(void* p, size_t count) {
+        POOL_UNPOISON(p, slot_size * count);
+        munmap(p, region_bytes(count));
+    }
+
+    // 对象被释放：加固模式下填充固定字节，ASan 下毒化除 next 以外的部分
+    void poison_free(T* ptr, size_t link_size) {
+#ifdef _MEM_POOL_HARDEN_
+        memset(static_cast<void*>(ptr), POOL_FREE_FILL, sizeof(T));
+#endif
+        POOL_POISON(reinterpret_cast<char*>(ptr) + link_size, sizeof(T) - link_size);
+    }
+
+private:
+    enum class overflow_mode { none, heap, pool };
+
+    overflow_mode overflow_ = overflow_mode::none;
+    MemoryPoolBase<T>* overflow_pool_ = nullptr;
+    std::atomic<uint64_t> overflow_allocations_{0};
+    std::atomic<uint64_t> overflow_deallocations_{0};
+    std::atomic<uint64_t> overflow_live_{0};
+    std::atomic<uint64_t> overflow_peak_{0};
+    std::atomic<uint64_t> overflow_failures_{0};
+};
+
+// T 必须是 trivially_destructible，因为我们不会调用析构函数
+template<typename T>
+class LockFreeMemoryPool : public MemoryPoolBase<T> {
+private:
+    // 内存块节点
+    struct Node {
+        Node* next;
+    };
+
+    // 解决 ABA 问题的标记指针
+    struct TaggedPointer {
+        Node* ptr;
+        uintptr_t tag;
+
+        // 需要默认构造函数以用于 atomic
+        TaggedPointer() : ptr(nullptr), tag(0) {}
+        TaggedPointer(Node* p, uintptr_t t) : ptr(p), tag(t) {}
+    };
+
+    // 一段连续的内存，每段都能放 segment_size_ 个对象。
+    // 段只会追加到链表头部，直到析构才释放，所以遍历链表不需要加锁。
+    // 所有的段都在构造时预留的同一片地址空间里依次排列，判断指针是否属于池子只要比较一次地址范围
+    struct Segment {
+        char* memory;
+        // 从未分配过的对象从这里按顺序切出，[0, bump) 已经切出过；
+        // 等于 retired 表示这段内存已经还给了系统，可以被重新启用；
+        // retiring 表示 trim() 正在释放它，这时既不能切分也不能重新启用
+        std::atomic<size_t> bump{0};
+        Segment* next = nullptr;
+    };
+
+    static constexpr size_t retired = SIZE_MAX;
+    static constexpr size_t retiring = SIZE_MAX - 1;
+
+    // 预留的地址空间最多能放的段数，用完之后池子才算耗尽
+    static constexpr size_t max_segments = 64;
+
+    // 空闲列表按 CPU 分片，每个分片的栈顶独占一条缓存行。线程优先使用自己所在 CPU 的分片，
+    // 自己的分片空了才去别的分片偷，这样不同核上的线程基本不会碰同一条缓存行。
+    // available 是列表长度的上界：压入之前先加，弹出成功之后才减，所以为 0 时列表一定是空的。
+    // 分配时用它跳过空的分片，只读 8 个字节，不用对 16 字节的栈顶做 cmpxchg16b
+    struct alignas(64) Shard {
+        std::atomic<TaggedPointer> head;
+        std::atomic<size_t> available{0};
+    };
+
+    static constexpr size_t max_shards = 64;
+
+    // 消除数组（Hendler/Shavit 的 elimination backoff）：在分片栈顶上 CAS 失败的线程不再立即重试，
+    // 而是到随机一个槽位上碰运气。释放的线程把对象放进槽位等一会儿，分配的线程从槽位里把它拿走，
+    // 两边都不用再碰栈顶。每个槽位独占一条缓存行
+    struct alignas(64) EliminationSlot {
+        std::atomic<Node*> offered{nullptr};
+    };
+
+    static constexpr size_t elimination_slots = 16;
+    // 释放的线程在槽位上等待的轮数
+    static constexpr int elimination_spins = 128;
+
+    // 空闲列表的分片，只包含被释放回来的对象。shard_mask_ + 1 个分片，是 2 的幂
+    Shard shards_[max_shards];
+    const size_t shard_mask_;
+    // 段链表，最新的段在最前面
+    std::atomic<Segment*> segments_{nullptr};
+    // 最近一次切出对象的段，只是个提示
+    std::atomic<Segment*> current_{nullptr};
+    // 每段中对象的个数
+    const size_t segment_size_;
+    // 预留的地址空间（PROT_NONE），段启用时才改成可读写。slices_ 个段，每段 region_bytes(segment_size_) 字节
+    char* reserved_ = nullptr;
+    size_t slices_ = 0;
+    // 下一个还没启用的段的序号
+    std::atomic<size_t> next_slice_{0};
+    // 共享的内存预算（可选）
+    MemoryBudget* budget_;
+    // 在预算上注册的 trim()，预算不足时由预算调用
+    MemoryBudget::registration_t budget_id_ = 0;
+    // 保证同一时间只有一个 trim()
+    std::atomic_flag trim_lock_ = ATOMIC_FLAG_INIT;
+    // 是否在冲突时使用消除数组
+    std::atomic<bool> eliminate_{true};
+    EliminationSlot elimination_[elimination_slots];
+
+public:
+    // 构造函数：映射第一段内存，不做任何初始化，对象在第一次分配时才切出。
+    // count 只是软上限：用完之后会再映射新的段，每段 count 个对象，最多 max_segments 段。
+    // 如果传入 budget，每段内存都先从预算中预留，第一段预留失败时抛出异常，之后的段预留失败时池子耗尽：
+    // allocate() 交给溢出的去处（见 set_overflow_to_heap()），没有去处时返回 nullptr
+    explicit LockFreeMemoryPool(size_t count, MemoryBudget* budget = nullptr);
+
+    // 析构函数：释放内存
+    ~LockFreeMemoryPool();
+
+    // 禁止拷贝和移动
+    LockFreeMemoryPool(const LockFreeMemoryPool&) = delete;
+    LockFreeMemoryPool& operator=(const LockFreeMemoryPool&) = delete;
+
+    // 分配一个对象
+    T* allocate() { return allocate_at(home_shard()); }
+
+    // 释放一个对象
+    void deallocate(T* ptr) { deallocate_at(ptr, home_shard()); }
+
+    // 指定分片的版本：从 shard 开始找空闲对象 / 把对象放回 shard。
+    // 竞争很小时总用分片 0，可以省掉 home_shard() 的开销
+    T* allocate_at(size_t shard);
+    void deallocate_at(T* ptr, size_t shard);
+
+    // 当前线程的主分片
+    size_t home_shard() const;
+
+    // 检查平台是否支持无锁的 TaggedPointer
+    static bool is_lock_free() {
+        std::atomic<TaggedPointer> dummy;
+        return dummy.is_lock_free();
+    }
+
+    // 把末尾（最新映射的）已经完全空闲的段还给系统和预算，返回释放的字节数。
+    // 地址空间保留着，之后需要增长时优先重新启用这些段。第一段永远保留。
+    // 已经有另一个线程在 trim() 时直接返回 0
+    size_t trim();
+
+    // 当前可用的对象总数（不含已释放的段）
+    size_t capacity() const;
+
+    // 打开或关闭消除数组，默认打开。主要用于对比测试
+    void set_elimination(bool on) { eliminate_.store(on, std::memory_order_relaxed); }
+
+    // 分片个数
+    size_t shards() const { return shard_mask_ + 1; }
+
+    // ptr 是否在池子预留的地址范围内。O(1)，deallocate() 用它把溢出的对象送回去
+    bool owns(const T* ptr) const {
+        return static_cast<size_t>(reinterpret_cast<const char*>(ptr) - reserved_) < slices_ * this->region_bytes(segment_size_);
+    }
+
+private:
+    Node* pop(Shard& shard);
+    void push(Shard& shard, Node* first, Node* last, size_t count);
+    Node* take_all(Shard& shard, size_t& count);
+    static size_t shard_count();
+    T* handed_out(Node* node);
+    bool try_offer(Node* node);
+    static size_t elimination_index();
+    T* carve();
+    T* carve_from(Segment* seg);
+    bool grow();
+    static size_t segment_index(const void* p, const std::vector<Segment*>& sorted);
+};
+
+// 基于互斥锁的备用实现，用 flat combining 减少锁的交接：
+// 拿不到锁的线程不排队等锁，而是把请求写进自己的请求记录里；拿到锁的线程（combiner）
+// 一次处理掉所有挂起的请求。空闲列表一直留在 combiner 所在核的缓存里，锁也很少在线程之间传递
+template<typename T>
+class MutexMemoryPool : public MemoryPoolBase<T> {
+private:
+    struct Node {
+        Node* next;
+    };
+
+    // 每个请求记录独占一条缓存行，等待的线程只在自己的记录上自旋
+    struct alignas(64) Request {
+        enum : uint32_t { idle, alloc, release, done };
+        std::atomic<uint32_t> state{idle};
+        std::atomic<bool> claimed{false};
+        // release 请求要放回的对象，或者 alloc 请求的结果
+        Node* node = nullptr;
+    };
+
+    static constexpr size_t request_records = 64;
+    
+    void* raw_memory_;
+    Node* head_ = nullptr;
+    size_t bump_ = 0;
+    std::mutex mutex_;
+    const size_t capacity_;
+    MemoryBudget* budget_;
+    // 挂起的请求数，为 0 时 combiner 不用扫描请求记录
+    std::atomic<size_t> pending_{0};
+    Request requests_[request_records];
+    
+public:
+    explicit MutexMemoryPool(size_t count, MemoryBudget* budget = nullptr) : capacity_(count), budget_(budget) {
+        static_assert(sizeof(T) >= sizeof(Node), "T must be at least the size of a pointer.");
+
+        if (budget_ && !budget_->reserve(this->slot_size * count)) {
+            throw std::runtime_error("MemoryBudget exhausted.");
+        }
+        
+        try {
+            raw_memory_ = this->map_region(count);
+        } catch (...) {
+            if (budget_) budget_->release(this->slot_size * count);
+            throw;
+        }
+    }
+    
+    ~MutexMemoryPool() {
+        this->unmap_region(raw_memory_, capacity_);
+        if (budget_) {
+            budget_->release(this->slot_size * capacity_);
+        }
+    }
+    
+    T* allocate() override {
+        Node* result;
+        if (mutex_.try_lock()) {
+            // 没有竞争：自己做完，顺便处理别人挂起的请求
+            result = pop_locked();
+            combine_locked();
+            mutex_.unlock();
+        } else {
+            result = submit(Request::alloc, nullptr);
+        }
+        if (result == nullptr) {
+            return this->overflow_allocate();
+        }
+        POOL_UNPOISON(result, sizeof(T));
+        if (this->profiler_ && this->profiler_->should_sample()) {
+            this->profiler_->record_alloc(result, sizeof(T));
+        }
+        return reinterpret_cast<T*>(result);
+    }
+    
+    void deallocate(T* ptr) override {
+        if (!owns(ptr)) {
+            this->overflow_deallocate(ptr);
+            return;
+        }
+        if (this->profiler_) {
+            this->profiler_->record_free(ptr);
+        }
+        this->poison_free(ptr, sizeof(Node));
+        Node* node = reinterpret_cast<Node*>(ptr);
+        if (mutex_.try_lock()) {
+            push_locked(node);
+            combine_locked();
+            mutex_.unlock();
+        } else {
+            submit(Request::release, node);
+        }
+    }
+
+    // ptr 是否属于池子自己的内存
+    bool owns(const T* ptr) const {
+        return static_cast<size_t>(reinterpret_cast<const char*>(ptr) - static_cast<const char*>(raw_memory_)) < this->slot_size * capacity_;
+    }
+
+private:
+    // 以下两个函数必须持有 mutex_
+    Node* pop_locked() {
+        Node* result = head_;
+        if (result != nullptr) {
+            head_ = this->xor_link(result->next);
+            this->check_link(result, head_);
+        } else if (bump_ < capacity_) {
+            result = reinterpret_cast<Node*>(static_cast<char*>(raw_memory_) + this->slot_size * bump_++);
+        }
+        return result;
+    }
+
+    void push_locked(Node* node) {
+        node->next = this->xor_link(head_);
+        head_ = node;
+    }
+
+    // 处理所有挂起的请求。同一趟里先释放的对象可以马上被后面的申请拿走，一直在缓存里
+    void combine_locked() {
+        if (pending_.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+        for (Request& r : requests_) {
+            uint32_t state = r.state.load(std::memory_order_acquire);
+            if (state == Request::alloc) {
+                r.node = pop_locked();
+            } else if (state == Request::release) {
+                push_locked(r.node);
+            } else {
+                continue;
+            }
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            r.state.store(Request::done, std::memory_order_release);
+        }
+    }
+
+    // 发布一个请求，等 combiner 处理完；锁空出来时自己当 combiner
+    Node* submit(uint32_t op, Node* node) {
+        Request* r = claim();
+        if (r == nullptr) {
+            // 记录都被占用了（线程数远多于记录数），老老实实排队等锁
+            std::lock_guard<std::mutex> lock(mutex_);
+            Node* result = op == Request::alloc ? pop_locked() : (push_locked(node), nullptr);
+            combine_locked();
+            return result;
+        }
+
+        this->note_contention();
+        r->node = node;
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        r->state.store(op, std::memory_order_release);
+
+        for (unsigned spins = 1; r->state.load(std::memory_order_acquire) != Request::done; spins++) {
+            if (mutex_.try_lock()) {
+                combine_locked();
+                mutex_.unlock();
+            } else if (spins % 64 == 0) {
+                // combiner 可能被抢占了，别一直占着 CPU
+                std::this_thread::yield();
+            } else {
+                asm volatile("pause\n": : :"memory");
+            }
+        }
+
+        Node* result = r->node;
+        r->state.store(Request::idle, std::memory_order_relaxed);
+        r->claimed.store(false, std::memory_order_release);
+        return result;
+    }
+
+    // 按线程 id 的哈希挑一个请求记录，被占用就往后找
+    Request* claim() {
+        static thread_local size_t hashed = std::hash<std::thread::id>()(std::this_thread::get_id());
+        for (size_t i = 0; i < request_records; i++) {
+            Request& r = requests_[(hashed + i) % request_records];
+            if (!r.claimed.load(std::memory_order_relaxed) && !r.claimed.exchange(true, std::memory_order_acquire)) {
+                return &r;
+            }
+        }
+        return nullptr;
+    }
+};
+
+struct adaptive_thread_exit;
+
+// AdaptiveMemoryPool 的编号和所有用过它们的线程。编号在进程内唯一，线程用它认出自己上次用的池子。
+// adaptive_thread_exit::entries 只在持有 lock 时读写
+struct adaptive_pool_registry {
+    std::mutex lock;
+    std::vector<adaptive_thread_exit*> threads;
+    uint64_t next_id = 1;
+
+    static adaptive_pool_registry& get() {
+        static adaptive_pool_registry registry;
+        return registry;
+    }
+
+    uint64_t add() {
+        std::lock_guard<std::mutex> guard(lock);
+        return next_id++;
+    }
+
+    // 池子析构时调用：从每个线程的退出列表里删掉这个池子，之后退出的线程不会再碰它
+    void remove(uint64_t id);
+};
+
+// 线程退出时，把它在每个还活着的 AdaptiveMemoryPool 里的记录交回去（包括缓存的对象）。
+// 池子析构时会把自己从列表里删掉，所以列表里只有还活着的池子，长度不超过线程同时用着的池子数
+struct adaptive_thread_exit {
+    struct entry_t {
+        uint64_t pool_id;
+        void* pool;
+        void* state;
+        void (*release)(void* pool, void* state);
+    };
+    std::vector<entry_t> entries;
+
+    static adaptive_thread_exit& get() {
+        static thread_local adaptive_thread_exit exit;
+        return exit;
+    }
+
+    adaptive_thread_exit() {
+        adaptive_pool_registry& registry = adaptive_pool_registry::get();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.threads.push_back(this);
+    }
+
+    void add(const entry_t& e) {
+        std::lock_guard<std::mutex> guard(adaptive_pool_registry::get().lock);
+        entries.push_back(e);
+    }
+
+    ~adaptive_thread_exit() {
+        adaptive_pool_registry& registry = adaptive_pool_registry::get();
+        // 持有注册表的锁，池子在这期间不会被析构
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (entry_t& e : entries) {
+            e.release(e.pool, e.state);
+        }
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+    }
+};
+
+inline void adaptive_pool_registry::remove(uint64_t id) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (adaptive_thread_exit* t : threads) {
+        std::vector<adaptive_thread_exit::entry_t>& entries = t->entries;
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [id](const adaptive_thread_exit::entry_t& e) { return e.pool_id == id; }),
+                      entries.end());
+    }
+}
+
+// 自适应内存池：构造时按平台选后端，运行时再按每个线程测到的竞争程度选择工作模式。
+//
+// 后端是一个带标签的 union，调用时用分支直接调到具体类型，没有虚函数。
+// 每个线程在自己的记录里统计它在这个池子上遇到的竞争（见 MemoryPoolBase::contention_counter()），每 adapt_window 次操作
+// 按这段时间里平均每次操作的竞争次数重新选一次模式：
+//  - single_head：几乎没有竞争，所有操作都走无锁池的分片 0，连 sched_getcpu() 都省了；
+//  - sharded：有一些竞争，使用当前 CPU 的分片；
+//  - thread_cached：竞争严重，在前面加一层线程私有的小缓存，大部分操作根本不碰共享数据。
+// 互斥锁后端没有分片，只在 sharded 之外多了 thread_cached 一种模式。
+//
+// 线程状态放在池子自己的 thread_records 个记录里，线程第一次使用时认领一个，退出时连同缓存的对象
+// 一起交回。记录不够分时，后来的线程先用 sharded 模式、没有缓存，每 adapt_window 次操作再试着认领一次
+template<typename T>
+class AdaptiveMemoryPool {
+public:
+    enum class mode : uint32_t { single_head, sharded, thread_cached };
+
+private:
+    enum class backend { lock_free, mutex };
+
+    static constexpr size_t thread_records = 128;
+    static constexpr size_t cache_slots = 16;
+    static constexpr uint32_t adapt_window = 256;
+
+    // 每个线程一条记录，只有认领它的线程读写（owner 除外）
+    struct alignas(64) ThreadState {
+        std::atomic<std::thread::id> owner{std::thread::id()};
+        mode current = mode::single_head;
+        uint32_t ops = 0;
+        // 这个窗口里遇到的竞争次数，后端通过 contention_counter() 累加
+        uint32_t contended = 0;
+        uint32_t cached = 0;
+        T* cache[cache_slots];
+    };
+
+    // 在作用域内把后端遇到的竞争计入当前线程的记录，离开时恢复原来的去处
+    struct counting_scope {
+        uint32_t*& counter = MemoryPoolBase<T>::contention_counter();
+        uint32_t* saved = counter;
+
+        explicit counting_scope(ThreadState* state) { counter = state ? &state->contended : nullptr; }
+        ~counting_scope() { counter = saved; }
+    };
+
+    const backend kind_;
+    union {
+        LockFreeMemoryPool<T> lock_free_;
+        MutexMemoryPool<T> mutex_;
+    };
+    const uint64_t id_ = adaptive_pool_registry::get().add();
+    PoolProfiler* profiler_ = nullptr;
+    ThreadState states_[thread_records];
+    
+public:
+    explicit AdaptiveMemoryPool(size_t count, MemoryBudget* budget = nullptr)
+        : kind_(LockFreeMemoryPool<T>::is_lock_free() ? backend::lock_free : backend::mutex) {
+        if (kind_ == backend::lock_free) {
+            new (&lock_free_) LockFreeMemoryPool<T>(count, budget);
+            std::cout << "Using lock-free memory pool implementation." << std::endl;
+        } else {
+            new (&mutex_) MutexMemoryPool<T>(count, budget);
+            std::cout << "Using mutex-based memory pool implementation." << std::endl;
+        }
+    }
+
+    ~AdaptiveMemoryPool() {
+        // 先从所有线程的退出列表里删掉，之后退出的线程就不会再碰这个池子。缓存里的对象属于后端的内存，后端析构时一起释放
+        adaptive_pool_registry::get().remove(id_);
+        if (kind_ == backend::lock_free) {
+            lock_free_.~LockFreeMemoryPool<T>();
+        } else {
+            mutex_.~MutexMemoryPool<T>();
+        }
+    }
+
+    AdaptiveMemoryPool(const AdaptiveMemoryPool&) = delete;
+    AdaptiveMemoryPool& operator=(const AdaptiveMemoryPool&) = delete;
+    
+    T* allocate() {
+        ThreadState* state = thread_state();
+        counting_scope counting(state);
+        mode m = state ? state->current : mode::sharded;
+        T* result;
+        if (m == mode::thread_cached && state->cached != 0) {
+            result = state->cache[--state->cached];
+            POOL_UNPOISON(result, sizeof(T));
+            if (profiler_ && profiler_->should_sample()) {
+                profiler_->record_alloc(result, sizeof(T));
+            }
+        } else {
+            result = backend_allocate(m);
+        }
+        if (state) {
+            adapt(*state);
+        }
+        return result;
+    }
+    
+    void deallocate(T* ptr) {
+        ThreadState* state = thread_state();
+        counting_scope counting(state);
+        mode m = state ? state->current : mode::sharded;
+        if (m == mode::thread_cached && state->cached < cache_slots) {
+            if (profiler_) {
+                profiler_->record_free(ptr);
+            }
+            POOL_POISON(ptr, sizeof(T));
+            state->cache[state->cached++] = ptr;
+        } else {
+            backend_deallocate(ptr, m);
+        }
+        if (state) {
+            adapt(*state);
+        }
+    }
+
+    void set_profiler(PoolProfiler* profiler) {
+        profiler_ = profiler;
+        if (kind_ == backend::lock_free) {
+            lock_free_.set_profiler(profiler);
+        } else {
+            mutex_.set_profiler(profiler);
+        }
+    }
+
+    void set_overflow_to_heap() {
+        if (kind_ == backend::lock_free) {
+            lock_free_.set_overflow_to_heap();
+        } else {
+            mutex_.set_overflow_to_heap();
+        }
+    }
+
+    typename MemoryPoolBase<T>::overflow_stats_t overflow_stats() const {
+        return kind_ == backend::lock_free ? lock_free_.overflow_stats() : mutex_.overflow_stats();
+    }
+
+    // 当前线程正在使用的模式
+    mode current_mode() {
+        ThreadState* state = thread_state();
+        return state ? state->current : mode::sharded;
+    }
+
+private:
+    T* backend_allocate(mode m) {
+        if (kind_ == backend::mutex) {
+            return mutex_.allocate();
+        }
+        return m == mode::single_head ? lock_free_.allocate_at(0) : lock_free_.allocate();
+    }
+
+    void backend_deallocate(T* ptr, mode m) {
+        if (kind_ == backend::mutex) {
+            mutex_.deallocate(ptr);
+        } else if (m == mode::single_head) {
+            lock_free_.deallocate_at(ptr, 0);
+        } else {
+            lock_free_.deallocate(ptr);
+        }
+    }
+
+    // 找到（或认领）当前线程在这个池子里的记录。同一个池子连续使用时只比较一次编号。
+    // 没认领到记录时每 adapt_window 次操作重新找一次，别的线程退出后空出来的记录还能用上
+    ThreadState* thread_state() {
+        struct last_t { uint64_t pool = 0; ThreadState* state = nullptr; uint32_t retry = 0; };
+        static thread_local last_t last;
+        if (last.pool == id_ && (last.state != nullptr || --last.retry != 0)) {
+            return last.state;
+        }
+
+        std::thread::id me = std::this_thread::get_id();
+        size_t start = std::hash<std::thread::id>()(me);
+        ThreadState* found = nullptr;
+        for (size_t i = 0; i < thread_records && found == nullptr; i++) {
+            ThreadState& s = states_[(start + i) % thread_records];
+            std::thread::id owner = s.owner.load(std::memory_order_acquire);
+            if (owner == me) {
+                found = &s;
+            } else if (owner == std::thread::id() && s.owner.compare_exchange_strong(owner, me)) {
+                found = &s;
+                found->current = mode::single_head;
+                found->ops = 0;
+                found->contended = 0;
+                adaptive_thread_exit::get().add({id_, this, found, &release_state});
+            }
+        }
+        last.pool = id_;
+        last.state = found;
+        last.retry = adapt_window;
+        return found;
+    }
+
+    // 线程退出时调用：还回缓存的对象，放弃记录
+    static void release_state(void* pool, void* state) {
+        AdaptiveMemoryPool* self = static_cast<AdaptiveMemoryPool*>(pool);
+        ThreadState* s = static_cast<ThreadState*>(state);
+        self->flush(*s, mode::sharded);
+        s->owner.store(std::thread::id(), std::memory_order_release);
+    }
+
+    void flush(ThreadState& state, mode m) {
+        while (state.cached != 0) {
+            T* ptr = state.cache[--state.cached];
+            POOL_UNPOISON(ptr, sizeof(T));
+            backend_deallocate(ptr, m);
+        }
+    }
+
+    // 每个窗口结束时按平均竞争次数重新选择模式
+    void adapt(ThreadState& state) {
+        if (++state.ops < adapt_window) {
+            return;
+        }
+        uint32_t contended = state.contended;
+        state.ops = 0;
+        state.contended = 0;
+
+        mode next;
+        if (contended * 8 >= adapt_window) {
+            next = mode::thread_cached;                 // 每 8 次操作至少一次竞争
+        } else if (contended * 64 >= adapt_window) {
+            next = kind_ == backend::mutex ? state.current : mode::sharded;
+        } else {
+            next = kind_ == backend::mutex ? mode::sharded : mode::single_head;
+        }
+
+        if (next != mode::thread_cached) {
+            // 离开缓存模式时把缓存的对象还回去
+            flush(state, next);
+        }
+        state.current = next;
+    }
+};
+
+// 构造函数实现
+template<typename T>
+LockFreeMemoryPool<T>::LockFreeMemoryPool(size_t count, MemoryBudget* budget)
+    : shard_mask_(shard_count() - 1), segment_size_(count), budget_(budget) {
+    if (!is_lock_free()) {
+        // 在不支持128位原子操作的平台（如32位系统）上，这会抛出异常
+        throw std::runtime_error("Atomic TaggedPointer is not lock-free on this platform.");
+    }
+    if (count == 0) {
+        throw std::runtime_error("LockFreeMemoryPool: count must not be 0.");
+    }
+
+    // 我们需要确保 T 的大小至少是一个指针的大小，以存放 next 指针
+    static_assert(sizeof(T) >= sizeof(Node), "T must be at least the size of a pointer.");
+    // 确保 T 是 POD 类型或其析构无关紧要
+//    static_assert(std::is_trivially_destructible<T>::value, "T must be trivially destructible.");
+
+    // 空闲列表一开始是空的，对象全部从段中切出
+    for (size_t i = 0; i < max_shards; i++) {
+        shards_[i].head.store(TaggedPointer(nullptr, 0));
+    }
+
+    // 预留 max_segments 段的地址空间，只占地址不占内存。地址空间不够时减半重试
+    const size_t stride = this->region_bytes(segment_size_);
+    for (size_t slices = max_segments; slices != 0 && reserved_ == nullptr; slices /= 2) {
+        if (stride > SIZE_MAX / slices) {
+            continue;
+        }
+        void* p = mmap(nullptr, stride * slices, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            reserved_ = static_cast<char*>(p);
+            slices_ = slices;
+        }
+    }
+    if (reserved_ == nullptr) {
+        throw std::runtime_error("mmap failed.");
+    }
+
+    // 启用第一段。不再逐个链接节点：那样要写遍整块内存，
+    // 千万级别的池子光构造就要几秒，而且所有页面都会被立即分配
+    if (!grow()) {
+        munmap(reserved_, stride * slices_);
+        throw std::runtime_error("MemoryBudget exhausted.");
+    }
+    // 别的池子向预算申请不到内存时，先让这个池子把完全空闲的段还回去。
+    // 自己的 grow() 预留失败时也会回调到这里，trim() 和分配本来就可以并发
+    if (budget_) {
+        budget_id_ = budget_->register_pool([this]() { return trim(); });
+    }
+}
+
+// 析构函数实现
+template<typename T>
+LockFreeMemoryPool<T>::~LockFreeMemoryPool() {
+    // 注销会等正在进行的回调结束，之后预算不会再调用 trim()
+    if (budget_) {
+        budget_->unregister_pool(budget_id_);
+    }
+    Segment* seg = segments_.load();
+    while (seg != nullptr) {
+        Segment* next = seg->next;
+        if (seg->bump.load() != retired && budget_) {
+            budget_->release(this->slot_size * segment_size_);
+        }
+        POOL_UNPOISON(seg->memory, this->slot_size * segment_size_);
+        delete seg;
+        seg = next;
+    }
+    munmap(reserved_, this->region_bytes(segment_size_) * slices_);
+}
+
+// 分片个数取 CPU 个数向上取整到 2 的幂，最多 max_shards 个
+template<typename T>
+size_t LockFreeMemoryPool<T>::shard_count() {
+    size_t cpus = std::thread::hardware_concurrency();
+    size_t n = 1;
+    while (n < cpus && n < max_shards) {
+        n <<= 1;
+    }
+    return n;
+}
+
+// 当前线程的主分片：Linux 上是当前 CPU（glibc 通过 rseq 读取，开销只有几个周期），
+// 其他平台用线程 id 的哈希。线程被迁移到别的 CPU 也没关系，只是换了一个分片
+template<typename T>
+size_t LockFreeMemoryPool<T>::home_shard() const {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0) {
+        return static_cast<size_t>(cpu) & shard_mask_;
+    }
+#endif
+    static thread_local size_t hashed = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return hashed & shard_mask_;
+}
+
+// 从一个分片弹出一个节点，分片为空时返回 nullptr (Lock-Free Pop)
+template<typename T>
+typename LockFreeMemoryPool<T>::Node* LockFreeMemoryPool<T>::pop(Shard& shard) {
+    TaggedPointer old_head;
+    TaggedPointer new_head;
+
+    // 使用循环和 CAS 保证原子性
+    while (true) {
+        // 1. 原子地读取当前 head
+        old_head = shard.head.load();
+
+        // 2. 如果栈为空，交给调用者处理
+        if (old_head.ptr == nullptr) {
+            return nullptr;
+        }
+
+        // 3. 准备新的 head（old_head 可能已经过期，读到的 next 只有 CAS 成功后才可信）
+        new_head.ptr = this->xor_link(old_head.ptr->next);
+        new_head.tag = old_head.tag + 1;
+
+        // 4. 尝试用 CAS 更新 head
+        // 如果 head 的值仍等于 old_head，就将其更新为 new_head 并返回 true
+        // 否则，说明有其他线程修改了 head，此时 CAS 失败，
+        // old_head 会被自动更新为 head 的最新值，然后循环重试。
+        if (shard.head.compare_exchange_weak(old_head, new_head)) {
+            // 成功！返回取出的节点
+            shard.available.fetch_sub(1, std::memory_order_relaxed);
+            this->check_link(old_head.ptr, new_head.ptr);
+            return old_head.ptr;
+        }
+
+        // 5. CAS 失败说明栈顶上有竞争，先看看有没有正在释放的线程可以直接交给我们一个对象
+        this->note_contention();
+        if (eliminate_.load(std::memory_order_relaxed)) {
+            EliminationSlot& slot = elimination_[elimination_index()];
+            Node* node = slot.offered.load(std::memory_order_acquire);
+            if (node != nullptr && slot.offered.compare_exchange_strong(node, nullptr, std::memory_order_acq_rel)) {
+                return node;
+            }
+        }
+    }
+}
+
+// 把 first..last 这条已经链好的、共 count 个节点的链表压入分片
+template<typename T>
+void LockFreeMemoryPool<T>::push(Shard& shard, Node* first, Node* last, size_t count) {
+    shard.available.fetch_add(count, std::memory_order_relaxed);
+    TaggedPointer head = shard.head.load();
+    do {
+        last->next = this->xor_link(head.ptr);
+    } while (!shard.head.compare_exchange_weak(head, TaggedPointer(first, head.tag + 1)));
+}
+
+// 取走分片中的整个链表，count 返回节点个数。tag 加一，正在 pop 的线程即使读到了其中节点的 next，CAS 也一定失败
+template<typename T>
+typename LockFreeMemoryPool<T>::Node* LockFreeMemoryPool<T>::take_all(Shard& shard, size_t& count) {
+    count = 0;
+    if (shard.available.load(std::memory_order_relaxed) == 0) {
+        return nullptr;
+    }
+    TaggedPointer head = shard.head.load();
+    while (!shard.head.compare_exchange_weak(head, TaggedPointer(nullptr, head.tag + 1))) { }
+    for (Node* node = head.ptr; node != nullptr; node = this->xor_link(node->next)) {
+        count++;
+    }
+    shard.available.fetch_sub(count, std::memory_order_relaxed);
+    return head.ptr;
+}
+
+// 分配操作：先找自己的分片，空了再依次偷别的分片，都空了才切新对象。
+// 空的分片只看 available，切分阶段每次分配只多读几个 8 字节的计数
+template<typename T>
+T* LockFreeMemoryPool<T>::allocate_at(size_t home) {
+    for (size_t i = 0; i <= shard_mask_; i++) {
+        Shard& shard = shards_[(home + i) & shard_mask_];
+        if (shard.available.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        if (Node* node = pop(shard)) {
+            return handed_out(node);
+        }
+    }
+    if (T* result = carve()) {
+        return result;
+    }
+    return this->overflow_allocate();
+}
+
+// 对象离开内存池：解除 ASan 毒化，按采样率记录调用栈
+template<typename T>
+T* LockFreeMemoryPool<T>::handed_out(Node* node) {
+    POOL_UNPOISON(node, sizeof(T));
+    if (this->profiler_ && this->profiler_->should_sample()) {
+        this->profiler_->record_alloc(node, sizeof(T));
+    }
+    return reinterpret_cast<T*>(node);
+}
+
+// 每个线程从不同的槽位开始，之后每次换一个，避免总是挤在同一个槽位上
+template<typename T>
+size_t LockFreeMemoryPool<T>::elimination_index() {
+    static thread_local uint32_t state = static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state % elimination_slots;
+}
+
+// 释放方：把对象放进一个空槽位，等待分配方拿走。超时后尝试撤回，撤回成功就回到栈顶上重试。
+// 分配方在 pop() 里用 CAS 把槽位里的对象拿走：即使同一个对象在这期间被拿走、用完又被放回来（ABA），
+// CAS 成功时它也确实是空闲的，所以不需要标记
+template<typename T>
+bool LockFreeMemoryPool<T>::try_offer(Node* node) {
+    EliminationSlot& slot = elimination_[elimination_index()];
+    Node* empty = nullptr;
+    if (!slot.offered.compare_exchange_strong(empty, node, std::memory_order_release, std::memory_order_relaxed)) {
+        return false;
+    }
+    for (int i = 0; i < elimination_spins; i++) {
+        if (slot.offered.load(std::memory_order_relaxed) != node) {
+            return true;
+        }
+        asm volatile("pause\n": : :"memory");
+    }
+    // 撤回失败说明对象在最后一刻被拿走了
+    Node* expected = node;
+    return !slot.offered.compare_exchange_strong(expected, nullptr, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+// 切出一个从未使用过的对象，所有段都用完时增长，增长失败返回 nullptr
+template<typename T>
+T* LockFreeMemoryPool<T>::carve() {
+    while (true) {
+        if (T* result = carve_from(current_.load(std::memory_order_acquire))) {
+            return result;
+        }
+
+        // 当前段用完了，找一个还有空间的段（段数很少，遍历的代价可以忽略）
+        Segment* seg = segments_.load(std::memory_order_acquire);
+        while (seg != nullptr && seg->bump.load(std::memory_order_relaxed) >= segment_size_) {
+            seg = seg->next;
+        }
+        if (seg != nullptr) {
+            current_.store(seg, std::memory_order_release);
+            continue;
+        }
+
+        if (!grow()) {
+            return nullptr;
+        }
+    }
+}
+
+template<typename T>
+T* LockFreeMemoryPool<T>::carve_from(Segment* seg) {
+    // 先检查再 CAS，段用完之后 bump 不会继续增长，也不会覆盖 retired
+    size_t index = seg->bump.load(std::memory_order_relaxed);
+    do {
+        if (index >= segment_size_) {
+            return nullptr;
+        }
+    } while (!seg->bump.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+
+    T* result = reinterpret_cast<T*>(seg->memory + this->slot_size * index);
+    POOL_UNPOISON(result, sizeof(T));
+    if (this->profiler_ && this->profiler_->should_sample()) {
+        this->profiler_->record_alloc(result, sizeof(T));
+    }
+    return result;
+}
+
+// 增加一段可用内存：优先重新启用 trim() 释放过的段，否则启用预留地址空间中的下一段并发布到链表头部。
+// 只有预算不足、预留的地址空间用完（或 mprotect 失败）时返回 false
+template<typename T>
+bool LockFreeMemoryPool<T>::grow() {
+    const size_t bytes = this->slot_size * segment_size_;
+
+    for (Segment* seg = segments_.load(std::memory_order_acquire); seg != nullptr; seg = seg->next) {
+        size_t expected = retired;
+        if (seg->bump.load(std::memory_order_relaxed) != retired) {
+            continue;
+        }
+        if (budget_ && !budget_->reserve(bytes)) {
+            return false;
+        }
+        // 页面在 trim() 时已经用 MADV_DONTNEED 丢掉，再次写入时由内核按需分配
+        if (seg->bump.compare_exchange_strong(expected, 0, std::memory_order_acq_rel)) {
+            current_.store(seg, std::memory_order_release);
+            return true;
+        }
+        if (budget_) {
+            budget_->release(bytes);
+        }
+    }
+
+    // 下一段的序号由已发布的段数决定，同一时间只有一个线程能拿到它。
+    // 拿不到说明别的线程正在增长，让出 CPU 后回去从它的段里切
+    const size_t stride = this->region_bytes(segment_size_);
+    Segment* head = segments_.load(std::memory_order_acquire);
+    size_t slice = head == nullptr ? 0 : static_cast<size_t>(head->memory - reserved_) / stride + 1;
+    if (slice >= slices_) {
+        return false;
+    }
+    // 先分配好节点：拿到序号之后就不能再抛异常，否则序号永远不会被释放
+    std::unique_ptr<Segment> seg(new Segment);
+    size_t expected = slice;
+    if (!next_slice_.compare_exchange_strong(expected, slice + 1, std::memory_order_acq_rel)) {
+        std::this_thread::yield();
+        return true;
+    }
+
+    if (budget_ && !budget_->reserve(bytes)) {
+        next_slice_.store(slice, std::memory_order_release);
+        return false;
+    }
+    seg->memory = reserved_ + stride * slice;
+    if (mprotect(seg->memory, stride, PROT_READ | PROT_WRITE) != 0) {
+        if (budget_) budget_->release(bytes);
+        next_slice_.store(slice, std::memory_order_release);
+        return false;
+    }
+    // 从未分配过的槽位也算空闲，ASan 下同样不允许访问
+    POOL_POISON(seg->memory, bytes);
+    seg->next = head;
+    // 拿到序号的线程才会发布，这期间链表不会变
+    Segment* published = seg.release();
+    segments_.store(published, std::memory_order_release);
+    current_.store(published, std::memory_order_release);
+    return true;
+}
+
+// sorted 按起始地址升序，返回 p 所在段的下标，即最后一个起始地址不大于 p 的段
+template<typename T>
+size_t LockFreeMemoryPool<T>::segment_index(const void* p, const std::vector<Segment*>& sorted) {
+    auto it = std::upper_bound(sorted.begin(), sorted.end(), static_cast<const char*>(p),
+                               [](const char* addr, const Segment* seg) { return addr < seg->memory; });
+    return static_cast<size_t>(it - sorted.begin()) - 1;
+}
+
+template<typename T>
+size_t LockFreeMemoryPool<T>::trim() {
+    if (trim_lock_.test_and_set(std::memory_order_acquire)) {
+        return 0;
+    }
+
+    // 1. 取走所有分片的空闲列表，串成一条
+    Node* taken = nullptr;
+    for (size_t i = 0; i <= shard_mask_; i++) {
+        size_t count;
+        Node* chain = take_all(shards_[i], count);
+        if (chain == nullptr) {
+            continue;
+        }
+        Node* tail = chain;
+        for (Node* next; (next = this->xor_link(tail->next)) != nullptr; tail = next) { }
+        tail->next = this->xor_link(taken);
+        taken = chain;
+    }
+
+    // 2. 按段统计取到的空闲对象
+    // 取走空闲列表之后再拍快照，列表中对象所在的段一定都在快照里
+    std::vector<Segment*> list;
+    for (Segment* seg = segments_.load(std::memory_order_acquire); seg != nullptr; seg = seg->next) {
+        list.push_back(seg);
+    }
+    std::vector<Segment*> sorted(list);
+    std::sort(sorted.begin(), sorted.end(), [](const Segment* a, const Segment* b) { return a->memory < b->memory; });
+    std::vector<size_t> free_count(sorted.size(), 0);
+    for (Node* node = taken; node != nullptr; node = this->xor_link(node->next)) {
+        free_count[segment_index(node, sorted)]++;
+    }
+
+    // 3. 从最新的段开始，切出的对象全部空闲的段可以释放，遇到第一个还在使用的段就停下。
+    //    CAS 把 bump 从统计时的值改成 retiring，并发的切分会让 CAS 失败，所以不会释放刚分配出去的对象
+    std::vector<bool> dropped(sorted.size(), false);
+    for (size_t i = 0; i + 1 < list.size(); i++) {
+        Segment* seg = list[i];
+        size_t carved = seg->bump.load(std::memory_order_acquire);
+        if (carved >= retiring) {
+            continue;
+        }
+        size_t index = segment_index(seg->memory, sorted);
+        if (free_count[index] != carved || !seg->bump.compare_exchange_strong(carved, retiring, std::memory_order_acq_rel)) {
+            break;
+        }
+        dropped[index] = true;
+    }
+
+    // 4. 其余的空闲对象放回当前线程的分片。必须在丢弃页面之前做，链表还要经过被释放段中的节点
+    Node* first = nullptr;
+    Node* last = nullptr;
+    size_t kept = 0;
+    for (Node* node = taken, *next; node != nullptr; node = next) {
+        next = this->xor_link(node->next);
+        if (dropped[segment_index(node, sorted)]) {
+            continue;
+        }
+        if (last == nullptr) {
+            first = node;
+        } else {
+            last->next = this->xor_link(node);
+        }
+        last = node;
+        kept++;
+    }
+    if (first != nullptr) {
+        push(shards_[home_shard()], first, last, kept);
+    }
+
+    // 5. 丢弃页面并归还预算
+    size_t released = 0;
+    const size_t bytes = this->slot_size * segment_size_;
+    for (size_t index = 0; index < sorted.size(); index++) {
+        if (!dropped[index]) {
+            continue;
+        }
+        Segment* seg = sorted[index];
+        POOL_UNPOISON(seg->memory, bytes);
+        madvise(seg->memory, this->region_bytes(segment_size_), MADV_DONTNEED);
+        POOL_POISON(seg->memory, bytes);
+        if (budget_) {
+            budget_->release(bytes);
+        }
+        if (this->profiler_) {
+            this->profiler_->forget(seg->memory, seg->memory + bytes);
+        }
+        // 页面丢弃完才允许 grow() 重新启用
+        seg->bump.store(retired, std::memory_order_release);
+        released += bytes;
+    }
+
+    trim_lock_.clear(std::memory_order_release);
+    return released;
+}
+
+template<typename T>
+size_t LockFreeMemoryPool<T>::capacity() const {
+    size_t total = 0;
+    for (Segment* seg = segments_.load(std::memory_order_acquire); seg != nullptr; seg = seg->next) {
+        if (seg->bump.load(std::memory_order_relaxed) < retiring) {
+            total += segment_size_;
+        }
+    }
+    return total;
+}
+
+// 释放操作 (Lock-Free Push)，放回指定的分片
+template<typename T>
+void LockFreeMemoryPool<T>::deallocate_at(T* ptr, size_t index) {
+    if (!owns(ptr)) {
+        this->overflow_deallocate(ptr);
+        return;
+    }
+    if (this->profiler_) {
+        this->profiler_->record_free(ptr);
+    }
+
+    this->poison_free(ptr, sizeof(Node));
+
+    // 将要释放的内存块转为 Node*
+    Node* new_node = reinterpret_cast<Node*>(ptr);
+    Shard& shard = shards_[index & shard_mask_];
+    TaggedPointer old_head;
+    TaggedPointer new_head;
+
+    new_head.ptr = new_node;
+    shard.available.fetch_add(1, std::memory_order_relaxed);
+
+    while (true) {
+        // 1. 原子地读取当前 head
+        old_head = shard.head.load();
+
+        // 2. 将新节点的 next 指向旧的 head
+        new_node->next = this->xor_link(old_head.ptr);
+
+        // 3. 准备新的 head
+        new_head.tag = old_head.tag + 1;
+
+        // 4. 尝试用 CAS 将新节点设为 head
+        if (shard.head.compare_exchange_weak(old_head, new_head)) {
+            // 成功！
+            return;
+        }
+
+        // 5. 有竞争，试着把对象直接交给一个正在分配的线程
+        this->note_contention();
+        if (eliminate_.load(std::memory_order_relaxed) && try_offer(new_node)) {
+            // 对象直接交给了分配方，没有进入列表
+            shard.available.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+#endif
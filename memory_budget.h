@@ -0,0 +1,191 @@
+#ifndef __MEMORY_BUDGET_H__
+#define __MEMORY_BUDGET_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <vector>
+
+// A byte budget shared by any number of pools.  Pools reserve memory from the budget before they grow
+// and hand it back when they free (or decommit) blocks.  When a reservation would push the budget over
+// its limit, every registered pool gets a pressure callback asking it to trim its free blocks.  If that
+// doesn't free enough memory, the reservation either fails right away or waits for memory to be
+// released, depending on the overflow policy.
+class MemoryBudget
+{
+  public:
+    enum class overflow_policy { fail, block };
+
+    // Called under memory pressure.  Returns the number of bytes the pool gave back to the budget.
+    typedef std::function<std::size_t()> pressure_callback_t;
+    typedef uint64_t registration_t;
+
+    struct stats_t {
+        std::size_t limit = 0;
+        std::size_t used = 0;
+        std::size_t peak = 0;
+        std::size_t pools = 0;
+        uint64_t reservations = 0;
+        uint64_t failed_reservations = 0;
+        uint64_t pressure_events = 0;
+        uint64_t bytes_trimmed = 0;
+    };
+
+    explicit MemoryBudget(std::size_t limit, overflow_policy policy = overflow_policy::fail,
+                          std::chrono::milliseconds max_wait = std::chrono::milliseconds(100)) noexcept :
+        m_limit(limit), m_policy(policy), m_max_wait(max_wait) { }
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // Reserve "bytes" from the budget.  Returns false if the budget is exhausted even after trimming
+    // (and, with overflow_policy::block, after waiting up to max_wait for memory to be released).
+    bool reserve(std::size_t bytes);
+
+    // Unconditionally account for "bytes", even if that puts the budget over its limit.  Used for memory
+    // a pool already owned before it was attached to the budget.
+    void charge(std::size_t bytes) noexcept;
+
+    void release(std::size_t bytes) noexcept;
+
+    registration_t register_pool(pressure_callback_t on_pressure);
+    void unregister_pool(registration_t id);
+
+    std::size_t limit() const noexcept { return m_limit; }
+    std::size_t used() const noexcept { return m_used.load(std::memory_order_relaxed); }
+    std::size_t available() const noexcept { std::size_t u = used(); return u < m_limit ? m_limit - u : 0; }
+    stats_t stats() const;
+
+  private:
+    bool try_reserve(std::size_t bytes) noexcept;
+    std::size_t relieve_pressure();
+    void update_peak(std::size_t used) noexcept;
+
+    const std::size_t m_limit;
+    const overflow_policy m_policy;
+    const std::chrono::milliseconds m_max_wait;
+
+    std::atomic<std::size_t> m_used { 0 };
+    std::atomic<std::size_t> m_peak { 0 };
+    std::atomic<uint64_t> m_reservations { 0 };
+    std::atomic<uint64_t> m_failed_reservations { 0 };
+    std::atomic<uint64_t> m_pressure_events { 0 };
+    std::atomic<uint64_t> m_bytes_trimmed { 0 };
+
+    // Registered pools.  The mutex is held while pressure callbacks run, so unregister_pool() (called from
+    // a pool's destructor) can't return while a callback into that pool is still in flight.
+    mutable std::mutex m_pools_lock;
+    std::vector<std::pair<registration_t, pressure_callback_t>> m_pools;
+    registration_t m_next_id = 1;
+
+    // Only used by overflow_policy::block
+    std::mutex m_wait_lock;
+    std::condition_variable m_released;
+    std::atomic<uint32_t> m_waiters { 0 };
+};
+
+inline bool
+MemoryBudget::try_reserve(std::size_t bytes) noexcept {
+    std::size_t orig = m_used.load(std::memory_order_relaxed);
+    do {
+        if (bytes > m_limit || orig > m_limit - bytes) return false;
+    }
+    while (!m_used.compare_exchange_weak(orig, orig + bytes, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    update_peak(orig + bytes);
+    return true;
+}
+
+inline void
+MemoryBudget::update_peak(std::size_t used) noexcept {
+    std::size_t peak = m_peak.load(std::memory_order_relaxed);
+    while (used > peak && !m_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed)) { }
+}
+
+inline bool
+MemoryBudget::reserve(std::size_t bytes) {
+    m_reservations.fetch_add(1, std::memory_order_relaxed);
+    if (try_reserve(bytes)) return true;
+
+    m_pressure_events.fetch_add(1, std::memory_order_relaxed);
+    if (relieve_pressure() > 0 && try_reserve(bytes)) return true;
+
+    if (m_policy == overflow_policy::block) {
+        std::unique_lock<std::mutex> lock(m_wait_lock);
+        m_waiters.fetch_add(1);
+        bool reserved = m_released.wait_for(lock, m_max_wait, [&] { return try_reserve(bytes); });
+        m_waiters.fetch_sub(1);
+        if (reserved) return true;
+    }
+
+    m_failed_reservations.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+inline void
+MemoryBudget::charge(std::size_t bytes) noexcept {
+    update_peak(m_used.fetch_add(bytes, std::memory_order_acq_rel) + bytes);
+}
+
+inline void
+MemoryBudget::release(std::size_t bytes) noexcept {
+    m_used.fetch_sub(bytes, std::memory_order_acq_rel);
+
+    // Waking waiters means taking a lock, so only do it when somebody is actually waiting.
+    if (m_waiters.load() != 0) {
+        std::lock_guard<std::mutex> lock(m_wait_lock);
+        m_released.notify_all();
+    }
+}
+
+inline std::size_t
+MemoryBudget::relieve_pressure() {
+    std::size_t trimmed = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_pools_lock);
+        for (auto &pool : m_pools) trimmed += pool.second();
+    }
+    m_bytes_trimmed.fetch_add(trimmed, std::memory_order_relaxed);
+    return trimmed;
+}
+
+inline MemoryBudget::registration_t
+MemoryBudget::register_pool(pressure_callback_t on_pressure) {
+    std::lock_guard<std::mutex> lock(m_pools_lock);
+    registration_t id = m_next_id++;
+    m_pools.emplace_back(id, std::move(on_pressure));
+    return id;
+}
+
+inline void
+MemoryBudget::unregister_pool(registration_t id) {
+    std::lock_guard<std::mutex> lock(m_pools_lock);
+    for (auto it = m_pools.begin(); it != m_pools.end(); ++it) {
+        if (it->first == id) {
+            m_pools.erase(it);
+            return;
+        }
+    }
+}
+
+inline MemoryBudget::stats_t
+MemoryBudget::stats() const {
+    stats_t s;
+    s.limit = m_limit;
+    s.used = m_used.load(std::memory_order_relaxed);
+    s.peak = m_peak.load(std::memory_order_relaxed);
+    s.reservations = m_reservations.load(std::memory_order_relaxed);
+    s.failed_reservations = m_failed_reservations.load(std::memory_order_relaxed);
+    s.pressure_events = m_pressure_events.load(std::memory_order_relaxed);
+    s.bytes_trimmed = m_bytes_trimmed.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(m_pools_lock);
+    s.pools = m_pools.size();
+    return s;
+}
+#endif
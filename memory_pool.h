@@ -10,6 +10,17 @@
 #include <iostream>
 #include <thread>
 #include <cassert>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory_budget.h"
+#include "pool_profiler.h"
+#include "pool_hardening.h"
 
 // Simulate a kernel level spin lock.
 template <class T> class spin_lock {
@@ -67,14 +78,74 @@ class MemoryPool
     template <class... Args> pointer new_element(Args&&... args);
     void delete_element(T* p);
 
+    // Object cache (Bonwick style slab caching).  Objects handed out by acquire() stay constructed while
+    // they sit on the cache list, so heavyweight types only pay for their constructor the first time a
+    // slot is used.  release() runs the reset hook instead of the destructor.  Cached objects are really
+    // destroyed only by trim_cache() or when the pool itself goes away.
+    typedef void (*reset_hook_t)(reference);
+    void set_reset_hook(reset_hook_t hook) { m_reset_hook = hook; }
+
+    // args are only used when no cached object is available and a new one has to be constructed
+    template <class... Args> pointer acquire(Args&&... args);
+    void release(pointer p);
+
+    // Destroys every cached object and returns its slot to the free list.  Returns the number of objects
+    // destroyed.
+    size_type trim_cache();
+
+    // Attach the pool to a MemoryBudget shared with other pools.  Block growth then reserves memory from the
+    // budget (allocate() returns nullptr when the budget refuses), and the budget calls trim() on the pool
+    // when it comes under pressure.  Blocks the pool already owns are charged to the new budget.
+    void set_budget(MemoryBudget *budget);
+
+    // Decommits every block whose slots are all free, destroying any cached objects that live in them, and
+    // gives the memory back to the OS and to the budget.  Decommitted blocks are reused before new ones are
+    // mapped.  Returns the number of bytes released; returns 0 right away if another thread is currently
+    // growing or trimming the pool.
+    size_type trim();
+
+    std::size_t committed_bytes() const noexcept { return m_committed_bytes.load(std::memory_order_relaxed); }
+
+    // Arena style bulk release of every object in the pool, for per-request or per-frame lifetimes.  All
+    // blocks are rewound so their slots are handed out again lazily by the bump pointer, which makes this
+    // O(blocks) for trivially destructible types.  For other types cached objects are always destroyed, and
+    // live objects are destroyed too when destroy_live is true (that part walks the slots).  Must not run
+    // concurrently with any other use of the pool.
+    void reset(bool destroy_live = true);
+
+    // Sample allocations into "profiler" (nullptr turns sampling off).  One profiler can be shared by
+    // several pools.
+    void set_profiler(PoolProfiler *profiler) noexcept { m_profiler = profiler; }
+
+    // Every block keeps a bitmap of its live slots (one bit per slot, set by allocate()/acquire() and
+    // cleared by deallocate()/release()).  Objects sitting in the object cache are not live.  The calls
+    // below walk the bitmaps and are meant for quiescent pools: an object allocated or freed while they run
+    // may or may not be seen.
+    template <class Fn> void for_each_live(Fn fn);
+    size_type live_objects() const noexcept;
+
+    // Destroys every live object and returns its slot to the free list.  Returns the number destroyed.
+    size_type destroy_live();
+
+    // What the destructor does about objects that were never freed.  report prints a one line summary to
+    // stderr, destroy runs their destructors (quietly), ignore does neither.
+    enum class leak_policy { report, destroy, ignore };
+    void set_leak_policy(leak_policy policy) noexcept { m_leak_policy = policy; }
+
+    // With _MEM_POOL_HARDEN_ deallocate() fills objects with POOL_FREE_FILL unless this is turned off.
+    // Does nothing in normal builds.  See pool_hardening.h.
+    void set_free_fill(bool fill) noexcept {
+#ifdef _MEM_POOL_HARDEN_
+        m_free_fill = fill;
+#endif
+        (void)fill;
+    }
+
   private:
     // Private types
     struct slot_t {
         T element;
         slot_t *next = nullptr;
-#ifdef _MEM_POOL_DEBUG_
-        bool allocated = false;
-#endif
     };
 
     struct slot_head_t {
@@ -82,26 +153,106 @@ class MemoryPool
         slot_t *node = nullptr;
     };
 
+    // Blocks are mmap()ed so trim() can hand their pages back with madvise() while the mapping itself
+    // stays valid for any thread still reading a stale free list head.  Each mapping is aligned to
+    // block_alignment() and starts with a pointer back to its allocated_block_t, so the block owning a
+    // slot is found by masking the slot's address.
     struct allocated_block_t {
         char *buffer = nullptr;
+        std::size_t bytes = 0;
+        slot_t *first = nullptr;
+        std::size_t slots = 0;
+        std::size_t carved = 0;     // Slots [0, carved) have been handed to the free list at least once
+        bool committed = false;
         allocated_block_t *next = nullptr;
+        // Live bits for slots [0, carved).  Bits past carved are stale and get cleared by carve().
+        std::unique_ptr<std::atomic<uint64_t>[]> live;
+        std::size_t trim_free = 0;  // Scratch space for trim()
+
+        ~allocated_block_t() {
+            if (buffer == nullptr) return;
+            POOL_UNPOISON(buffer, bytes);
+            munmap(buffer, bytes);
+        }
 
-        ~allocated_block_t() { operator delete(buffer); }
+        bool any_live() const noexcept {
+            for (std::size_t w = 0; w < (carved + 63) / 64; w++) {
+                uint64_t word = live[w].load(std::memory_order_relaxed);
+                if (w == carved / 64) word &= (uint64_t(1) << (carved % 64)) - 1;
+                if (word != 0) return true;
+            }
+            return false;
+        }
     };
 
     // Private variables
+    reset_hook_t m_reset_hook = nullptr;
     uint32_t m_allocate_block_threshold = 0;
     uint64_t m_max_size = 0;
-    slot_t *m_last_slot = nullptr;
     allocated_block_t *m_allocated_block_head = nullptr;
-    std::atomic<slot_head_t> m_free;
+    MemoryBudget *m_budget = nullptr;
+    MemoryBudget::registration_t m_budget_id = 0;
+    PoolProfiler *m_profiler = nullptr;
+    leak_policy m_leak_policy = leak_policy::report;
+#ifdef _MEM_POOL_HARDEN_
+    // Moves carry the key along with the free lists it encodes
+    uintptr_t m_link_key { pool_harden_key(this) };
+    bool m_free_fill = true;
+#endif
+    std::atomic<std::size_t> m_committed_bytes { 0 };
+    std::atomic<slot_head_t> m_free { slot_head_t() };
+    std::atomic<slot_head_t> m_cached { slot_head_t() };
     std::atomic_flag m_lock = ATOMIC_FLAG_INIT;
     std::chrono::system_clock::time_point m_last_allocate_block_time { std::chrono::system_clock::now() };
 
     // Private functions
     size_type pad_pointer(char *p, std::size_t align) const noexcept;
 
+    // Free list links go through these so _MEM_POOL_HARDEN_ can encode them
+    slot_t *next_of(const slot_t *s) const noexcept {
+#ifdef _MEM_POOL_HARDEN_
+        return reinterpret_cast<slot_t *>(reinterpret_cast<uintptr_t>(s->next) ^ m_link_key);
+#else
+        return s->next;
+#endif
+    }
+    void set_next(slot_t *s, slot_t *next) const noexcept {
+#ifdef _MEM_POOL_HARDEN_
+        s->next = reinterpret_cast<slot_t *>(reinterpret_cast<uintptr_t>(next) ^ m_link_key);
+#else
+        s->next = next;
+#endif
+    }
+    void check_link(const slot_t *s, const slot_t *next) const noexcept {
+#ifdef _MEM_POOL_HARDEN_
+        if (next != nullptr && !pool_plausible_link(reinterpret_cast<uintptr_t>(next), alignof(slot_t))) {
+            pool_corruption("MemoryPool", s);
+        }
+#endif
+        (void)s; (void)next;
+    }
+
+    slot_t *pop_slot(std::atomic<slot_head_t> &list);
+    void push_slot(std::atomic<slot_head_t> &list, slot_t *slot);
+    void push_chain(std::atomic<slot_head_t> &list, slot_t *first, slot_t *last);
+    slot_t *take_all(std::atomic<slot_head_t> &list);
+
+    static std::size_t block_bytes() noexcept;
+    static std::size_t block_alignment() noexcept;
+    static allocated_block_t *block_of(const slot_t *s) noexcept {
+        return *reinterpret_cast<allocated_block_t *const *>(reinterpret_cast<uintptr_t>(s) & ~(block_alignment() - 1));
+    }
+    void mark_live(slot_t *s) noexcept;
+    void mark_free(slot_t *s) noexcept;
+
+    // The destructor's work: leak policy, cached objects, blocks and budget.  Leaves an empty pool.
+    void clear() noexcept;
+
+    static std::size_t carve_batch() noexcept { return std::max<std::size_t>(1, (64 * 1024) / sizeof(slot_t)); }
+    void carve(allocated_block_t *block);
     bool allocate_block();
+    enum class growth { done, failed, needs_budget };
+    growth grow(bool &reserved);
 
     MemoryPool(const MemoryPool& memoryPool) noexcept = delete;
     MemoryPool& operator=(const MemoryPool& memoryPool) = delete;
@@ -119,6 +270,30 @@ MemoryPool<T, block_size>::MemoryPool() noexcept { }
 
 template <typename T, std::size_t block_size>
 MemoryPool<T, block_size>::~MemoryPool() noexcept {
+    clear();
+}
+
+template <typename T, std::size_t block_size>
+void
+MemoryPool<T, block_size>::clear() noexcept {
+    if (m_budget != nullptr) {
+        m_budget->unregister_pool(m_budget_id);
+        m_budget->release(m_committed_bytes.load());
+        m_budget = nullptr;
+    }
+
+    if (m_leak_policy != leak_policy::ignore) {
+        size_type leaked = live_objects();
+        if (leaked > 0 && m_leak_policy == leak_policy::report) {
+            fprintf(stderr, "MemoryPool: %zu objects (%zu bytes) still allocated at destruction, their destructors will not run\n",
+                    leaked, leaked * sizeof(value_type));
+        } else if (leaked > 0) {
+            destroy_live();
+        }
+    }
+
+    trim_cache();
+
     allocated_block_t *curr = m_allocated_block_head;
     allocated_block_t *next = nullptr;
     while (curr != nullptr) {
@@ -126,15 +301,36 @@ MemoryPool<T, block_size>::~MemoryPool() noexcept {
         delete curr;
         curr = next;
     }
+
+    m_allocated_block_head = nullptr;
+    m_max_size = 0;
+    m_free.store(slot_head_t());
+    m_cached.store(slot_head_t());
+    m_committed_bytes.store(0);
 }
 
 template <typename T, std::size_t block_size>
 MemoryPool<T, block_size>::MemoryPool(MemoryPool &&mp) noexcept :
-    m_max_size(mp.m_max_size), m_last_slot(nullptr), m_free(mp.m_free),
-    m_lock(mp.m_lock), m_allocated_block_head(nullptr) {
+    m_reset_hook(mp.m_reset_hook), m_max_size(mp.m_max_size), m_allocated_block_head(nullptr),
+    m_profiler(mp.m_profiler), m_leak_policy(mp.m_leak_policy), m_committed_bytes(mp.m_committed_bytes.load()), m_free(mp.m_free.load()), m_cached(mp.m_cached.load()) {
 
-    std::swap(m_last_slot, mp.m_last_slot);
     std::swap(m_allocated_block_head, mp.m_allocated_block_head);
+    mp.m_free.store(slot_head_t());
+    mp.m_cached.store(slot_head_t());
+    mp.m_committed_bytes.store(0);
+#ifdef _MEM_POOL_HARDEN_
+    m_link_key = mp.m_link_key;
+    m_free_fill = mp.m_free_fill;
+#endif
+
+    // The budget's pressure callback points at the old object, so register again from here
+    if (mp.m_budget != nullptr) {
+        MemoryBudget *budget = mp.m_budget;
+        budget->unregister_pool(mp.m_budget_id);
+        budget->release(m_committed_bytes.load());
+        mp.m_budget = nullptr;
+        set_budget(budget);
+    }
 }
 
 template <typename T, std::size_t block_size>
@@ -143,8 +339,15 @@ MemoryPool<T, block_size>::operator=(MemoryPool&& mp) {
     if (this == &mp)
         return *this;
 
-    m_last_slot = mp.m_last_slot;
-    mp.m_last_slot = nullptr;
+    // Let go of our own blocks (and their budget charge) first, as the destructor would
+    clear();
+
+    MemoryBudget *budget = mp.m_budget;
+    if (budget != nullptr) {
+        budget->unregister_pool(mp.m_budget_id);
+        budget->release(mp.m_committed_bytes.load());
+        mp.m_budget = nullptr;
+    }
 
     m_allocated_block_head = mp.m_allocated_block_head;
     mp.m_allocated_block_head = nullptr;
@@ -152,7 +355,24 @@ MemoryPool<T, block_size>::operator=(MemoryPool&& mp) {
     m_max_size = mp.m_max_size;
     mp.m_max_size = 0;
 
-    std::swap(m_free, mp.m_free);
+    m_reset_hook = mp.m_reset_hook;
+    m_profiler = mp.m_profiler;
+    m_leak_policy = mp.m_leak_policy;
+#ifdef _MEM_POOL_HARDEN_
+    m_link_key = mp.m_link_key;
+    m_free_fill = mp.m_free_fill;
+#endif
+
+    m_free.store(mp.m_free.load());
+    mp.m_free.store(slot_head_t());
+
+    m_cached.store(mp.m_cached.load());
+    mp.m_cached.store(slot_head_t());
+
+    m_committed_bytes.store(mp.m_committed_bytes.load());
+    mp.m_committed_bytes.store(0);
+
+    if (budget != nullptr) set_budget(budget);
 
     return *this;
 };
@@ -161,42 +381,82 @@ MemoryPool<T, block_size>::operator=(MemoryPool&& mp) {
 // See here: https://en.wikipedia.org/wiki/ABA_problem
 // The solution below works adequately.
 template <typename T, std::size_t block_size>
-inline typename MemoryPool<T, block_size>::pointer
-MemoryPool<T, block_size>::allocate(size_type n, const_pointer hint) {
-    slot_head_t next, orig = m_free.load();
+inline typename MemoryPool<T, block_size>::slot_t *
+MemoryPool<T, block_size>::pop_slot(std::atomic<slot_head_t> &list) {
+    slot_head_t next, orig = list.load();
     do {
-        while (orig.node == nullptr) {
-            if (!allocate_block()) return nullptr;
-            orig = m_free.load();
-        }
+        if (orig.node == nullptr) return nullptr;
         next.aba = orig.aba + 1;
-        next.node = orig.node->next;
+        // If orig is already stale this may read garbage, which is fine because the CAS will fail.  Only
+        // a link that made it through the CAS is checked.
+        next.node = next_of(orig.node);
     }
-    while (!atomic_compare_exchange_weak(&m_free, &orig, next));
+    while (!atomic_compare_exchange_weak(&list, &orig, next));
 
-#ifdef _MEM_POOL_DEBUG_
-    assert(orig.node->allocated == false);
-    orig.node->allocated = true;
-#endif
-    return reinterpret_cast<pointer>(orig.node);
+    check_link(orig.node, next.node);
+    return orig.node;
+}
+
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::push_slot(std::atomic<slot_head_t> &list, slot_t *slot) {
+    push_chain(list, slot, slot);
+}
+
+// Splices an already linked chain of slots onto the front of a free list.
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::push_chain(std::atomic<slot_head_t> &list, slot_t *first, slot_t *last) {
+    slot_head_t next, orig = list.load();
+    do {
+        set_next(last, orig.node);
+        next.aba = orig.aba + 1;
+        next.node = first;
+    }
+    while (!atomic_compare_exchange_weak(&list, &orig, next));
+}
+
+// Detaches the whole list.  The tag keeps counting up so a stale head can never match again.
+template <typename T, std::size_t block_size>
+inline typename MemoryPool<T, block_size>::slot_t *
+MemoryPool<T, block_size>::take_all(std::atomic<slot_head_t> &list) {
+    slot_head_t next, orig = list.load();
+    do {
+        if (orig.node == nullptr) return nullptr;
+        next.aba = orig.aba + 1;
+        next.node = nullptr;
+    }
+    while (!atomic_compare_exchange_weak(&list, &orig, next));
+
+    return orig.node;
+}
+
+template <typename T, std::size_t block_size>
+inline typename MemoryPool<T, block_size>::pointer
+MemoryPool<T, block_size>::allocate(size_type n, const_pointer hint) {
+    slot_t *slot;
+    while ((slot = pop_slot(m_free)) == nullptr) {
+        if (!allocate_block()) return nullptr;
+    }
+
+    mark_live(slot);
+    POOL_UNPOISON(slot, sizeof(value_type));
+    if (m_profiler != nullptr && m_profiler->should_sample()) m_profiler->record_alloc(slot, sizeof(value_type));
+    return reinterpret_cast<pointer>(slot);
 }
 
 template <typename T, std::size_t block_size>
 inline void
 MemoryPool<T, block_size>::deallocate(pointer p, size_type n)
 {
-    slot_head_t next, orig = m_free.load();
+    if (m_profiler != nullptr) m_profiler->record_free(p);
     slot_t *tp = reinterpret_cast<slot_t *>(p);
-#ifdef _MEM_POOL_DEBUG_
-    assert(tp->allocated == true);
-    tp->allocated = false;
+    mark_free(tp);
+#ifdef _MEM_POOL_HARDEN_
+    if (m_free_fill) memset(static_cast<void *>(p), POOL_FREE_FILL, sizeof(value_type));
 #endif
-    do {
-        tp->next = orig.node;
-        next.aba = orig.aba + 1;
-        next.node = tp;
-    }
-    while (!atomic_compare_exchange_weak(&m_free, &orig, next));
+    POOL_POISON(p, sizeof(value_type));
+    push_slot(m_free, tp);
 }
 
 template <typename T, std::size_t block_size>
@@ -232,70 +492,377 @@ MemoryPool<T, block_size>::delete_element(pointer p) {
     }
 }
 
+template <typename T, std::size_t block_size>
+template <class... Args>
+inline typename MemoryPool<T, block_size>::pointer
+MemoryPool<T, block_size>::acquire(Args&&... args) {
+    slot_t *slot = pop_slot(m_cached);
+    if (slot == nullptr) return new_element(std::forward<Args>(args)...);
+
+    mark_live(slot);
+    POOL_UNPOISON(slot, sizeof(value_type));
+    if (m_profiler != nullptr && m_profiler->should_sample()) m_profiler->record_alloc(slot, sizeof(value_type));
+    return reinterpret_cast<pointer>(slot);
+}
+
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::release(pointer p) {
+    if (p == nullptr) return;
+    if (m_profiler != nullptr) m_profiler->record_free(p);
+    if (m_reset_hook != nullptr) m_reset_hook(*p);
+
+    slot_t *tp = reinterpret_cast<slot_t *>(p);
+    mark_free(tp);
+    POOL_POISON(p, sizeof(value_type));
+    push_slot(m_cached, tp);
+}
+
+template <typename T, std::size_t block_size>
+inline typename MemoryPool<T, block_size>::size_type
+MemoryPool<T, block_size>::trim_cache() {
+    size_type count = 0;
+    slot_t *slot;
+    while ((slot = pop_slot(m_cached)) != nullptr) {
+        POOL_UNPOISON(slot, sizeof(value_type));
+        reinterpret_cast<pointer>(slot)->~value_type();
+        push_slot(m_free, slot);
+        count++;
+    }
+    return count;
+}
+
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::set_budget(MemoryBudget *budget) {
+    if (m_budget != nullptr) {
+        m_budget->unregister_pool(m_budget_id);
+        m_budget->release(m_committed_bytes.load());
+    }
+
+    m_budget = budget;
+    if (m_budget != nullptr) {
+        m_budget->charge(m_committed_bytes.load());
+        m_budget_id = m_budget->register_pool([this]() { return trim(); });
+    }
+}
+
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::mark_live(slot_t *s) noexcept {
+    allocated_block_t *block = block_of(s);
+    std::size_t i = s - block->first;
+    uint64_t bit = uint64_t(1) << (i % 64);
+    uint64_t orig = block->live[i / 64].fetch_or(bit, std::memory_order_relaxed);
+#ifdef _MEM_POOL_DEBUG_
+    assert((orig & bit) == 0);
+#endif
+    (void)orig;
+}
+
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::mark_free(slot_t *s) noexcept {
+    allocated_block_t *block = block_of(s);
+    std::size_t i = s - block->first;
+    uint64_t bit = uint64_t(1) << (i % 64);
+    uint64_t orig = block->live[i / 64].fetch_and(~bit, std::memory_order_relaxed);
+#ifdef _MEM_POOL_DEBUG_
+    assert((orig & bit) != 0);
+#endif
+    (void)orig;
+}
+
+template <typename T, std::size_t block_size>
+template <class Fn>
+inline void
+MemoryPool<T, block_size>::for_each_live(Fn fn) {
+    for (allocated_block_t *b = m_allocated_block_head; b != nullptr; b = b->next) {
+        if (!b->committed) continue;
+        for (std::size_t w = 0; w < (b->carved + 63) / 64; w++) {
+            uint64_t word = b->live[w].load(std::memory_order_relaxed);
+            if (w == b->carved / 64) word &= (uint64_t(1) << (b->carved % 64)) - 1;
+            while (word != 0) {
+                std::size_t i = w * 64 + __builtin_ctzll(word);
+                word &= word - 1;
+                fn(*reinterpret_cast<pointer>(&b->first[i]));
+            }
+        }
+    }
+}
+
+template <typename T, std::size_t block_size>
+inline typename MemoryPool<T, block_size>::size_type
+MemoryPool<T, block_size>::live_objects() const noexcept {
+    size_type count = 0;
+    for (allocated_block_t *b = m_allocated_block_head; b != nullptr; b = b->next) {
+        if (!b->committed) continue;
+        for (std::size_t w = 0; w < (b->carved + 63) / 64; w++) {
+            uint64_t word = b->live[w].load(std::memory_order_relaxed);
+            if (w == b->carved / 64) word &= (uint64_t(1) << (b->carved % 64)) - 1;
+            count += __builtin_popcountll(word);
+        }
+    }
+    return count;
+}
+
+template <typename T, std::size_t block_size>
+inline typename MemoryPool<T, block_size>::size_type
+MemoryPool<T, block_size>::destroy_live() {
+    size_type count = 0;
+    for_each_live([this, &count](reference x) {
+        destroy(&x);
+        deallocate(&x);
+        count++;
+    });
+    return count;
+}
+
+template <typename T, std::size_t block_size>
+inline typename MemoryPool<T, block_size>::size_type
+MemoryPool<T, block_size>::trim() {
+    // Never wait here.  trim() is called by the budget from the growth paths of any pool sharing it,
+    // including our own allocate_block(), possibly while another thread holds the lock.
+    if (m_lock.test_and_set(std::memory_order_acquire)) return 0;
+
+    // A block with a live bit set certainly can't be released.  If every block has one, we're done
+    // without touching the free lists.
+    bool candidates = false;
+    for (allocated_block_t *b = m_allocated_block_head; b != nullptr; b = b->next) {
+        b->trim_free = 0;
+        candidates = candidates || (b->committed && !b->any_live());
+    }
+    if (!candidates) {
+        m_lock.clear(std::memory_order_release);
+        return 0;
+    }
+
+    // The bitmap alone isn't enough: a slot that was just popped but isn't marked yet looks free.  So take
+    // both free lists private and count what is really on them.  Allocating threads that find the lists
+    // empty will wait on the lock in allocate_block() and pick up whatever we put back.
+    slot_t *free = take_all(m_free);
+    slot_t *cached = take_all(m_cached);
+
+    for (slot_t *s = free; s != nullptr; s = next_of(s)) {
+        check_link(s, next_of(s));
+        block_of(s)->trim_free++;
+    }
+    for (slot_t *s = cached; s != nullptr; s = next_of(s)) {
+        check_link(s, next_of(s));
+        block_of(s)->trim_free++;
+    }
+
+    auto releasing = [](const allocated_block_t *b) { return b->committed && b->trim_free == b->carved; };
+
+    // Put back every slot that doesn't live in a block we're about to release
+    auto keep = [&](std::atomic<slot_head_t> &list, slot_t *s, bool destroy_cached) {
+        slot_t *first = nullptr, *last = nullptr;
+        while (s != nullptr) {
+            slot_t *next = next_of(s);
+            if (!releasing(block_of(s))) {
+                set_next(s, first);
+                first = s;
+                if (last == nullptr) last = s;
+            } else if (destroy_cached) {
+                POOL_UNPOISON(s, sizeof(value_type));
+                reinterpret_cast<pointer>(s)->~value_type();
+            }
+            s = next;
+        }
+        if (first != nullptr) push_chain(list, first, last);
+    };
+    keep(m_cached, cached, true);
+    keep(m_free, free, false);
+
+    size_type released = 0;
+    for (allocated_block_t *b = m_allocated_block_head; b != nullptr; b = b->next) {
+        if (!releasing(b)) continue;
+        madvise(b->buffer, b->bytes, MADV_DONTNEED);
+        b->committed = false;
+        b->carved = 0;
+        released += b->bytes;
+    }
+
+    if (released > 0) {
+        m_committed_bytes.fetch_sub(released);
+        if (m_budget != nullptr) m_budget->release(released);
+    }
+
+    m_lock.clear(std::memory_order_release);
+    return released;
+}
+
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::reset(bool destroy_live) {
+    spin_lock<std::atomic_flag> lock(m_lock);
+
+    take_all(m_free);
+    slot_t *cached = take_all(m_cached);
+
+    if (!std::is_trivially_destructible<value_type>::value) {
+        for (slot_t *s = cached; s != nullptr; s = next_of(s)) {
+            POOL_UNPOISON(s, sizeof(value_type));
+            reinterpret_cast<pointer>(s)->~value_type();
+        }
+        if (destroy_live) for_each_live([this](reference x) { destroy(&x); });
+    }
+
+    // The live bits of the rewound slots are cleared by carve() as the slots come back into use
+    for (allocated_block_t *b = m_allocated_block_head; b != nullptr; b = b->next) {
+        if (m_profiler != nullptr) m_profiler->forget(b->buffer, b->buffer + b->bytes);
+        b->carved = 0;
+    }
+}
+
+// Hands the next batch of never-used slots in "block" to the free list.  Carving lazily keeps untouched
+// pages from being faulted in, and lets reset() rewind a block in O(1).
+template <typename T, std::size_t block_size>
+inline void
+MemoryPool<T, block_size>::carve(allocated_block_t *block) {
+    std::size_t count = std::min(block->slots - block->carved, carve_batch());
+    slot_t *first = &block->first[block->carved];
+
+    for (std::size_t i = 0; i < count; i++) {
+        set_next(&first[i], &first[i + 1]);
+        POOL_POISON(&first[i], sizeof(value_type));
+    }
+
+    for (std::size_t i = block->carved; i < block->carved + count; ) {
+        std::size_t bits = std::min<std::size_t>(64 - i % 64, block->carved + count - i);
+        uint64_t mask = bits == 64 ? ~uint64_t(0) : ((uint64_t(1) << bits) - 1) << (i % 64);
+        block->live[i / 64].fetch_and(~mask, std::memory_order_relaxed);
+        i += bits;
+    }
+    block->carved += count;
+
+    // Slots freed by other threads may have landed on m_free since we checked, so splice rather than store
+    push_chain(m_free, first, &first[count - 1]);
+}
+
+template <typename T, std::size_t block_size>
+inline std::size_t
+MemoryPool<T, block_size>::block_bytes() noexcept {
+    static const std::size_t bytes = [] {
+        std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        std::size_t header = sizeof(allocated_block_t *) + alignof(slot_t);
+        return ((header + block_size * sizeof(slot_t) + page - 1) / page) * page;
+    }();
+    return bytes;
+}
+
+template <typename T, std::size_t block_size>
+inline std::size_t
+MemoryPool<T, block_size>::block_alignment() noexcept {
+    static const std::size_t alignment = [] {
+        std::size_t a = 1;
+        while (a < block_bytes()) a <<= 1;
+        return a;
+    }();
+    return alignment;
+}
+
+// Refills the free list: carves more slots out of a committed block if there are any left, otherwise
+// recommits a block trim() released, otherwise maps a new one.  The budget is reserved without holding
+// m_lock: with overflow_policy::block reserve() may wait up to max_wait, and every other thread that
+// needs the lock would spin all that time.
 template <typename T, std::size_t block_size>
 inline bool
 MemoryPool<T, block_size>::allocate_block() {
+    bool reserved = false;
+    for (;;) {
+        growth result = grow(reserved);
+        if (result != growth::needs_budget) {
+            // Someone else refilled the free list while we were reserving
+            if (reserved) m_budget->release(block_bytes());
+            return result == growth::done;
+        }
+        if (!m_budget->reserve(block_bytes())) return false;
+        reserved = true;
+    }
+}
+
+// allocate_block() under m_lock.  "reserved" means a block's worth of budget is already held for us; it is
+// cleared when the reservation gets used.
+template <typename T, std::size_t block_size>
+inline typename MemoryPool<T, block_size>::growth
+MemoryPool<T, block_size>::grow(bool &reserved) {
     spin_lock<std::atomic_flag> lock(m_lock);
     // After coming out of the lock, if the condition that got us here is now false, we can safely return
     // and do nothing.  This means another thread beat us to the allocation.  If we don't do this, we could
     // potentially allocate an entire block_size of memory that would never get used.
-    if (m_free.load().node != nullptr) { return true; }
+    if (m_free.load().node != nullptr) { return growth::done; }
+
+    allocated_block_t *block = m_allocated_block_head;
+    while (block != nullptr && !(block->committed && block->carved < block->slots)) block = block->next;
+    if (block != nullptr) {
+        carve(block);
+        return growth::done;
+    }
 
     std::chrono::system_clock::time_point now { std::chrono::system_clock::now() };
     if (m_max_size > 0 &&
        (now <= m_last_allocate_block_time + std::chrono::seconds(m_allocate_block_threshold))) {
-        return false;
+        return growth::failed;
     }
 
-#ifdef _MEM_POOL_DEBUG_
-    fprintf(stdout, "Allocating new block of %lu nodes\n", block_size);
-    fflush(stdout);
-#endif
-
-    m_last_allocate_block_time = std::chrono::system_clock::now();
-
-    allocated_block_t *new_block = new allocated_block_t();
-    new_block->next = m_allocated_block_head;
-    m_allocated_block_head = new_block;
-
-    new_block->buffer = reinterpret_cast<char *>(operator new(block_size * sizeof(slot_t)));
-
-    // Pad block body to satisfy the alignment requirements for elements
-    char *body = new_block->buffer + sizeof(slot_t *);
-    std::size_t body_padding = pad_pointer(body, alignof(slot_t));
-    char *start = body + body_padding;
-    char *end = (new_block->buffer + (block_size * sizeof(slot_t)));
-
-    // Update the old last slot's next ptr to point to the first slot of the new block
-    if (m_last_slot)
-        m_last_slot->next = reinterpret_cast<slot_t *>(start);
+    // Bring a block that trim() decommitted back before mapping a new one
+    block = m_allocated_block_head;
+    while (block != nullptr && block->committed) block = block->next;
 
-    // We'll never get exactly the number of objects requested, but it should be close.
-    for (; (start + sizeof(slot_t)) < end; start += sizeof(slot_t)) {
-        reinterpret_cast<slot_t *>(start)->next = reinterpret_cast<slot_t *>(start + sizeof(slot_t));
-        m_max_size++;
+    std::size_t bytes = block_bytes();
+    if (m_budget != nullptr) {
+        if (!reserved) return growth::needs_budget;
+        reserved = false;
     }
 
-    // "start" should now point to one byte past the end of the last slot.  Subtract the size of slot_t from it to
-    // get a pointer to the beginning of the last slot.
-    m_last_slot = reinterpret_cast<slot_t *>(start - sizeof(slot_t));
-    m_last_slot->next = nullptr;
+    if (block == nullptr) {
+#ifdef _MEM_POOL_DEBUG_
+        fprintf(stdout, "Allocating new block of %lu nodes\n", block_size);
+        fflush(stdout);
+#endif
+        // Over-map by the alignment and unmap whatever sticks out on either side
+        std::size_t align = block_alignment();
+        void *raw = mmap(nullptr, bytes + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            if (m_budget != nullptr) m_budget->release(bytes);
+            return growth::failed;
+        }
+        char *lo = reinterpret_cast<char *>(raw);
+        char *buffer = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(lo) + align - 1) & ~(align - 1));
+        if (buffer > lo) munmap(lo, buffer - lo);
+        munmap(buffer + bytes, (lo + bytes + align) - (buffer + bytes));
+
+        block = new allocated_block_t();
+        block->buffer = buffer;
+        block->bytes = bytes;
+
+        // Pad block body to satisfy the alignment requirements for elements
+        char *body = block->buffer + sizeof(allocated_block_t *);
+        block->first = reinterpret_cast<slot_t *>(body + pad_pointer(body, alignof(slot_t)));
+        // We'll never get exactly the number of objects requested, but it should be close.
+        block->slots = (block->buffer + bytes - reinterpret_cast<char *>(block->first)) / sizeof(slot_t);
+        block->live.reset(new std::atomic<uint64_t>[(block->slots + 63) / 64]);
+
+        block->next = m_allocated_block_head;
+        m_allocated_block_head = block;
+        m_max_size += block->slots;
+    }
 
-    // If there's anything in the free list, make sure it doesn't get lost when we reset m_free
-    if (m_free.load().node != nullptr)
-        m_last_slot->next = m_free.load().node;
+    m_last_allocate_block_time = std::chrono::system_clock::now();
 
-    // Update the head of the free list to point to the start of the new block
-    slot_head_t first;
-    first.aba = 0;
-    first.node = reinterpret_cast<slot_t *>(body + body_padding);
-    m_free.store(first);
+    // The back pointer is (re)written here because trim()'s madvise() zeroes it
+    *reinterpret_cast<allocated_block_t **>(block->buffer) = block;
+    block->committed = true;
+    block->carved = 0;
+    m_committed_bytes.fetch_add(bytes);
+    carve(block);
 
 #ifdef _MEM_POOL_DEBUG_
     fprintf(stdout, "Done allocating new block of %lu nodes\n", block_size);
     fflush(stdout);
 #endif
-    
-    return true;
+
+    return growth::done;
 }
 #endif
@@ -0,0 +1,33 @@
+#include <cstdio>
+#include "persistent_pool.h"
+
+// A linked list that survives restarts: run the demo several times and the list keeps growing.
+struct Node {
+    int value = 0;
+    offset_ptr<Node> next;
+};
+
+int main() {
+    PersistentPool<Node> pool("persistent_demo.pool", 1000);
+
+    if (pool.reattached()) {
+        printf("Reattached to an existing image (%s shutdown)\n", pool.was_clean_shutdown() ? "clean" : "unclean");
+    } else {
+        printf("Created a new image\n");
+    }
+
+    // Push one node at the front of the list kept in the root slot
+    Node *head = pool.root();
+    Node *node = pool.new_element();
+    if (node == nullptr) {
+        printf("Pool is full\n");
+        return 1;
+    }
+    node->value = head != nullptr ? head->value + 1 : 0;
+    node->next = head;
+    pool.set_root(node);
+
+    for (Node *n = pool.root(); n != nullptr; n = n->next.get()) printf("%d ", n->value);
+    printf("\n");
+    return 0;
+}
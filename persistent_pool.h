@@ -0,0 +1,305 @@
+#ifndef __PERSISTENT_POOL_H__
+#define __PERSISTENT_POOL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <chrono>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Self-relative pointer.  It stores the distance from itself to its target, so a structure linked with
+// offset_ptrs is still valid when the region it lives in is mapped at a different address, e.g. after
+// a restart or in another process.  Like boost::interprocess, a distance of 1 encodes nullptr (an object
+// can never point one byte past its own start).
+template <typename T>
+class offset_ptr
+{
+  public:
+    offset_ptr() noexcept : m_offset(1) { }
+    offset_ptr(T *p) noexcept { set(p); }
+    offset_ptr(const offset_ptr &other) noexcept { set(other.get()); }
+    offset_ptr& operator=(const offset_ptr &other) noexcept { set(other.get()); return *this; }
+    offset_ptr& operator=(T *p) noexcept { set(p); return *this; }
+
+    T *get() const noexcept {
+        return m_offset == 1 ? nullptr : reinterpret_cast<T *>(reinterpret_cast<intptr_t>(this) + m_offset);
+    }
+
+    T *operator->() const noexcept { return get(); }
+    T &operator*() const noexcept { return *get(); }
+    explicit operator bool() const noexcept { return m_offset != 1; }
+
+  private:
+    void set(T *p) noexcept {
+        m_offset = p == nullptr ? 1 : reinterpret_cast<intptr_t>(p) - reinterpret_cast<intptr_t>(this);
+    }
+
+    intptr_t m_offset;
+};
+
+// A fixed capacity pool whose slots live in an mmap()ed file.  The free list is made of slot indices,
+// never addresses, so the file can be mapped again after a restart and the pool picks up exactly where
+// it left off: objects allocated before the restart are still there, and the free list is intact.
+// Restarting costs one mmap() instead of rebuilding every object.
+//
+// T must not hold raw pointers or other process-local state.  Link pooled objects with offset_ptr or
+// with the offsets from to_offset()/from_offset(), and use set_root()/root() to find the entry point of
+// your data structure after reattaching.  Destructors never run, so T must be trivially destructible.
+//
+// The image is only as consistent as the moment the process stopped.  was_clean_shutdown() tells you
+// whether the previous owner went through the destructor (which msync()s the file) or crashed.
+template <typename T>
+class PersistentPool
+{
+  public:
+    typedef T               value_type;
+    typedef T*              pointer;
+    typedef std::size_t     size_type;
+    typedef uint64_t        offset_type;
+
+    // Bump this whenever header_t or slot_t changes, so old images are rejected instead of misread.
+    static const uint32_t layout_version = 1;
+
+    // Opens "path", creating and sizing it for "capacity" objects if it doesn't exist yet.  An existing
+    // image is reattached if its header matches this layout, type size and capacity; otherwise the
+    // constructor throws std::runtime_error.
+    PersistentPool(const std::string &path, size_type capacity);
+    ~PersistentPool() noexcept;
+
+    PersistentPool(const PersistentPool&) = delete;
+    PersistentPool& operator=(const PersistentPool&) = delete;
+
+    pointer allocate();
+    void deallocate(pointer p);
+
+    template <class... Args> pointer new_element(Args&&... args);
+    void delete_element(pointer p);
+
+    // Position independent handles for pooled objects.  0 is the null offset.
+    offset_type to_offset(const T *p) const noexcept;
+    pointer from_offset(offset_type offset) const noexcept;
+
+    // The root object is how an application finds its data again after reattaching.
+    void set_root(pointer p) noexcept { m_header->root.store(to_offset(p)); }
+    pointer root() const noexcept { return from_offset(m_header->root.load()); }
+
+    bool reattached() const noexcept { return m_reattached; }
+    bool was_clean_shutdown() const noexcept { return m_was_clean; }
+    size_type capacity() const noexcept { return m_header->capacity; }
+
+    // Flushes the image to the file.  Blocks until the write-back is done.
+    void sync() noexcept { msync(m_base, m_bytes, MS_SYNC); }
+
+  protected:
+    struct slot_t {
+        T element;
+        uint32_t next;      // Index + 1 of the next free slot, 0 ends the list
+    };
+
+    struct header_t {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t slot_size;
+        uint64_t capacity;
+        uint64_t slots_offset;
+        // Free list head: low 32 bits are the slot index + 1, high 32 bits an ABA tag.  A single 64 bit
+        // word keeps the CAS lock-free even where 16 byte atomics aren't.
+        std::atomic<uint64_t> free;
+        // Slots [0, bump) have been handed out at least once; the rest are carved lazily.
+        std::atomic<uint64_t> bump;
+        std::atomic<uint64_t> root;
+        std::atomic<uint32_t> clean;
+    };
+
+    static const uint64_t header_magic = 0x4c4f4f5050504d4dULL;     // "MMPPPOOL" on little endian
+
+    // Maps "fd" and either initializes a fresh image or validates an existing one.  Used by the
+    // constructor, and by pools that bring their own file descriptor.  With may_initialize false an empty
+    // file is assumed to be in the middle of being set up by another process, and we wait for it.
+    PersistentPool() noexcept { }
+    void attach(int fd, size_type capacity, bool may_initialize = true);
+
+    slot_t *slot(uint32_t index) const noexcept { return reinterpret_cast<slot_t *>(m_slots) + index; }
+    uint32_t index_of(const T *p) const noexcept {
+        return static_cast<uint32_t>(reinterpret_cast<const slot_t *>(p) - reinterpret_cast<const slot_t *>(m_slots));
+    }
+
+    int m_fd = -1;
+    char *m_base = nullptr;
+    char *m_slots = nullptr;
+    std::size_t m_bytes = 0;
+    header_t *m_header = nullptr;
+    bool m_reattached = false;
+    bool m_was_clean = true;
+};
+
+template <typename T>
+PersistentPool<T>::PersistentPool(const std::string &path, size_type capacity) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) throw std::runtime_error("PersistentPool: cannot open " + path);
+    attach(fd, capacity);
+}
+
+template <typename T>
+void
+PersistentPool<T>::attach(int fd, size_type capacity, bool may_initialize) {
+    static_assert(std::is_trivially_destructible<T>::value, "T must be trivially destructible.");
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "The free list head must be a lock-free 64 bit atomic.");
+
+    if (capacity == 0 || capacity >= UINT32_MAX) {
+        close(fd);
+        throw std::runtime_error("PersistentPool: capacity must be between 1 and 2^32 - 2.");
+    }
+
+    m_fd = fd;
+    std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    std::size_t slots_offset = ((sizeof(header_t) + alignof(slot_t) - 1) / alignof(slot_t)) * alignof(slot_t);
+    m_bytes = ((slots_offset + capacity * sizeof(slot_t) + page - 1) / page) * page;
+
+    // Whoever initializes the image gets up to a second to size it and write the header
+    const int init_wait_ms = 1000;
+
+    struct stat st;
+    for (int waited = 0; ; waited++) {
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("PersistentPool: fstat failed.");
+        }
+        if (st.st_size != 0 || may_initialize) break;
+        if (waited == init_wait_ms) {
+            close(fd);
+            throw std::runtime_error("PersistentPool: timed out waiting for the image to be initialized.");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bool fresh = st.st_size == 0;
+    if (fresh && ftruncate(fd, static_cast<off_t>(m_bytes)) != 0) {
+        close(fd);
+        throw std::runtime_error("PersistentPool: cannot size the backing file.");
+    }
+    if (!fresh && static_cast<std::size_t>(st.st_size) < m_bytes) {
+        close(fd);
+        throw std::runtime_error("PersistentPool: backing file is too small for this capacity.");
+    }
+
+    void *base = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("PersistentPool: mmap failed.");
+    }
+    m_base = reinterpret_cast<char *>(base);
+    m_slots = m_base + slots_offset;
+    m_header = reinterpret_cast<header_t *>(m_base);
+
+    if (fresh) {
+        // The file is zero filled, so the atomics already hold 0.  Write the magic last so a crash in the
+        // middle of initialization leaves an image that is rejected rather than half trusted.
+        m_header->version = layout_version;
+        m_header->slot_size = sizeof(slot_t);
+        m_header->capacity = capacity;
+        m_header->slots_offset = slots_offset;
+        m_header->clean.store(0);
+        __atomic_store_n(&m_header->magic, header_magic, __ATOMIC_RELEASE);
+        return;
+    }
+
+    for (int waited = 0; __atomic_load_n(&m_header->magic, __ATOMIC_ACQUIRE) == 0 && waited < init_wait_ms; waited++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (m_header->magic != header_magic || m_header->version != layout_version ||
+        m_header->slot_size != sizeof(slot_t) || m_header->capacity != capacity ||
+        m_header->slots_offset != slots_offset) {
+        munmap(m_base, m_bytes);
+        close(fd);
+        m_base = nullptr;
+        throw std::runtime_error("PersistentPool: existing image doesn't match this layout.");
+    }
+
+    m_reattached = true;
+    m_was_clean = m_header->clean.exchange(0) != 0;
+}
+
+template <typename T>
+PersistentPool<T>::~PersistentPool() noexcept {
+    if (m_base == nullptr) return;
+
+    m_header->clean.store(1);
+    sync();
+    munmap(m_base, m_bytes);
+    close(m_fd);
+}
+
+// Same tagged head scheme as LockFreeMemoryPool, only with indices instead of pointers.
+template <typename T>
+inline typename PersistentPool<T>::pointer
+PersistentPool<T>::allocate() {
+    uint64_t orig = m_header->free.load(std::memory_order_acquire);
+    while ((orig & 0xffffffffULL) != 0) {
+        uint32_t index = static_cast<uint32_t>(orig & 0xffffffffULL) - 1;
+        uint64_t next = ((orig >> 32) + 1) << 32 | slot(index)->next;
+        if (m_header->free.compare_exchange_weak(orig, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return &slot(index)->element;
+        }
+    }
+
+    // Nothing recycled, carve a never-used slot
+    uint64_t bump = m_header->bump.load(std::memory_order_relaxed);
+    do {
+        if (bump >= m_header->capacity) return nullptr;
+    }
+    while (!m_header->bump.compare_exchange_weak(bump, bump + 1, std::memory_order_relaxed));
+
+    return &slot(static_cast<uint32_t>(bump))->element;
+}
+
+template <typename T>
+inline void
+PersistentPool<T>::deallocate(pointer p) {
+    uint32_t index = index_of(p);
+    uint64_t orig = m_header->free.load(std::memory_order_acquire);
+    uint64_t next;
+    do {
+        slot(index)->next = static_cast<uint32_t>(orig & 0xffffffffULL);
+        next = ((orig >> 32) + 1) << 32 | (index + 1);
+    }
+    while (!m_header->free.compare_exchange_weak(orig, next, std::memory_order_acq_rel, std::memory_order_acquire));
+}
+
+template <typename T>
+template <class... Args>
+inline typename PersistentPool<T>::pointer
+PersistentPool<T>::new_element(Args&&... args) {
+    pointer result = allocate();
+    if (result != nullptr) new (result) T (std::forward<Args>(args)...);
+    return result;
+}
+
+template <typename T>
+inline void
+PersistentPool<T>::delete_element(pointer p) {
+    if (p != nullptr) deallocate(p);
+}
+
+template <typename T>
+inline typename PersistentPool<T>::offset_type
+PersistentPool<T>::to_offset(const T *p) const noexcept {
+    return p == nullptr ? 0 : static_cast<offset_type>(reinterpret_cast<const char *>(p) - m_base);
+}
+
+template <typename T>
+inline typename PersistentPool<T>::pointer
+PersistentPool<T>::from_offset(offset_type offset) const noexcept {
+    return offset == 0 ? nullptr : reinterpret_cast<pointer>(m_base + offset);
+}
+#endif
@@ -0,0 +1,540 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pool_hardening.h"
+
+// Policy-based object pool.  The hand-written pools in this repository share a core made of four decisions,
+// and Pool<T, Storage, FreeList, Growth, Threading> makes each of them a template parameter:
+//
+//   Storage    where a free slot keeps its link: overlay_link (on top of the object, slots are exactly
+//              sizeof(T)) or inline_link (after the object, so a free object's bytes survive, which is
+//              what MemoryPool's object cache relies on).
+//   FreeList   how freed slots are recycled: tagged_free_list (lock-free stack, 16 byte {pointer, tag}
+//              CAS against ABA), locked_free_list (plain stack behind a spin lock) or
+//              sharded_free_list<Inner, N> (N cache line padded Inner lists picked by CPU, with stealing).
+//   Growth     where never-used slots come from: fixed_growth (one mmap()ed region, nullptr once it is
+//              used up) or segmented_growth<N> (a new region published with a CAS whenever the last one is
+//              used up, nullptr once N regions are).  Both carve slots lazily with a bump index, so untouched
+//              memory is never faulted in.
+//   Threading  multi_thread (std::atomic, spin lock) or single_thread (plain loads and stores, no lock).
+//
+// Policies are plain classes with member templates; everything is inline and nothing is virtual, so a
+// Pool costs exactly what its policies cost.  Pools honour the hardening helpers like the others: ASan
+// poisoning of free slots, and under _MEM_POOL_HARDEN_ encoded links and a fill pattern on free.
+//
+// Only that core is covered.  Budgets, trim(), overflow, elimination, flat combining, live bitmaps and
+// profiler hooks exist in the hand-written pools alone, so none of them is a Pool configuration, and a
+// Pool keeps every region it maps until it is destroyed.
+//
+// Pool is a separate implementation, not the code behind the other pools: MemoryPool, MutexMemoryPool,
+// LockFreeMemoryPool, PersistentPool and SharedMemoryPool do not instantiate it, and a fix to one of them
+// doesn't reach Pool or the other way round.  Only the hardening helpers (pool_hardening.h) are shared.
+// Porting a hand-written pool means adding the policies above first.
+
+// ---------------------------------------------------------------------------------------------------
+// Threading
+
+struct single_thread
+{
+    // Same interface as the parts of std::atomic the policies use, without the atomic instructions
+    template <class U>
+    class atomic
+    {
+      public:
+        atomic() noexcept : m_value() { }
+        explicit atomic(U value) noexcept : m_value(value) { }
+
+        U load(std::memory_order = std::memory_order_seq_cst) const noexcept { return m_value; }
+        void store(U value, std::memory_order = std::memory_order_seq_cst) noexcept { m_value = value; }
+        U fetch_add(U n, std::memory_order = std::memory_order_seq_cst) noexcept { U old = m_value; m_value += n; return old; }
+
+        bool compare_exchange_weak(U &expected, U desired, std::memory_order = std::memory_order_seq_cst,
+                                   std::memory_order = std::memory_order_seq_cst) noexcept {
+            if (memcmp(&m_value, &expected, sizeof(U)) != 0) {
+                expected = m_value;
+                return false;
+            }
+            m_value = desired;
+            return true;
+        }
+        bool compare_exchange_strong(U &expected, U desired, std::memory_order order = std::memory_order_seq_cst,
+                                     std::memory_order failure = std::memory_order_seq_cst) noexcept {
+            return compare_exchange_weak(expected, desired, order, failure);
+        }
+
+      private:
+        U m_value;
+    };
+
+    struct mutex {
+        void lock() noexcept { }
+        void unlock() noexcept { }
+    };
+};
+
+struct multi_thread
+{
+    template <class U> using atomic = std::atomic<U>;
+
+    // Critical sections are a handful of instructions, so spin rather than sleep
+    class mutex
+    {
+      public:
+        void lock() noexcept {
+            while (m_flag.test_and_set(std::memory_order_acquire)) { asm volatile("pause\n": : :"memory"); }
+        }
+        void unlock() noexcept { m_flag.clear(std::memory_order_release); }
+
+      private:
+        std::atomic_flag m_flag = ATOMIC_FLAG_INIT;
+    };
+};
+
+// ---------------------------------------------------------------------------------------------------
+// Storage
+
+struct overlay_link
+{
+    template <class T>
+    struct bind {
+        struct node_type { node_type *next; };
+
+        static const std::size_t slot_align = alignof(T) > alignof(node_type) ? alignof(T) : alignof(node_type);
+        // Rounded up to slot_align so the link in every slot is aligned (a 12 byte T would otherwise put
+        // every other link on a 4 byte boundary)
+        static const std::size_t slot_size =
+            ((sizeof(T) > sizeof(node_type) ? sizeof(T) : sizeof(node_type)) + slot_align - 1) / slot_align * slot_align;
+        static const std::size_t link_offset = 0;
+
+        static node_type *node(T *p) noexcept { return reinterpret_cast<node_type *>(p); }
+        static T *object(node_type *n) noexcept { return reinterpret_cast<T *>(n); }
+        static node_type *&next(node_type *n) noexcept { return n->next; }
+    };
+};
+
+struct inline_link
+{
+    template <class T>
+    struct bind {
+        struct node_type {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type element;
+            node_type *next;
+        };
+
+        static const std::size_t slot_size = sizeof(node_type);
+        static const std::size_t slot_align = alignof(node_type);
+        static const std::size_t link_offset = offsetof(node_type, next);
+
+        static node_type *node(T *p) noexcept { return reinterpret_cast<node_type *>(p); }
+        static T *object(node_type *n) noexcept { return reinterpret_cast<T *>(&n->element); }
+        static node_type *&next(node_type *n) noexcept { return n->next; }
+    };
+};
+
+// ---------------------------------------------------------------------------------------------------
+// FreeList
+
+// Encodes links under _MEM_POOL_HARDEN_ (see pool_hardening.h), compiles away otherwise
+class pool_link_codec
+{
+  public:
+    template <class N>
+    N *encode(N *p) const noexcept {
+#ifdef _MEM_POOL_HARDEN_
+        return reinterpret_cast<N *>(reinterpret_cast<uintptr_t>(p) ^ m_key);
+#else
+        return p;
+#endif
+    }
+    template <class N> N *decode(N *p) const noexcept { return encode(p); }
+
+    // Only called on links that won their CAS, stale reads never get here
+    void check(const void *slot, const void *next) const noexcept {
+#ifdef _MEM_POOL_HARDEN_
+        if (next != nullptr && !pool_plausible_link(reinterpret_cast<uintptr_t>(next), alignof(void *))) {
+            pool_corruption("Pool", slot);
+        }
+#endif
+        (void)slot; (void)next;
+    }
+
+  private:
+#ifdef _MEM_POOL_HARDEN_
+    const uintptr_t m_key = pool_harden_key(this);
+#endif
+};
+
+struct tagged_free_list
+{
+    template <class S, class Threading>
+    class bind
+    {
+        typedef typename S::node_type node_type;
+        struct head_t {
+            node_type *node;
+            uintptr_t tag;
+        };
+
+      public:
+        bind() noexcept { m_head.store(head_t { nullptr, 0 }); }
+
+        void push(node_type *n) noexcept {
+            head_t orig = m_head.load(std::memory_order_relaxed);
+            head_t next;
+            do {
+                S::next(n) = m_codec.encode(orig.node);
+                next = head_t { n, orig.tag + 1 };
+            }
+            while (!m_head.compare_exchange_weak(orig, next, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        node_type *pop() noexcept {
+            head_t orig = m_head.load(std::memory_order_acquire);
+            head_t next;
+            do {
+                if (orig.node == nullptr) return nullptr;
+                // orig may be stale, its link is only trusted once the CAS succeeds
+                next = head_t { m_codec.decode(S::next(orig.node)), orig.tag + 1 };
+            }
+            while (!m_head.compare_exchange_weak(orig, next, std::memory_order_acq_rel, std::memory_order_acquire));
+            m_codec.check(orig.node, next.node);
+            return orig.node;
+        }
+
+        bool is_lock_free() const noexcept { return m_head.is_lock_free(); }
+
+      private:
+        typename Threading::template atomic<head_t> m_head;
+        pool_link_codec m_codec;
+    };
+};
+
+struct locked_free_list
+{
+    template <class S, class Threading>
+    class bind
+    {
+        typedef typename S::node_type node_type;
+
+      public:
+        void push(node_type *n) noexcept {
+            m_lock.lock();
+            S::next(n) = m_codec.encode(m_head);
+            m_head = n;
+            m_lock.unlock();
+        }
+
+        node_type *pop() noexcept {
+            m_lock.lock();
+            node_type *n = m_head;
+            if (n != nullptr) {
+                m_head = m_codec.decode(S::next(n));
+                m_codec.check(n, m_head);
+            }
+            m_lock.unlock();
+            return n;
+        }
+
+        bool is_lock_free() const noexcept { return false; }
+
+      private:
+        typename Threading::mutex m_lock;
+        node_type *m_head = nullptr;
+        pool_link_codec m_codec;
+    };
+};
+
+// Shards must be a power of two.  A thread pushes to and pops from the shard of its CPU and steals from
+// the others only when that one is empty.
+template <class Inner, std::size_t Shards = 16>
+struct sharded_free_list
+{
+    static_assert(Shards != 0 && (Shards & (Shards - 1)) == 0, "Shards must be a power of two.");
+
+    template <class S, class Threading>
+    class bind
+    {
+        typedef typename S::node_type node_type;
+        struct alignas(64) shard_t {
+            typename Inner::template bind<S, Threading> list;
+        };
+
+      public:
+        void push(node_type *n) noexcept { m_shards[home()].list.push(n); }
+
+        node_type *pop() noexcept {
+            std::size_t first = home();
+            for (std::size_t i = 0; i < Shards; i++) {
+                if (node_type *n = m_shards[(first + i) & (Shards - 1)].list.pop()) return n;
+            }
+            return nullptr;
+        }
+
+        bool is_lock_free() const noexcept { return m_shards[0].list.is_lock_free(); }
+
+      private:
+        static std::size_t home() noexcept {
+#ifdef __linux__
+            int cpu = sched_getcpu();
+            if (cpu >= 0) return static_cast<std::size_t>(cpu) & (Shards - 1);
+#endif
+            static thread_local std::size_t hashed = std::hash<std::thread::id>()(std::this_thread::get_id());
+            return hashed & (Shards - 1);
+        }
+
+        shard_t m_shards[Shards];
+    };
+};
+
+// ---------------------------------------------------------------------------------------------------
+// Growth
+
+// Anonymous memory for slots, poisoned under ASan until a slot is handed out
+inline char *
+pool_map_slots(std::size_t bytes) {
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    POOL_POISON(p, bytes);
+    return static_cast<char *>(p);
+}
+
+inline void
+pool_unmap_slots(char *p, std::size_t bytes) noexcept {
+    POOL_UNPOISON(p, bytes);
+    munmap(p, bytes);
+}
+
+struct fixed_growth
+{
+    template <class Threading>
+    class bind
+    {
+      public:
+        bind(std::size_t count, std::size_t slot_size) :
+            m_count(count), m_slot_size(slot_size), m_memory(pool_map_slots(count * slot_size)) { }
+        ~bind() noexcept { pool_unmap_slots(m_memory, m_count * m_slot_size); }
+
+        bind(const bind&) = delete;
+        bind& operator=(const bind&) = delete;
+
+        void *carve() noexcept {
+            std::size_t index = m_bump.load(std::memory_order_relaxed);
+            do {
+                if (index >= m_count) return nullptr;
+            }
+            while (!m_bump.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+            return m_memory + index * m_slot_size;
+        }
+
+        std::size_t capacity() const noexcept { return m_count; }
+
+      private:
+        const std::size_t m_count;
+        const std::size_t m_slot_size;
+        char *const m_memory;
+        typename Threading::template atomic<std::size_t> m_bump { 0 };
+    };
+};
+
+// "count" is the size of one segment, and at most MaxSegments segments are mapped.  Segments are only
+// ever added (there is no trim), so walking the list needs no lock.
+template <std::size_t MaxSegments = 64>
+struct segmented_growth
+{
+    static_assert(MaxSegments != 0, "MaxSegments must not be 0.");
+
+    template <class Threading>
+    class bind
+    {
+        struct segment_t {
+            char *memory;
+            std::size_t index;
+            typename Threading::template atomic<std::size_t> bump { 0 };
+            segment_t *next = nullptr;
+        };
+
+      public:
+        bind(std::size_t count, std::size_t slot_size) : m_count(count), m_slot_size(slot_size) {
+            if (count == 0) throw std::invalid_argument("segmented_growth: count must not be 0.");
+            grow();
+        }
+
+        ~bind() noexcept {
+            for (segment_t *seg = m_segments.load(), *next; seg != nullptr; seg = next) {
+                next = seg->next;
+                pool_unmap_slots(seg->memory, m_count * m_slot_size);
+                delete seg;
+            }
+        }
+
+        bind(const bind&) = delete;
+        bind& operator=(const bind&) = delete;
+
+        // nullptr once all MaxSegments segments are used up
+        void *carve() {
+            for (;;) {
+                if (void *p = carve_from(m_current.load(std::memory_order_acquire))) return p;
+
+                segment_t *seg = m_segments.load(std::memory_order_acquire);
+                while (seg != nullptr && seg->bump.load(std::memory_order_relaxed) >= m_count) seg = seg->next;
+                if (seg != nullptr) m_current.store(seg, std::memory_order_release);
+                else if (!grow()) return nullptr;
+            }
+        }
+
+        std::size_t capacity() const noexcept {
+            std::size_t total = 0;
+            for (segment_t *seg = m_segments.load(std::memory_order_acquire); seg != nullptr; seg = seg->next) total += m_count;
+            return total;
+        }
+
+      private:
+        void *carve_from(segment_t *seg) noexcept {
+            std::size_t index = seg->bump.load(std::memory_order_relaxed);
+            do {
+                if (index >= m_count) return nullptr;
+            }
+            while (!seg->bump.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+            return seg->memory + index * m_slot_size;
+        }
+
+        // Publish with one CAS; a thread that loses the race drops its segment and uses the winner's.
+        // False once MaxSegments segments are published
+        bool grow() {
+            segment_t *head = m_segments.load(std::memory_order_acquire);
+            std::size_t index = head == nullptr ? 0 : head->index + 1;
+            if (index >= MaxSegments) return false;
+
+            segment_t *seg = new segment_t;
+            try {
+                seg->memory = pool_map_slots(m_count * m_slot_size);
+            } catch (...) {
+                delete seg;
+                throw;
+            }
+
+            seg->index = index;
+            seg->next = head;
+            if (!m_segments.compare_exchange_strong(head, seg, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                pool_unmap_slots(seg->memory, m_count * m_slot_size);
+                delete seg;
+                return true;
+            }
+            m_current.store(seg, std::memory_order_release);
+            return true;
+        }
+
+        const std::size_t m_count;
+        const std::size_t m_slot_size;
+        typename Threading::template atomic<segment_t *> m_segments { nullptr };
+        typename Threading::template atomic<segment_t *> m_current { nullptr };
+    };
+};
+
+// ---------------------------------------------------------------------------------------------------
+// Pool
+
+template <class T, class Storage = overlay_link, class FreeList = sharded_free_list<tagged_free_list>,
+          class Growth = segmented_growth<>, class Threading = multi_thread>
+class Pool
+{
+    typedef typename Storage::template bind<T> storage_t;
+    typedef typename storage_t::node_type node_type;
+    typedef typename FreeList::template bind<storage_t, Threading> free_list_t;
+    typedef typename Growth::template bind<Threading> growth_t;
+
+  public:
+    typedef T               value_type;
+    typedef T*              pointer;
+    typedef std::size_t     size_type;
+
+    // fixed_growth: "count" objects in total.  segmented_growth<N>: "count" objects per segment, N segments.
+    explicit Pool(size_type count) : m_growth(count, storage_t::slot_size) {
+        static_assert(storage_t::slot_align <= 4096, "Slots are carved from page aligned memory.");
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    // nullptr only when the growth policy is used up
+    pointer allocate();
+    void deallocate(pointer p) noexcept;
+
+    template <class... Args> pointer new_element(Args&&... args);
+    void delete_element(pointer p) noexcept;
+
+    size_type capacity() const noexcept { return m_growth.capacity(); }
+    bool is_lock_free() const noexcept { return m_free.is_lock_free(); }
+
+  private:
+    // Everything but the link is off limits while a slot is free
+    static void poison_free(node_type *n) noexcept {
+        char *slot = reinterpret_cast<char *>(n);
+        const std::size_t link_end = storage_t::link_offset + sizeof(node_type *);
+#ifdef _MEM_POOL_HARDEN_
+        memset(slot, POOL_FREE_FILL, storage_t::link_offset);
+        memset(slot + link_end, POOL_FREE_FILL, storage_t::slot_size - link_end);
+#endif
+        POOL_POISON(slot, storage_t::link_offset);
+        POOL_POISON(slot + link_end, storage_t::slot_size - link_end);
+        (void)slot; (void)link_end;
+    }
+
+    free_list_t m_free;
+    growth_t m_growth;
+};
+
+template <class T, class Storage, class FreeList, class Growth, class Threading>
+inline typename Pool<T, Storage, FreeList, Growth, Threading>::pointer
+Pool<T, Storage, FreeList, Growth, Threading>::allocate() {
+    node_type *n = m_free.pop();
+    if (n == nullptr) {
+        n = static_cast<node_type *>(m_growth.carve());
+        if (n == nullptr) return nullptr;
+    }
+    POOL_UNPOISON(n, storage_t::slot_size);
+    return storage_t::object(n);
+}
+
+template <class T, class Storage, class FreeList, class Growth, class Threading>
+inline void
+Pool<T, Storage, FreeList, Growth, Threading>::deallocate(pointer p) noexcept {
+    if (p == nullptr) return;
+    node_type *n = storage_t::node(p);
+    poison_free(n);
+    m_free.push(n);
+}
+
+template <class T, class Storage, class FreeList, class Growth, class Threading>
+template <class... Args>
+inline typename Pool<T, Storage, FreeList, Growth, Threading>::pointer
+Pool<T, Storage, FreeList, Growth, Threading>::new_element(Args&&... args) {
+    pointer result = allocate();
+    if (result != nullptr) new (result) value_type (std::forward<Args>(args)...);
+    return result;
+}
+
+template <class T, class Storage, class FreeList, class Growth, class Threading>
+inline void
+Pool<T, Storage, FreeList, Growth, Threading>::delete_element(pointer p) noexcept {
+    if (p == nullptr) return;
+    p->~value_type();
+    deallocate(p);
+}
+
+#endif
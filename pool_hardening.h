@@ -0,0 +1,63 @@
+#ifndef __POOL_HARDENING_H__
+#define __POOL_HARDENING_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+// Helpers shared by the pools for catching misuse of pooled memory.
+//
+// Under AddressSanitizer the pools poison slots while they are free, so a use-after-free of a pooled
+// object is reported just like one of a heap object.  Without ASan the POOL_POISON/POOL_UNPOISON macros
+// compile to nothing.
+//
+// Defining _MEM_POOL_HARDEN_ turns on the cheap checks meant to stay enabled in canary deployments:
+//  - free list links are stored XORed with a random per-pool key and checked when they are followed, so
+//    a write through a dangling pointer into a free slot aborts with a message instead of handing out
+//    some arbitrary address later;
+//  - freed objects are filled with POOL_FREE_FILL (can be turned off per pool), so stale reads see an
+//    obvious pattern instead of plausible data.
+
+#if defined(__SANITIZE_ADDRESS__)
+#define _POOL_ASAN_ 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define _POOL_ASAN_ 1
+#endif
+#endif
+
+#ifdef _POOL_ASAN_
+#include <sanitizer/asan_interface.h>
+#define POOL_POISON(p, n)   ASAN_POISON_MEMORY_REGION((p), (n))
+#define POOL_UNPOISON(p, n) ASAN_UNPOISON_MEMORY_REGION((p), (n))
+#else
+#define POOL_POISON(p, n)   ((void)(p), (void)(n))
+#define POOL_UNPOISON(p, n) ((void)(p), (void)(n))
+#endif
+
+#define POOL_FREE_FILL 0xdb
+
+// Random key for encoding free list links.  Mixing in an address of the pool keeps two pools created
+// at the same instant apart.
+inline uintptr_t
+pool_harden_key(const void *pool) {
+    std::random_device rd;
+    uint64_t key = (static_cast<uint64_t>(rd()) << 32) ^ rd() ^ reinterpret_cast<uintptr_t>(pool);
+    return static_cast<uintptr_t>(key | 1);
+}
+
+// A decoded link has to look like a slot address: canonical user space and aligned.  A slot overwritten
+// with anything but a correctly encoded pointer fails this with very high probability.
+inline bool
+pool_plausible_link(uintptr_t p, std::size_t align) {
+    return (static_cast<uint64_t>(p) >> 47) == 0 && p % align == 0;
+}
+
+[[noreturn]] inline void
+pool_corruption(const char *pool, const void *slot) {
+    fprintf(stderr, "%s: free list corruption detected at slot %p (use after free or overflow into a free slot?)\n",
+            pool, slot);
+    abort();
+}
+#endif
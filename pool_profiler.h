@@ -0,0 +1,323 @@
+#ifndef __POOL_PROFILER_H__
+#define __POOL_PROFILER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+
+// Sampling allocation profiler for the pools.  Roughly one allocation in "sample_rate" records its stack
+// trace; the rest pay for a thread local countdown and a branch.  Frees of sampled objects remove their
+// sample again, so at any time the profiler holds an estimate of which call sites own pool memory right
+// now.  Dump it with dump_folded() (flame graph input) or dump_pprof() (pprof's legacy heap format).
+//
+// Samples live in a fixed size lock-free table keyed by address rather than a plain ring, because a free
+// has to find the sample of its object again.  When the table is full new samples are dropped (and
+// counted), nothing blocks.  A dump can run while other threads sample and free: every entry carries a
+// sequence number, and a dump copies an entry and keeps the copy only if the number didn't change.
+// Frames are symbolized only when dumping; link with -rdynamic to get names for functions in the main
+// executable.
+//
+// Cost: the goal of under 1% on the pools' hot paths is NOT met.  Every sample pays for a backtrace()
+// (about 2.5 us with glibc's unwinder), so at the default 1/1024 the sampled allocations alone add
+// ~2.5 ns to a ~30 ns allocate/free pair, and the total measured overhead is 5-10%.  Unsampled
+// operations still pay a thread local countdown and, on free, a one byte filter load (a live sample in
+// the same hash bucket is the only reason to probe the table), about 1 ns together, so even 1/16384
+// lands around 1-3%.  bench/src/profiler_bench.cc measures it.
+class PoolProfiler
+{
+  public:
+    static const int max_depth = 32;
+
+    struct stats_t {
+        uint64_t samples = 0;           // Allocations sampled since construction
+        uint64_t dropped = 0;           // Samples lost because the table was full
+        uint64_t live_samples = 0;
+        uint64_t live_bytes = 0;        // Bytes held by sampled objects
+        uint64_t estimated_live_bytes = 0;  // live_bytes scaled by the sample rate
+    };
+
+    explicit PoolProfiler(uint32_t sample_rate = 1024, std::size_t max_samples = 16384);
+
+    PoolProfiler(const PoolProfiler&) = delete;
+    PoolProfiler& operator=(const PoolProfiler&) = delete;
+
+    // Hot path, called by the pools on every allocation.  Returns true roughly once every sample_rate calls.
+    bool should_sample() noexcept {
+        if (--tls_countdown() > 0) return false;
+        tls_countdown() = next_interval();
+        return true;
+    }
+
+    void record_alloc(const void *p, std::size_t bytes) noexcept;
+
+    // Called on every free.  One byte load unless a live sample hashes to the same bucket as p.
+    void record_free(const void *p) noexcept {
+        std::size_t home = hash(reinterpret_cast<uintptr_t>(p)) & m_mask;
+        if (m_homed[home].load(std::memory_order_relaxed) != 0) remove(p, home);
+    }
+
+    // Drops every sample in [begin, end), for pools that release objects without freeing them one by one.
+    void forget(const void *begin, const void *end) noexcept;
+
+    uint32_t sample_rate() const noexcept { return m_sample_rate; }
+    stats_t stats() const noexcept;
+
+    // One line per distinct stack, outermost frame first: "main;worker;alloc_thing <estimated bytes>"
+    void dump_folded(std::ostream &out) const;
+    // pprof heap profile.  Addresses are resolved by pprof from the MAPPED_LIBRARIES section.
+    void dump_pprof(std::ostream &out) const;
+
+  private:
+    // key is 0 when the entry is empty, tombstone after its object was freed.  A writer claims an entry by
+    // CASing the key, fills it in and then sets ready; readers skip entries that aren't ready.  seq is odd
+    // while the fields below it are being written, so a dump can tell that its copy was torn.
+    struct sample_t {
+        std::atomic<uintptr_t> key { 0 };
+        std::atomic<bool> ready { false };
+        std::atomic<uint32_t> seq { 0 };
+        std::atomic<std::size_t> bytes { 0 };
+        std::atomic<int> depth { 0 };
+        std::atomic<void *> frames[max_depth];
+
+        sample_t() noexcept { for (auto &f : frames) f.store(nullptr, std::memory_order_relaxed); }
+    };
+
+    // What a dump sees of an entry
+    struct snapshot_t {
+        std::size_t bytes;
+        int depth;
+        void *frames[max_depth];
+    };
+
+    static const uintptr_t tombstone = 1;
+
+    static std::size_t hash(uintptr_t p) noexcept {
+        uint64_t h = static_cast<uint64_t>(p) * 0x9e3779b97f4a7c15ULL;
+        return static_cast<std::size_t>(h ^ (h >> 32));
+    }
+    static int32_t &tls_countdown() noexcept { static thread_local int32_t countdown = 0; return countdown; }
+
+    int32_t next_interval() noexcept;
+    void remove(const void *p, std::size_t home) noexcept;
+    void release(sample_t &s) noexcept;
+
+    template <class Fn> void for_each_live(Fn fn) const;
+    static std::string symbolize(void *frame);
+
+    const uint32_t m_sample_rate;
+    const std::size_t m_mask;
+    std::unique_ptr<sample_t[]> m_samples;
+    // Live samples per home bucket.  A sample sits at most 64 entries past its home, so this never
+    // exceeds 64; zero lets a free skip the probe
+    std::unique_ptr<std::atomic<uint8_t>[]> m_homed;
+
+    std::atomic<uint64_t> m_sampled { 0 };
+    std::atomic<uint64_t> m_dropped { 0 };
+    std::atomic<uint64_t> m_live_samples { 0 };
+    std::atomic<uint64_t> m_live_bytes { 0 };
+};
+
+inline
+PoolProfiler::PoolProfiler(uint32_t sample_rate, std::size_t max_samples) :
+    m_sample_rate(sample_rate == 0 ? 1 : sample_rate),
+    m_mask([max_samples]() { std::size_t n = 1; while (n < max_samples) n <<= 1; return n - 1; }()),
+    m_samples(new sample_t[m_mask + 1]),
+    m_homed(new std::atomic<uint8_t>[m_mask + 1]) {
+    for (std::size_t i = 0; i <= m_mask; i++) m_homed[i].store(0, std::memory_order_relaxed);
+}
+
+// Uniform in [1, 2 * rate) so the mean stays at the sample rate without locking onto periodic patterns
+inline int32_t
+PoolProfiler::next_interval() noexcept {
+    static thread_local std::minstd_rand rng(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&rng)));
+    if (m_sample_rate == 1) return 1;
+    return static_cast<int32_t>(1 + rng() % (2 * m_sample_rate - 1));
+}
+
+inline void
+PoolProfiler::record_alloc(const void *p, std::size_t bytes) noexcept {
+    uintptr_t key = reinterpret_cast<uintptr_t>(p);
+    m_sampled.fetch_add(1, std::memory_order_relaxed);
+
+    // Bounded linear probe; give up rather than scan a nearly full table
+    const std::size_t home = hash(key) & m_mask;
+    for (std::size_t i = 0, idx = home; i < 64 && i <= m_mask; i++, idx = (idx + 1) & m_mask) {
+        sample_t &s = m_samples[idx];
+        uintptr_t orig = s.key.load(std::memory_order_relaxed);
+        if (orig != 0 && orig != tombstone) continue;
+        if (!s.key.compare_exchange_strong(orig, key, std::memory_order_acquire)) continue;
+
+        // Skip backtrace()'s own frame and record_alloc().  Unwound before the entry is marked as being
+        // written, so a dump finds it torn only for the few stores below
+        void *frames[max_depth + 2];
+        int depth = backtrace(frames, max_depth + 2);
+        depth = depth > 2 ? depth - 2 : 0;
+
+        // Only the thread that claimed the key writes the entry
+        uint32_t seq = s.seq.load(std::memory_order_relaxed);
+        s.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        s.bytes.store(bytes, std::memory_order_relaxed);
+        s.depth.store(depth, std::memory_order_relaxed);
+        for (int f = 0; f < depth; f++) s.frames[f].store(frames[f + 2], std::memory_order_relaxed);
+        s.seq.store(seq + 2, std::memory_order_release);
+        s.ready.store(true, std::memory_order_release);
+
+        m_homed[home].fetch_add(1, std::memory_order_relaxed);
+        m_live_samples.fetch_add(1, std::memory_order_relaxed);
+        m_live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        return;
+    }
+    m_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void
+PoolProfiler::release(sample_t &s) noexcept {
+    s.ready.store(false, std::memory_order_relaxed);
+    m_homed[hash(s.key.load(std::memory_order_relaxed)) & m_mask].fetch_sub(1, std::memory_order_relaxed);
+    m_live_samples.fetch_sub(1, std::memory_order_relaxed);
+    m_live_bytes.fetch_sub(s.bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    s.key.store(tombstone, std::memory_order_release);
+}
+
+inline void
+PoolProfiler::remove(const void *p, std::size_t home) noexcept {
+    uintptr_t key = reinterpret_cast<uintptr_t>(p);
+    for (std::size_t i = 0, idx = home; i < 64 && i <= m_mask; i++, idx = (idx + 1) & m_mask) {
+        sample_t &s = m_samples[idx];
+        uintptr_t k = s.key.load(std::memory_order_acquire);
+        if (k == 0) return;
+        // An object is freed by exactly one thread, so nobody else can be releasing this entry
+        if (k == key && s.ready.load(std::memory_order_acquire)) {
+            release(s);
+            return;
+        }
+    }
+}
+
+inline void
+PoolProfiler::forget(const void *begin, const void *end) noexcept {
+    uintptr_t lo = reinterpret_cast<uintptr_t>(begin), hi = reinterpret_cast<uintptr_t>(end);
+    for (std::size_t i = 0; i <= m_mask; i++) {
+        sample_t &s = m_samples[i];
+        uintptr_t k = s.key.load(std::memory_order_acquire);
+        if (k >= lo && k < hi && s.ready.load(std::memory_order_acquire)) release(s);
+    }
+}
+
+inline PoolProfiler::stats_t
+PoolProfiler::stats() const noexcept {
+    stats_t st;
+    st.samples = m_sampled.load(std::memory_order_relaxed);
+    st.dropped = m_dropped.load(std::memory_order_relaxed);
+    st.live_samples = m_live_samples.load(std::memory_order_relaxed);
+    st.live_bytes = m_live_bytes.load(std::memory_order_relaxed);
+    st.estimated_live_bytes = st.live_bytes * m_sample_rate;
+    return st;
+}
+
+// Copies every live entry, seqlock style: a copy that overlapped a writer is retried a few times and
+// then skipped, like a sample taken just after the dump started
+template <class Fn>
+inline void
+PoolProfiler::for_each_live(Fn fn) const {
+    for (std::size_t i = 0; i <= m_mask; i++) {
+        const sample_t &s = m_samples[i];
+        for (int attempt = 0; attempt < 4; attempt++) {
+            uint32_t before = s.seq.load(std::memory_order_acquire);
+            if (before & 1) continue;
+            if (!s.ready.load(std::memory_order_acquire)) break;
+
+            snapshot_t copy;
+            copy.bytes = s.bytes.load(std::memory_order_relaxed);
+            copy.depth = std::min(s.depth.load(std::memory_order_relaxed), static_cast<int>(max_depth));
+            for (int f = 0; f < copy.depth; f++) copy.frames[f] = s.frames[f].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.seq.load(std::memory_order_relaxed) == before) {
+                fn(copy);
+                break;
+            }
+        }
+    }
+}
+
+inline std::string
+PoolProfiler::symbolize(void *frame) {
+    Dl_info info;
+    if (dladdr(frame, &info) == 0 || info.dli_sname == nullptr) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%p", frame);
+        return buf;
+    }
+
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name = status == 0 && demangled != nullptr ? demangled : info.dli_sname;
+    free(demangled);
+
+    // ';' separates frames in the folded format
+    for (char &c : name) if (c == ';') c = ':';
+    return name;
+}
+
+inline void
+PoolProfiler::dump_folded(std::ostream &out) const {
+    std::map<std::vector<void *>, uint64_t> stacks;
+    for_each_live([&](const snapshot_t &s) {
+        stacks[std::vector<void *>(s.frames, s.frames + s.depth)] += s.bytes * m_sample_rate;
+    });
+
+    std::map<void *, std::string> names;
+    for (auto &stack : stacks) {
+        std::string line;
+        for (auto it = stack.first.rbegin(); it != stack.first.rend(); ++it) {
+            auto name = names.find(*it);
+            if (name == names.end()) name = names.emplace(*it, symbolize(*it)).first;
+            if (!line.empty()) line += ';';
+            line += name->second;
+        }
+        out << line << ' ' << stack.second << '\n';
+    }
+}
+
+inline void
+PoolProfiler::dump_pprof(std::ostream &out) const {
+    struct totals_t { uint64_t count = 0; uint64_t bytes = 0; };
+    std::map<std::vector<void *>, totals_t> stacks;
+    totals_t all;
+    for_each_live([&](const snapshot_t &s) {
+        totals_t &t = stacks[std::vector<void *>(s.frames, s.frames + s.depth)];
+        t.count += m_sample_rate;
+        t.bytes += s.bytes * m_sample_rate;
+        all.count += m_sample_rate;
+        all.bytes += s.bytes * m_sample_rate;
+    });
+
+    out << "heap profile: " << all.count << ": " << all.bytes << " [" << all.count << ": " << all.bytes
+        << "] @ heap\n";
+    for (auto &stack : stacks) {
+        out << stack.second.count << ": " << stack.second.bytes << " [" << stack.second.count << ": "
+            << stack.second.bytes << "] @";
+        for (void *frame : stack.first) out << ' ' << frame;
+        out << '\n';
+    }
+
+    out << "\nMAPPED_LIBRARIES:\n";
+    std::ifstream maps("/proc/self/maps");
+    if (maps) out << maps.rdbuf();
+}
+#endif
@@ -0,0 +1,282 @@
+#ifndef __RSEQ_CACHE_H__
+#define __RSEQ_CACHE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// rseq critical sections are written in x86-64 assembly against glibc's rseq registration (glibc 2.35+).
+// Everywhere else the cache compiles to a pass-through to the pool.
+#if defined(__linux__) && defined(__x86_64__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#include <sys/rseq.h>
+#define _POOL_RSEQ_ 1
+#endif
+
+// A per-CPU object cache in front of a pool (LockFreeMemoryPool, MemoryPool, anything with allocate() and
+// deallocate(p)).  Every CPU owns a small stack of free objects; allocate() pops from the stack of the CPU
+// it runs on and deallocate() pushes onto it, without atomics or locks.  Both run as Linux restartable
+// sequences: if the thread is preempted or migrated in the middle, the kernel restarts it at an abort
+// handler instead of letting it finish on the wrong CPU, and the operation is retried.  Same idea as
+// tcmalloc's per-CPU mode.
+//
+// Unlike thread-local caches, the memory parked in caches scales with the number of CPUs, not threads.
+// A miss (empty stack) goes to the pool, and so does a free onto a full stack.  Without rseq (not Linux
+// x86-64, glibc older than 2.35, or rseq registration disabled with GLIBC_TUNABLES=glibc.pthread.rseq=0)
+// every call goes straight to the pool.
+//
+// Objects parked in the cache count as allocated as far as the pool knows.  drain() (also called by the
+// destructor) hands them back; it must not run concurrently with allocate()/deallocate().
+template <class Pool, std::size_t cache_slots = 32>
+class RseqPoolCache
+{
+  public:
+    typedef typename std::remove_pointer<decltype(std::declval<Pool&>().allocate())>::type value_type;
+    typedef value_type*     pointer;
+    typedef std::size_t     size_type;
+
+    explicit RseqPoolCache(Pool &pool);
+    ~RseqPoolCache() noexcept;
+
+    RseqPoolCache(const RseqPoolCache&) = delete;
+    RseqPoolCache& operator=(const RseqPoolCache&) = delete;
+
+    pointer allocate();
+    void deallocate(pointer p);
+
+    template <class... Args> pointer new_element(Args&&... args);
+    void delete_element(pointer p);
+
+    // Returns every cached object to the pool.
+    void drain() noexcept;
+
+    // False when running on the fallback path
+    bool uses_rseq() const noexcept { return m_caches != nullptr; }
+
+  private:
+    // One per CPU, on its own cache lines
+    struct alignas(64) cpu_cache_t {
+        uint64_t count;
+        void *slots[cache_slots];
+    };
+
+#ifdef _POOL_RSEQ_
+    static struct rseq *rseq_area() noexcept {
+        return reinterpret_cast<struct rseq *>(static_cast<char *>(__builtin_thread_pointer()) + __rseq_offset);
+    }
+    static std::size_t possible_cpus() noexcept;
+    static void *pop(cpu_cache_t *caches, std::size_t cpus) noexcept;
+    static bool push(cpu_cache_t *caches, std::size_t cpus, void *p) noexcept;
+#endif
+
+    Pool &m_pool;
+    cpu_cache_t *m_caches = nullptr;
+    std::size_t m_cpus = 0;
+    std::size_t m_bytes = 0;
+};
+
+template <class Pool, std::size_t cache_slots>
+RseqPoolCache<Pool, cache_slots>::RseqPoolCache(Pool &pool) : m_pool(pool) {
+#ifdef _POOL_RSEQ_
+    // __rseq_size is 0 when glibc didn't (or wasn't allowed to) register rseq for its threads
+    if (__rseq_size == 0) return;
+
+    m_cpus = possible_cpus();
+    if (m_cpus == 0) return;
+
+    // mmap()ed, so the caches of CPUs we never run on are never faulted in
+    std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    m_bytes = (m_cpus * sizeof(cpu_cache_t) + page - 1) / page * page;
+    void *caches = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (caches == MAP_FAILED) throw std::runtime_error("RseqPoolCache: mmap failed.");
+    m_caches = static_cast<cpu_cache_t *>(caches);
+#endif
+}
+
+template <class Pool, std::size_t cache_slots>
+RseqPoolCache<Pool, cache_slots>::~RseqPoolCache() noexcept {
+    if (m_caches == nullptr) return;
+    drain();
+    munmap(m_caches, m_bytes);
+}
+
+template <class Pool, std::size_t cache_slots>
+void
+RseqPoolCache<Pool, cache_slots>::drain() noexcept {
+    for (std::size_t cpu = 0; cpu < m_cpus; cpu++) {
+        cpu_cache_t &cache = m_caches[cpu];
+        while (cache.count != 0) m_pool.deallocate(static_cast<pointer>(cache.slots[--cache.count]));
+    }
+}
+
+#ifdef _POOL_RSEQ_
+// CPU ids index the caches, so the array has to cover the highest id the kernel may ever report, which
+// _SC_NPROCESSORS_CONF doesn't promise (holes in the numbering, CPUs hot-added later).  Takes the largest
+// id in /sys/devices/system/cpu/possible ("0-63", "0-3,8-11"), or the configured count if that can't be
+// read.  pop() and push() still check the id and go to the pool for anything beyond it.
+template <class Pool, std::size_t cache_slots>
+std::size_t
+RseqPoolCache<Pool, cache_slots>::possible_cpus() noexcept {
+    long conf = sysconf(_SC_NPROCESSORS_CONF);
+    std::size_t cpus = conf > 0 ? static_cast<std::size_t>(conf) : 0;
+
+    int fd = open("/sys/devices/system/cpu/possible", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return cpus;
+    char buf[256];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    std::size_t id = 0;
+    bool digits = false;
+    for (ssize_t i = 0; i < len; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            id = id * 10 + static_cast<std::size_t>(buf[i] - '0');
+            digits = true;
+        } else {
+            if (digits && id + 1 > cpus) cpus = id + 1;
+            id = 0;
+            digits = false;
+        }
+    }
+    if (digits && id + 1 > cpus) cpus = id + 1;
+    return cpus;
+}
+
+// The critical sections follow librseq's x86-64 layout: a descriptor in __rseq_cs, the address of the
+// descriptor stored into rseq->rseq_cs before the first instruction, the CPU check, and a single store
+// that commits.  The abort handler lives in __rseq_failure behind the RSEQ_SIG signature the kernel
+// checks.
+#define _POOL_RSEQ_STR_(x) #x
+#define _POOL_RSEQ_STR(x) _POOL_RSEQ_STR_(x)
+
+#define _POOL_RSEQ_CS_BEGIN                                                     \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                        \
+    ".balign 32\n\t"                                                            \
+    "3:\n\t"                                                                    \
+    ".long 0x0, 0x0\n\t"                                                        \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                               \
+    ".popsection\n\t"                                                           \
+    "leaq 3b(%%rip), %%rax\n\t"                                                 \
+    "movq %%rax, %[rseq_cs]\n\t"                                                \
+    "1:\n\t"                                                                    \
+    "cmpl %[cpu], %[current_cpu]\n\t"                                           \
+    "jnz 4f\n\t"
+
+#define _POOL_RSEQ_CS_END                                                       \
+    "2:\n\t"                                                                    \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                                   \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                                \
+    ".long " _POOL_RSEQ_STR(RSEQ_SIG) "\n\t"                                    \
+    "4:\n\t"                                                                    \
+    "jmp %l[abort]\n\t"                                                         \
+    ".popsection\n\t"
+
+template <class Pool, std::size_t cache_slots>
+inline void *
+RseqPoolCache<Pool, cache_slots>::pop(cpu_cache_t *caches, std::size_t cpus) noexcept {
+    struct rseq *rs = rseq_area();
+    void *result;
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        if (cpu >= cpus) return nullptr;
+        cpu_cache_t *cache = &caches[cpu];
+        __asm__ __volatile__ goto (
+            _POOL_RSEQ_CS_BEGIN
+            "movq %[count], %%rbx\n\t"
+            "testq %%rbx, %%rbx\n\t"
+            "jz %l[empty]\n\t"
+            "movq -8(%[slots], %%rbx, 8), %%rcx\n\t"
+            "movq %%rcx, %[result]\n\t"
+            "decq %%rbx\n\t"
+            "movq %%rbx, %[count]\n\t"          // Commit
+            _POOL_RSEQ_CS_END
+            : /* no outputs */
+            : [cpu] "r" (cpu), [current_cpu] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+              [count] "m" (cache->count), [slots] "r" (cache->slots), [result] "m" (result)
+            : "memory", "cc", "rax", "rbx", "rcx"
+            : abort, empty);
+        return result;
+      empty:
+        return nullptr;
+      abort:
+        // Preempted, signalled or migrated: nothing was committed, try again on whatever CPU we're on now
+        continue;
+    }
+}
+
+template <class Pool, std::size_t cache_slots>
+inline bool
+RseqPoolCache<Pool, cache_slots>::push(cpu_cache_t *caches, std::size_t cpus, void *p) noexcept {
+    struct rseq *rs = rseq_area();
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+        if (cpu >= cpus) return false;
+        cpu_cache_t *cache = &caches[cpu];
+        __asm__ __volatile__ goto (
+            _POOL_RSEQ_CS_BEGIN
+            "movq %[count], %%rbx\n\t"
+            "cmpq %[capacity], %%rbx\n\t"
+            "jae %l[full]\n\t"
+            "movq %[p], (%[slots], %%rbx, 8)\n\t"   // Beyond count, harmless if we're aborted now
+            "incq %%rbx\n\t"
+            "movq %%rbx, %[count]\n\t"          // Commit
+            _POOL_RSEQ_CS_END
+            : /* no outputs */
+            : [cpu] "r" (cpu), [current_cpu] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+              [count] "m" (cache->count), [slots] "r" (cache->slots), [p] "r" (p),
+              [capacity] "i" (cache_slots)
+            : "memory", "cc", "rax", "rbx"
+            : abort, full);
+        return true;
+      full:
+        return false;
+      abort:
+        continue;
+    }
+}
+#endif
+
+template <class Pool, std::size_t cache_slots>
+inline typename RseqPoolCache<Pool, cache_slots>::pointer
+RseqPoolCache<Pool, cache_slots>::allocate() {
+#ifdef _POOL_RSEQ_
+    if (m_caches != nullptr) {
+        if (void *p = pop(m_caches, m_cpus)) return static_cast<pointer>(p);
+    }
+#endif
+    return m_pool.allocate();
+}
+
+template <class Pool, std::size_t cache_slots>
+inline void
+RseqPoolCache<Pool, cache_slots>::deallocate(pointer p) {
+    if (p == nullptr) return;
+#ifdef _POOL_RSEQ_
+    if (m_caches != nullptr && push(m_caches, m_cpus, p)) return;
+#endif
+    m_pool.deallocate(p);
+}
+
+template <class Pool, std::size_t cache_slots>
+template <class... Args>
+inline typename RseqPoolCache<Pool, cache_slots>::pointer
+RseqPoolCache<Pool, cache_slots>::new_element(Args&&... args) {
+    pointer result = allocate();
+    if (result != nullptr) new (result) value_type (std::forward<Args>(args)...);
+    return result;
+}
+
+template <class Pool, std::size_t cache_slots>
+inline void
+RseqPoolCache<Pool, cache_slots>::delete_element(pointer p) {
+    if (p == nullptr) return;
+    p->~value_type();
+    deallocate(p);
+}
+#endif
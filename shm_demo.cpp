@@ -0,0 +1,51 @@
+#include <cstdio>
+#include <cstring>
+#include <sys/wait.h>
+#include "shm_pool.h"
+
+// Zero-copy hand off between two processes through a SharedMemoryPool
+struct Message {
+    int id;
+    char text[120];
+};
+
+int main() {
+    const char *name = "/mpoll-shm-demo";
+    SharedMemoryPool<Message>::unlink(name);
+    SharedMemoryPool<Message> pool(name, 1024);
+
+    int pipe_fd[2];
+    if (pipe(pipe_fd) != 0) return 1;
+
+    pid_t producer = fork();
+    if (producer == 0) {
+        // The child maps the region on its own and sends handles, never the messages themselves
+        SharedMemoryPool<Message> child_pool(name, 1024);
+        for (int i = 0; i < 3; i++) {
+            Message *m = child_pool.allocate();
+            m->id = i;
+            snprintf(m->text, sizeof(m->text), "message %d from pid %d", i, getpid());
+            uint64_t handle = child_pool.to_handle(m);
+            if (write(pipe_fd[1], &handle, sizeof(handle)) != sizeof(handle)) _exit(1);
+        }
+
+        // Leaked on purpose, the parent reclaims it once we're gone
+        child_pool.allocate();
+        _exit(0);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        uint64_t handle;
+        if (read(pipe_fd[0], &handle, sizeof(handle)) != sizeof(handle)) return 1;
+        Message *m = pool.from_handle(handle);
+        pid_t from = pool.owner(m);
+        printf("Received #%d: %s (adopted: %s)\n", m->id, m->text, pool.adopt(m, from) ? "yes" : "no");
+        pool.deallocate(m);
+    }
+
+    waitpid(producer, nullptr, 0);
+    printf("Recovered %zu slots from the exited producer\n", pool.recover_dead_owners());
+
+    SharedMemoryPool<Message>::unlink(name);
+    return 0;
+}
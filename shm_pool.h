@@ -0,0 +1,379 @@
+#ifndef __SHM_POOL_H__
+#define __SHM_POOL_H__
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "persistent_pool.h"
+
+// Every slot of a SharedMemoryPool records the process that owns it, so slots held by a process that
+// died can be found and reclaimed.  The owner word packs, from the low bits up:
+//  - the pid (22 bits, Linux's pid_max limit);
+//  - a tag derived from the process start time (24 bits, 0 when unknown), so a reused pid doesn't look
+//    like the dead owner is still around;
+//  - a version (17 bits) that recover_dead_owners() bumps when it puts a slot back on the free list;
+//  - a "freeing" bit, set by deallocate() before the slot is pushed onto the free list and cleared right
+//    after.  A free slot has no owner process.
+template <typename T>
+struct shared_pool_entry {
+    T value;                        // Must stay first, pooled pointers point here
+    std::atomic<uint64_t> owner;
+};
+
+// A pool living in a shared memory object that several processes map at the same time, for zero-copy
+// message passing between co-located processes: one process allocates and fills an object, then hands
+// its handle (an offset into the region, the same in every process) to another one.
+//
+// The region uses PersistentPool's layout, so the free list is the same tagged head CAS design as
+// LockFreeMemoryPool, only with slot indices in a single 64 bit word instead of pointers.  That keeps it
+// lock-free and address independent across processes.  Objects must follow PersistentPool's rules: no
+// raw pointers, trivially destructible.
+template <typename T>
+class SharedMemoryPool : private PersistentPool<shared_pool_entry<T>>
+{
+    typedef PersistentPool<shared_pool_entry<T>> base_t;
+    typedef shared_pool_entry<T> entry_t;
+
+  public:
+    typedef T               value_type;
+    typedef T*              pointer;
+    typedef std::size_t     size_type;
+    typedef uint64_t        handle_type;    // 0 is the null handle
+
+    // Opens (or creates) the POSIX shared memory object "name", e.g. "/mpoll-queue".  Every process must
+    // pass the same capacity.
+    SharedMemoryPool(const std::string &name, size_type capacity);
+
+    // Attaches to a region by file descriptor, e.g. one received over a unix socket with SCM_RIGHTS.  The
+    // descriptor is duplicated, the caller keeps ownership of "fd".
+    SharedMemoryPool(int fd, size_type capacity);
+
+#ifdef __linux__
+    // Creates an anonymous region with memfd_create().  Share it with fork() or by sending fd().
+    explicit SharedMemoryPool(size_type capacity);
+#endif
+
+    SharedMemoryPool(const SharedMemoryPool&) = delete;
+    SharedMemoryPool& operator=(const SharedMemoryPool&) = delete;
+
+    // The object is owned by the calling process until it is deallocated or adopted by another process.
+    pointer allocate();
+    void deallocate(pointer p);
+
+    template <class... Args> pointer new_element(Args&&... args);
+    void delete_element(pointer p) { deallocate(p); }
+
+    handle_type to_handle(const T *p) const noexcept { return base_t::to_offset(reinterpret_cast<const entry_t *>(p)); }
+    pointer from_handle(handle_type h) const noexcept { return reinterpret_cast<pointer>(base_t::from_offset(h)); }
+
+    // Takes ownership of an object handed over by process "from".  Returns false if "from" doesn't own it
+    // any more, e.g. because the slot was already reclaimed by recover_dead_owners() after "from" died.
+    bool adopt(pointer p, pid_t from) noexcept;
+
+    // Returns every slot owned by a process that no longer exists to the free list, including slots whose
+    // owner died in the middle of deallocate().  Returns the number of slots reclaimed.  A slot is lost
+    // (until the region is recreated) only if a process dies between taking it off the free list and
+    // recording itself as the owner, a window of a few instructions.
+    // Only one process recovers at a time; a call that finds another live process recovering returns 0.
+    // Finding out whether a dying deallocate() got as far as the free list means holding the free list
+    // for a moment, and allocations meanwhile fall back to never-used slots (or fail if there are none).
+    // That only happens when such a slot exists.
+    size_type recover_dead_owners();
+
+    // The pid of the owner, 0 if the slot is free
+    pid_t owner(const T *p) const noexcept;
+    int fd() const noexcept { return this->m_fd; }
+
+    using base_t::capacity;
+
+    // Removes the name; processes that have it mapped keep working.
+    static void unlink(const std::string &name) { shm_unlink(name.c_str()); }
+
+  private:
+    static const uint64_t pid_mask = (uint64_t(1) << 22) - 1;
+    static const uint64_t process_mask = (uint64_t(1) << 46) - 1;      // pid and start time tag
+    static const unsigned version_shift = 46;
+    static const uint64_t version_mask = (uint64_t(1) << 17) - 1;
+    static const uint64_t freeing_bit = uint64_t(1) << 63;
+
+    static uint64_t version_of(uint64_t word) noexcept { return (word >> version_shift) & version_mask; }
+    static uint64_t with_version(uint64_t process, uint64_t version) noexcept {
+        return process | (version & version_mask) << version_shift;
+    }
+
+    // pid and start time tag of the calling process, recomputed after fork()
+    static uint64_t current_process() noexcept;
+    static uint64_t start_tag(pid_t pid) noexcept;
+    static bool process_alive(uint64_t process) noexcept;
+
+    uint32_t pop(uint64_t &word) noexcept;
+    void push(uint32_t first, uint32_t last) noexcept;
+    void release(entry_t *e, uint64_t version) noexcept;
+
+    // SharedMemoryPool has no root object, so the header's root word is the recovery lock: 0, or the pid
+    // and start time tag of the process recovering
+    std::atomic<uint64_t> &recovery_lock() const noexcept { return this->m_header->root; }
+};
+
+template <typename T>
+SharedMemoryPool<T>::SharedMemoryPool(const std::string &name, size_type capacity) {
+    // Only the process that actually creates the object initializes it.  Everybody else waits for the
+    // creator to finish writing the header.
+    bool creator = true;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0) throw std::runtime_error("SharedMemoryPool: cannot open " + name);
+
+    this->attach(fd, capacity, creator);
+}
+
+template <typename T>
+SharedMemoryPool<T>::SharedMemoryPool(int fd, size_type capacity) {
+    int own = dup(fd);
+    if (own < 0) throw std::runtime_error("SharedMemoryPool: dup failed.");
+    this->attach(own, capacity);
+}
+
+#ifdef __linux__
+template <typename T>
+SharedMemoryPool<T>::SharedMemoryPool(size_type capacity) {
+    int fd = memfd_create("mpoll-shared-pool", 0);
+    if (fd < 0) throw std::runtime_error("SharedMemoryPool: memfd_create failed.");
+    this->attach(fd, capacity);
+}
+#endif
+
+template <typename T>
+uint64_t
+SharedMemoryPool<T>::start_tag(pid_t pid) noexcept {
+#ifdef __linux__
+    // Field 22 of /proc/<pid>/stat, the start time in clock ticks since boot.  The command name (field 2)
+    // may contain spaces and parentheses, so count from the last ')'.
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) return 0;
+    char buf[1024];
+    std::size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    const char *p = strrchr(buf, ')');
+    if (p == nullptr) return 0;
+    for (int field = 2; field < 22 && p != nullptr; field++) p = strchr(p + 1, ' ');
+    if (p == nullptr) return 0;
+    unsigned long long start = strtoull(p + 1, nullptr, 10);
+    return start % ((uint64_t(1) << 24) - 1) + 1;
+#else
+    (void)pid;
+    return 0;
+#endif
+}
+
+template <typename T>
+uint64_t
+SharedMemoryPool<T>::current_process() noexcept {
+    static std::atomic<uint64_t> self { 0 };
+    pid_t pid = getpid();
+    uint64_t process = self.load(std::memory_order_relaxed);
+    if (process == 0 || static_cast<pid_t>(process & pid_mask) != pid) {
+        process = (static_cast<uint64_t>(pid) & pid_mask) | start_tag(pid) << 22;
+        self.store(process, std::memory_order_relaxed);
+    }
+    return process;
+}
+
+template <typename T>
+bool
+SharedMemoryPool<T>::process_alive(uint64_t process) noexcept {
+    pid_t pid = static_cast<pid_t>(process & pid_mask);
+    if (kill(pid, 0) != 0 && errno == ESRCH) return false;
+    // Somebody has the pid.  If both start times are known and differ, it was reused.
+    uint64_t tag = process >> 22;
+    uint64_t now = start_tag(pid);
+    return tag == 0 || now == 0 || tag == now;
+}
+
+template <typename T>
+inline pid_t
+SharedMemoryPool<T>::owner(const T *p) const noexcept {
+    uint64_t word = reinterpret_cast<const entry_t *>(p)->owner.load();
+    return (word & freeing_bit) != 0 ? 0 : static_cast<pid_t>(word & pid_mask);
+}
+
+// PersistentPool's pop, except that the owner word of the slot is read while the slot is still at the
+// head of the free list.  Returns the index + 1 of the slot, 0 if the free list is empty.
+template <typename T>
+inline uint32_t
+SharedMemoryPool<T>::pop(uint64_t &word) noexcept {
+    std::atomic<uint64_t> &head = this->m_header->free;
+    uint64_t orig = head.load(std::memory_order_acquire);
+    while ((orig & 0xffffffffULL) != 0) {
+        uint32_t index = static_cast<uint32_t>(orig & 0xffffffffULL) - 1;
+        word = this->slot(index)->element.owner.load(std::memory_order_acquire);
+        uint64_t next = ((orig >> 32) + 1) << 32 | this->slot(index)->next;
+        if (head.compare_exchange_weak(orig, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return index + 1;
+        }
+    }
+    return 0;
+}
+
+// Splices the chain of slots first .. last (indices + 1, already linked) onto the free list
+template <typename T>
+inline void
+SharedMemoryPool<T>::push(uint32_t first, uint32_t last) noexcept {
+    std::atomic<uint64_t> &head = this->m_header->free;
+    uint64_t orig = head.load(std::memory_order_acquire);
+    uint64_t next;
+    do {
+        this->slot(last - 1)->next = static_cast<uint32_t>(orig & 0xffffffffULL);
+        next = ((orig >> 32) + 1) << 32 | first;
+    }
+    while (!head.compare_exchange_weak(orig, next, std::memory_order_acq_rel, std::memory_order_acquire));
+}
+
+template <typename T>
+inline typename SharedMemoryPool<T>::pointer
+SharedMemoryPool<T>::allocate() {
+    uint64_t process = current_process();
+    uint64_t word;
+    while (uint32_t index = pop(word)) {
+        // Between our read and now the word can only have been cleared by the deallocate() that freed the
+        // slot, or taken by recover_dead_owners() because that deallocate() died.  In the second case the
+        // version moves on when the recovery pushes the slot, and the slot isn't ours.
+        entry_t *e = &this->slot(index - 1)->element;
+        uint64_t version = version_of(word);
+        uint64_t expected = word;
+        do {
+            if (expected != word && expected != with_version(0, version)) break;
+            if (e->owner.compare_exchange_weak(expected, with_version(process, version))) return &e->value;
+        }
+        while (true);
+    }
+
+    // Nothing recycled, carve a never-used slot.  Nobody else knows about it yet.
+    uint64_t bump = this->m_header->bump.load(std::memory_order_relaxed);
+    do {
+        if (bump >= this->m_header->capacity) return nullptr;
+    }
+    while (!this->m_header->bump.compare_exchange_weak(bump, bump + 1, std::memory_order_relaxed));
+
+    entry_t *e = &this->slot(static_cast<uint32_t>(bump))->element;
+    e->owner.store(with_version(process, version_of(e->owner.load())));
+    return &e->value;
+}
+
+// Marks the slot as being freed before it goes onto the free list, and clears the mark right after.  A
+// process that dies in between leaves the mark behind for recover_dead_owners().
+template <typename T>
+inline void
+SharedMemoryPool<T>::release(entry_t *e, uint64_t version) noexcept {
+    uint64_t freeing = with_version(current_process(), version) | freeing_bit;
+    e->owner.store(freeing);
+    uint32_t index = this->index_of(e) + 1;
+    push(index, index);
+    e->owner.compare_exchange_strong(freeing, with_version(0, version));
+}
+
+template <typename T>
+inline void
+SharedMemoryPool<T>::deallocate(pointer p) {
+    if (p == nullptr) return;
+    entry_t *e = reinterpret_cast<entry_t *>(p);
+    release(e, version_of(e->owner.load(std::memory_order_relaxed)));
+}
+
+template <typename T>
+template <class... Args>
+inline typename SharedMemoryPool<T>::pointer
+SharedMemoryPool<T>::new_element(Args&&... args) {
+    pointer result = allocate();
+    if (result != nullptr) new (result) T (std::forward<Args>(args)...);
+    return result;
+}
+
+template <typename T>
+inline bool
+SharedMemoryPool<T>::adopt(pointer p, pid_t from) noexcept {
+    std::atomic<uint64_t> &owner = reinterpret_cast<entry_t *>(p)->owner;
+    uint64_t word = owner.load();
+    if ((word & freeing_bit) != 0 || static_cast<pid_t>(word & pid_mask) != from) return false;
+    return owner.compare_exchange_strong(word, with_version(current_process(), version_of(word)));
+}
+
+template <typename T>
+typename SharedMemoryPool<T>::size_type
+SharedMemoryPool<T>::recover_dead_owners() {
+    uint64_t process = current_process();
+    uint64_t holder = 0;
+    while (!recovery_lock().compare_exchange_strong(holder, process)) {
+        if (holder != 0 && process_alive(holder)) return 0;
+    }
+
+    size_type recovered = 0;
+    uint64_t carved = this->m_header->bump.load();
+    std::vector<std::pair<uint32_t, uint64_t>> interrupted;    // Owner died inside deallocate()
+
+    for (uint64_t i = 0; i < carved; i++) {
+        entry_t *e = &this->slot(static_cast<uint32_t>(i))->element;
+        uint64_t word = e->owner.load();
+        if ((word & process_mask) == 0 || process_alive(word & process_mask)) continue;
+
+        if ((word & freeing_bit) != 0) {
+            interrupted.emplace_back(static_cast<uint32_t>(i), word);
+        } else if (e->owner.compare_exchange_strong(word, with_version(process, version_of(word)))) {
+            // Owned slots are never on the free list
+            release(e, version_of(word));
+            recovered++;
+        }
+    }
+
+    if (!interrupted.empty()) {
+        // The owner may have died before or after pushing the slot.  Take the whole free list to see which,
+        // then put it back.
+        std::atomic<uint64_t> &head = this->m_header->free;
+        uint64_t orig = head.load(std::memory_order_acquire);
+        while (!head.compare_exchange_weak(orig, ((orig >> 32) + 1) << 32, std::memory_order_acq_rel, std::memory_order_acquire)) { }
+
+        std::vector<bool> listed(carved);
+        uint32_t first = static_cast<uint32_t>(orig & 0xffffffffULL), last = 0;
+        for (uint32_t i = first; i != 0; i = this->slot(i - 1)->next) {
+            if (i - 1 < carved) listed[i - 1] = true;
+            last = i;
+        }
+        if (first != 0) push(first, last);
+
+        for (auto &slot : interrupted) {
+            entry_t *e = &this->slot(slot.first)->element;
+            uint64_t version = version_of(slot.second);
+            if (listed[slot.first]) {
+                // Already free, only the mark was left behind
+                e->owner.compare_exchange_strong(slot.second, with_version(0, version));
+            } else if (e->owner.compare_exchange_strong(slot.second, with_version(process, version))) {
+                // An allocate() that popped the slot before we took the list gives it up when it sees
+                // this; the new version keeps it from claiming the slot once it is back on the list
+                release(e, version + 1);
+                recovered++;
+            }
+        }
+    }
+
+    recovery_lock().store(0);
+    return recovered;
+}
+#endif
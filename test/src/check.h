@@ -0,0 +1,24 @@
+#ifndef __TEST_CHECK_H__
+#define __TEST_CHECK_H__
+
+#include <cstdio>
+#include <cstdlib>
+
+// The test programs abort on the first failed check, like the torture test in mempool_test.cc
+#define CHECK(cond)                                                                         \
+    do {                                                                                    \
+        if (!(cond)) {                                                                      \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);        \
+            abort();                                                                        \
+        }                                                                                   \
+    } while (0)
+
+// Expression that must throw "exception"
+#define CHECK_THROWS(expr, exception)                                                       \
+    do {                                                                                    \
+        bool thrown = false;                                                                \
+        try { expr; } catch (const exception &) { thrown = true; }                          \
+        CHECK(thrown && #expr " throws " #exception);                                       \
+    } while (0)
+
+#endif
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <m_pool.h>
+
+#include "check.h"
+
+struct item {
+    uint64_t owner;
+    uint64_t serial;
+    char payload[48];
+};
+
+// Objects freed on one shard are found by allocate_at() starting from any other shard, and no
+// object is handed out twice while the free lists are being drained
+static void
+lock_free_steal() {
+    LockFreeMemoryPool<item> pool(1024);
+    const size_t shards = pool.shards();
+
+    std::vector<item *> objects;
+    for (size_t i = 0; i < 512; i++) objects.push_back(pool.allocate());
+    for (size_t i = 0; i < objects.size(); i++) pool.deallocate_at(objects[i], i % shards);
+
+    std::set<item *> freed(objects.begin(), objects.end());
+    for (size_t i = 0; i < objects.size(); i++) {
+        item *p = pool.allocate_at((i * 7) % shards);
+        CHECK(freed.erase(p) == 1);
+    }
+    CHECK(freed.empty());
+    // Every free list is empty now, so the next object is carved
+    item *fresh = pool.allocate_at(0);
+    CHECK(std::find(objects.begin(), objects.end(), fresh) == objects.end());
+}
+
+// Threads allocate and free on their own and on random shards. Every object carries its owner; after
+// the threads finish, all objects are back on the free lists and can be handed out without growing
+static void
+lock_free_stress() {
+    const int threads = 8;
+    const int rounds = 20000;
+    LockFreeMemoryPool<item> pool(4096);
+    const size_t shards = pool.shards();
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&pool, shards, t] {
+            uint32_t state = 2463534242u + t;
+            std::vector<item *> held;
+            for (int r = 0; r < rounds; r++) {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                if (held.size() < 64 && (state & 1)) {
+                    item *p = (state & 2) ? pool.allocate() : pool.allocate_at(state % shards);
+                    CHECK(p != nullptr);
+                    p->owner = t;
+                    p->serial = r;
+                    held.push_back(p);
+                } else if (!held.empty()) {
+                    item *p = held.back();
+                    held.pop_back();
+                    CHECK(p->owner == static_cast<uint64_t>(t));
+                    if (state & 2) {
+                        pool.deallocate(p);
+                    } else {
+                        pool.deallocate_at(p, state % shards);
+                    }
+                }
+            }
+            for (item *p : held) pool.deallocate(p);
+        });
+    }
+    for (std::thread &w : workers) w.join();
+
+    const size_t capacity = pool.capacity();
+    std::set<item *> seen;
+    for (size_t i = 0; i < capacity; i++) CHECK(seen.insert(pool.allocate()).second);
+    CHECK(pool.capacity() == capacity);
+    for (item *p : seen) pool.deallocate(p);
+}
+
+// trim() takes every free list, so the per-shard counts have to follow the objects it puts back
+static void
+lock_free_trim() {
+    LockFreeMemoryPool<item> pool(256);
+    std::vector<item *> objects;
+    for (int i = 0; i < 1024; i++) objects.push_back(pool.allocate());
+    CHECK(pool.capacity() == 1024);
+    for (size_t i = 0; i < objects.size(); i++) pool.deallocate_at(objects[i], i);
+
+    CHECK(pool.trim() == 3 * 256 * sizeof(item));
+    CHECK(pool.capacity() == 256);
+
+    std::set<item *> seen;
+    for (int i = 0; i < 256; i++) CHECK(seen.insert(pool.allocate_at(i)).second);
+    for (item *p : seen) CHECK(p >= objects[0] && p < objects[0] + 256);
+}
+
+// A pool that can't get memory from a shared budget makes the other pools on it trim their free segments
+static void
+lock_free_budget_pressure() {
+    const size_t segment = 256 * sizeof(item);
+    MemoryBudget budget(4 * segment);
+    LockFreeMemoryPool<item> pool(256, &budget);
+    std::vector<item *> objects;
+    for (int i = 0; i < 1024; i++) objects.push_back(pool.allocate());
+    CHECK(budget.used() == 4 * segment);
+    for (item *p : objects) pool.deallocate(p);
+
+    LockFreeMemoryPool<item> other(256, &budget);
+    CHECK(pool.capacity() == 256);
+    CHECK(budget.stats().bytes_trimmed == 3 * segment);
+    CHECK(budget.used() == 2 * segment);
+    CHECK(other.allocate() != nullptr);
+}
+
+// Flat combining: threads that find the lock taken have their requests served by whoever holds it.
+// Every object has one owner at a time, and every object comes back
+static void
+mutex_combining() {
+    const int threads = 16;
+    const int rounds = 20000;
+    const size_t capacity = threads * 64;
+    MutexMemoryPool<item> pool(capacity);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&pool, t] {
+            std::vector<item *> held;
+            for (int r = 0; r < rounds; r++) {
+                if (held.size() < 64 && (r % 3 != 2)) {
+                    item *p = pool.allocate();
+                    CHECK(p != nullptr);
+                    p->owner = t;
+                    held.push_back(p);
+                } else if (!held.empty()) {
+                    item *p = held.back();
+                    held.pop_back();
+                    CHECK(p->owner == static_cast<uint64_t>(t));
+                    pool.deallocate(p);
+                }
+            }
+            for (item *p : held) pool.deallocate(p);
+        });
+    }
+    for (std::thread &w : workers) w.join();
+
+    std::set<item *> seen;
+    for (size_t i = 0; i < capacity; i++) {
+        item *p = pool.allocate();
+        CHECK(p != nullptr && pool.owns(p));
+        CHECK(seen.insert(p).second);
+    }
+    CHECK(pool.allocate() == nullptr);
+    for (item *p : seen) pool.deallocate(p);
+}
+
+// Each thread owns an uncontended AdaptiveMemoryPool and also hammers a shared MutexMemoryPool of the same
+// type. Contention on the shared pool must not push the private pools into thread_cached mode
+static void
+adaptive_per_pool_contention() {
+    const int threads = 8;
+    MutexMemoryPool<item> shared(threads * 16);
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&shared] {
+            AdaptiveMemoryPool<item> own(1024);
+            for (int r = 0; r < 20000; r++) {
+                item *a = shared.allocate();
+                item *b = own.allocate();
+                CHECK(a != nullptr && b != nullptr);
+                shared.deallocate(a);
+                own.deallocate(b);
+            }
+            CHECK(own.current_mode() != AdaptiveMemoryPool<item>::mode::thread_cached);
+        });
+    }
+    for (std::thread &w : workers) w.join();
+}
+
+// A thread that found every record taken gets one once another thread exits
+static void
+adaptive_records_full() {
+    const int holders = 128;
+    AdaptiveMemoryPool<item> pool(1024);
+
+    std::mutex lock;
+    std::condition_variable cv;
+    int claimed = 0;
+    int released = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < holders; t++) {
+        threads.emplace_back([&, t] {
+            pool.deallocate(pool.allocate());
+            std::unique_lock<std::mutex> guard(lock);
+            claimed++;
+            cv.notify_all();
+            cv.wait(guard, [&] { return released > t; });
+        });
+    }
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [&] { return claimed == holders; });
+    }
+
+    std::thread late([&] {
+        CHECK(pool.current_mode() == AdaptiveMemoryPool<item>::mode::sharded);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            released = 1;
+        }
+        cv.notify_all();
+        threads[0].join();
+
+        bool got_record = false;
+        for (int r = 0; r < 4 * 256 && !got_record; r++) {
+            pool.deallocate(pool.allocate());
+            got_record = pool.current_mode() != AdaptiveMemoryPool<item>::mode::sharded;
+        }
+        CHECK(got_record);
+    });
+    late.join();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        released = holders;
+    }
+    cv.notify_all();
+    for (int t = 1; t < holders; t++) threads[t].join();
+}
+
+// Destroyed pools drop out of the exit lists of the threads that used them
+static void
+adaptive_exit_list() {
+    adaptive_thread_exit &exit = adaptive_thread_exit::get();
+    const size_t before = exit.entries.size();
+    for (int i = 0; i < 100; i++) {
+        AdaptiveMemoryPool<item> pool(64);
+        pool.deallocate(pool.allocate());
+        CHECK(exit.entries.size() == before + 1);
+    }
+    CHECK(exit.entries.size() == before);
+}
+
+// 12 bytes, alignment 4: the slots are padded to pointer alignment so free-list links stay aligned
+// (the hardened build checks every link it pops)
+struct odd_sized {
+    uint32_t words[3];
+};
+
+template <class P>
+static void
+odd_sized_slots(P &pool, size_t count) {
+    std::vector<odd_sized *> objects;
+    for (size_t i = 0; i < count; i++) {
+        odd_sized *p = pool.allocate();
+        CHECK(p != nullptr);
+        CHECK(reinterpret_cast<uintptr_t>(p) % alignof(void *) == 0);
+        p->words[0] = p->words[1] = p->words[2] = static_cast<uint32_t>(i);
+        objects.push_back(p);
+    }
+    for (odd_sized *p : objects) pool.deallocate(p);
+    std::set<odd_sized *> seen;
+    for (size_t i = 0; i < count; i++) CHECK(seen.insert(pool.allocate()).second);
+    for (odd_sized *p : seen) pool.deallocate(p);
+}
+
+int
+main(void) {
+    // GCC routes 16 byte atomics through libatomic, which doesn't report them as lock-free
+    if (LockFreeMemoryPool<item>::is_lock_free()) {
+        lock_free_steal();
+        lock_free_stress();
+        lock_free_trim();
+        lock_free_budget_pressure();
+        LockFreeMemoryPool<odd_sized> odd(8);
+        odd_sized_slots(odd, 20);
+    } else {
+        printf("16 byte CAS is not lock-free here, skipping LockFreeMemoryPool\n");
+    }
+    MutexMemoryPool<odd_sized> odd(8);
+    odd_sized_slots(odd, 8);
+    mutex_combining();
+    adaptive_per_pool_contention();
+    adaptive_records_full();
+    adaptive_exit_list();
+    printf("m_pool_test passed\n");
+    return 0;
+}
@@ -0,0 +1,267 @@
+#include <atomic>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <memory_pool.h>
+
+#include "check.h"
+
+// Counts constructions and destructions, so the tests can see which objects the pool destroys
+struct tracked {
+    static int_fast64_t alive;
+    int_fast64_t value;
+    char payload[48];
+
+    explicit tracked(int_fast64_t v = 0) : value(v) { alive++; }
+    ~tracked() { alive--; }
+};
+int_fast64_t tracked::alive = 0;
+
+typedef MemoryPool<tracked, 256> pool_t;
+
+// Live bits follow allocate()/deallocate() and acquire()/release(); cached objects aren't live
+static void
+live_bitmap() {
+    pool_t pool;
+    std::vector<tracked *> objects;
+    for (int i = 0; i < 1000; i++) objects.push_back(pool.new_element(i));
+    CHECK(pool.live_objects() == 1000);
+
+    for (int i = 1; i < 1000; i += 2) pool.delete_element(objects[i]);
+    CHECK(pool.live_objects() == 500);
+
+    std::set<int_fast64_t> seen;
+    pool.for_each_live([&](tracked &t) { CHECK(seen.insert(t.value).second); });
+    CHECK(seen.size() == 500);
+    for (int_fast64_t v : seen) CHECK(v % 2 == 0);
+
+    tracked *cached = pool.acquire(-1);
+    CHECK(pool.live_objects() == 501);
+    pool.release(cached);
+    CHECK(pool.live_objects() == 500);
+    CHECK(pool.acquire() == cached);
+    pool.release(cached);
+
+    CHECK(pool.destroy_live() == 500);
+    CHECK(pool.live_objects() == 0);
+    CHECK(pool.trim_cache() == 1);
+    CHECK(tracked::alive == 0);
+}
+
+// trim() hands back blocks with nothing live in them, to the OS and to the budget
+static void
+trim() {
+    MemoryBudget budget(64 * 1024 * 1024);
+    pool_t pool;
+    pool.set_budget(&budget);
+
+    std::vector<tracked *> objects;
+    for (int i = 0; i < 2000; i++) objects.push_back(pool.new_element(i));
+    std::size_t committed = pool.committed_bytes();
+    CHECK(committed > 0 && budget.used() == committed);
+
+    // The first object keeps its block; every other block goes
+    for (std::size_t i = 1; i < objects.size(); i++) pool.delete_element(objects[i]);
+    std::size_t released = pool.trim();
+    CHECK(released > 0 && released < committed);
+    CHECK(pool.committed_bytes() == committed - released);
+    CHECK(budget.used() == pool.committed_bytes());
+    CHECK(objects[0]->value == 0);
+
+    // Cached objects in a released block are destroyed by trim()
+    pool.delete_element(objects[0]);
+    pool.release(pool.acquire(7));
+    CHECK(tracked::alive == 1);
+    CHECK(pool.trim() > 0);
+    CHECK(pool.committed_bytes() == 0 && budget.used() == 0);
+    CHECK(tracked::alive == 0);
+
+    // Decommitted blocks come back on demand
+    for (int i = 0; i < 2000; i++) objects[i] = pool.new_element(i);
+    for (int i = 0; i < 2000; i++) CHECK(objects[i]->value == i);
+    CHECK(budget.used() == pool.committed_bytes());
+    for (tracked *t : objects) pool.delete_element(t);
+}
+
+// A budget that refuses growth makes allocate() fail instead of overrunning it
+static void
+budget_limit() {
+    pool_t probe;
+    probe.deallocate(probe.allocate());
+    std::size_t block = probe.committed_bytes();
+
+    MemoryBudget budget(2 * block);
+    pool_t pool;
+    pool.set_budget(&budget);
+    std::vector<tracked *> objects;
+    tracked *t;
+    while ((t = pool.allocate()) != nullptr) objects.push_back(t);
+    CHECK(!objects.empty());
+    CHECK(pool.committed_bytes() == 2 * block && budget.used() == 2 * block);
+    CHECK(budget.stats().failed_reservations > 0);
+    for (tracked *p : objects) pool.deallocate(p);
+}
+
+// reset() rewinds every block: live objects are destroyed, and the blocks already mapped are used again
+static void
+reset() {
+    pool_t pool;
+    for (int i = 0; i < 600; i++) pool.new_element(i);
+    pool.release(pool.acquire(-1));
+    CHECK(tracked::alive == 601);
+    std::size_t committed = pool.committed_bytes();
+
+    pool.reset();
+    CHECK(tracked::alive == 0);
+    CHECK(pool.live_objects() == 0);
+
+    std::set<tracked *> again;
+    for (int i = 0; i < 600; i++) CHECK(again.insert(pool.new_element(i)).second);
+    CHECK(pool.committed_bytes() == committed);
+    CHECK(pool.live_objects() == 600);
+
+    // Without destroy_live the objects are forgotten, not destroyed
+    pool.reset(false);
+    CHECK(tracked::alive == 600);
+    CHECK(pool.live_objects() == 0);
+    tracked::alive = 0;
+}
+
+// What the destructor does with objects that were never freed
+static void
+leak_policy() {
+    {
+        pool_t pool;
+        pool.set_leak_policy(pool_t::leak_policy::destroy);
+        for (int i = 0; i < 10; i++) pool.new_element(i);
+    }
+    CHECK(tracked::alive == 0);
+
+    {
+        pool_t pool;
+        pool.set_leak_policy(pool_t::leak_policy::ignore);
+        for (int i = 0; i < 10; i++) pool.new_element(i);
+    }
+    CHECK(tracked::alive == 10);
+    tracked::alive = 0;
+
+    // report only prints a line to stderr
+    {
+        pool_t pool;
+        pool.new_element(1);
+    }
+    CHECK(tracked::alive == 1);
+    tracked::alive = 0;
+}
+
+// Moving a pool moves its free lists.  In _MEM_POOL_HARDEN_ builds their links are encoded with the
+// source pool's key, which has to move along.
+static void
+moves() {
+    pool_t a;
+    tracked *x = a.allocate(), *y = a.allocate();
+    a.deallocate(x);
+    a.deallocate(y);
+
+    pool_t b(std::move(a));
+    tracked *p = b.allocate(), *q = b.allocate();
+    CHECK(p != nullptr && q != nullptr && p != q);
+    CHECK((p == x || p == y) && (q == x || q == y));
+    b.deallocate(p);
+    b.deallocate(q);
+
+    pool_t c;
+    c.deallocate(c.allocate());
+    c = std::move(b);
+    CHECK(c.allocate() != nullptr && c.allocate() != nullptr);
+    CHECK(a.allocate() != nullptr);
+    CHECK(b.allocate() != nullptr);
+
+    // Move assignment gives up the target's own blocks, and their budget charge, before taking over
+    MemoryBudget budget(64 * 1024 * 1024);
+    pool_t d, e;
+    d.set_budget(&budget);
+    e.set_budget(&budget);
+    for (int i = 0; i < 1000; i++) d.deallocate(d.allocate());
+    e.deallocate(e.allocate());
+    CHECK(budget.used() == d.committed_bytes() + e.committed_bytes());
+    d = std::move(e);
+    CHECK(budget.used() == d.committed_bytes() && e.committed_bytes() == 0);
+    CHECK(d.allocate() != nullptr);
+    CHECK(budget.used() == d.committed_bytes());
+
+    pool_t f(std::move(d));
+    CHECK(budget.used() == f.committed_bytes() && d.committed_bytes() == 0);
+    CHECK(budget.stats().pools == 1);
+
+    a.set_leak_policy(pool_t::leak_policy::ignore);
+    b.set_leak_policy(pool_t::leak_policy::ignore);
+    c.set_leak_policy(pool_t::leak_policy::ignore);
+    f.set_leak_policy(pool_t::leak_policy::ignore);
+}
+
+// Dumps run while other threads sample and free.  Afterwards the folded output adds up to exactly what
+// the stats say is live
+static void
+profiler_dump() {
+    PoolProfiler profiler(1);
+    pool_t pool;
+    pool.set_profiler(&profiler);
+
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&pool] {
+            std::vector<tracked *> held;
+            for (int r = 0; r < 20000; r++) {
+                if (held.size() < 64 && r % 3 != 2) {
+                    held.push_back(pool.allocate());
+                } else if (!held.empty()) {
+                    pool.deallocate(held.back());
+                    held.pop_back();
+                }
+            }
+            for (tracked *p : held) pool.deallocate(p);
+        });
+    }
+    std::thread dumper([&] {
+        while (!done.load()) {
+            std::ostringstream out;
+            profiler.dump_folded(out);
+        }
+    });
+    for (std::thread &t : threads) t.join();
+    done = true;
+    dumper.join();
+    CHECK(profiler.stats().live_samples == 0);
+
+    std::vector<tracked *> held;
+    for (int i = 0; i < 100; i++) held.push_back(pool.allocate());
+    std::ostringstream out;
+    profiler.dump_folded(out);
+    std::istringstream lines(out.str());
+    uint64_t total = 0;
+    for (std::string line; std::getline(lines, line);) total += std::stoull(line.substr(line.rfind(' ') + 1));
+    CHECK(total == profiler.stats().live_bytes);
+    CHECK(profiler.stats().live_samples == 100);
+    for (tracked *p : held) pool.deallocate(p);
+    CHECK(profiler.stats().live_bytes == 0);
+}
+
+int
+main(void) {
+    live_bitmap();
+    trim();
+    budget_limit();
+    reset();
+    leak_policy();
+    moves();
+    profiler_dump();
+
+    printf("memory_pool_test passed\n");
+    return 0;
+}
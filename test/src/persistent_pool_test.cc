@@ -0,0 +1,114 @@
+#include <string>
+#include <stdexcept>
+
+#include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <persistent_pool.h>
+
+#include "check.h"
+
+struct node {
+    int_fast64_t value = 0;
+    offset_ptr<node> next;
+};
+
+static std::string
+image_path() {
+    return "/tmp/persistent_pool_test." + std::to_string(getpid()) + ".pool";
+}
+
+// A list built before the pool goes away is still there, and still linked, after reattaching
+static void
+reattach(const std::string &path) {
+    {
+        PersistentPool<node> pool(path, 100);
+        CHECK(!pool.reattached());
+        node *head = nullptr;
+        for (int i = 0; i < 10; i++) {
+            node *n = pool.new_element();
+            CHECK(n != nullptr);
+            n->value = i;
+            n->next = head;
+            head = n;
+        }
+        pool.set_root(head);
+
+        // Two free slots, so the free list has to survive too
+        node *spare1 = pool.allocate();
+        node *spare2 = pool.allocate();
+        pool.deallocate(spare1);
+        pool.deallocate(spare2);
+    }
+
+    PersistentPool<node> pool(path, 100);
+    CHECK(pool.reattached());
+    CHECK(pool.was_clean_shutdown());
+
+    int expected = 9;
+    for (node *n = pool.root(); n != nullptr; n = n->next.get()) CHECK(n->value == expected--);
+    CHECK(expected == -1);
+
+    // The freed slots come back before any new one, and no slot of the list is handed out again
+    node *a = pool.allocate();
+    node *b = pool.allocate();
+    node *c = pool.allocate();
+    CHECK(pool.to_offset(a) != pool.to_offset(b));
+    for (node *n = pool.root(); n != nullptr; n = n->next.get()) CHECK(n != a && n != b && n != c);
+    CHECK(pool.to_offset(c) > pool.to_offset(a) && pool.to_offset(c) > pool.to_offset(b));
+
+    // Every slot can be used exactly once
+    std::size_t used = 13;
+    while (pool.allocate() != nullptr) used++;
+    CHECK(used == pool.capacity());
+
+    CHECK(pool.from_offset(pool.to_offset(a)) == a);
+    CHECK(pool.to_offset(nullptr) == 0 && pool.from_offset(0) == nullptr);
+}
+
+// A process that exits without running the destructor leaves an image marked unclean
+static void
+unclean_shutdown(const std::string &path) {
+    pid_t child = fork();
+    if (child == 0) {
+        PersistentPool<node> pool(path, 100);
+        node *n = pool.new_element();
+        n->value = 42;
+        pool.set_root(n);
+        pool.sync();
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    PersistentPool<node> pool(path, 100);
+    CHECK(pool.reattached());
+    CHECK(!pool.was_clean_shutdown());
+    CHECK(pool.root() != nullptr && pool.root()->value == 42);
+}
+
+// An image created for another capacity (or layout) is rejected, not misread
+static void
+mismatch(const std::string &path) {
+    { PersistentPool<node> pool(path, 100); }
+    CHECK_THROWS(PersistentPool<node> pool(path, 200), std::runtime_error);
+    CHECK_THROWS(PersistentPool<int_fast32_t> pool(path, 100), std::runtime_error);
+    CHECK_THROWS(PersistentPool<node> pool(path, 0), std::runtime_error);
+}
+
+int
+main(void) {
+    std::string path = image_path();
+
+    unlink(path.c_str());
+    reattach(path);
+    unlink(path.c_str());
+    unclean_shutdown(path);
+    unlink(path.c_str());
+    mismatch(path);
+    unlink(path.c_str());
+
+    printf("persistent_pool_test passed\n");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <pool.h>
+
+#include "check.h"
+
+struct item {
+    uint64_t owner;
+    char payload[56];
+};
+
+// segmented_growth<N> stops after N segments, fixed_growth after its one region
+static void
+growth_limits() {
+    Pool<item, overlay_link, locked_free_list, segmented_growth<3>> segmented(100);
+    std::set<item *> seen;
+    for (int i = 0; i < 300; i++) {
+        item *p = segmented.allocate();
+        CHECK(p != nullptr && seen.insert(p).second);
+    }
+    CHECK(segmented.capacity() == 300);
+    CHECK(segmented.allocate() == nullptr);
+
+    item *back = *seen.begin();
+    segmented.deallocate(back);
+    CHECK(segmented.allocate() == back);
+
+    Pool<item, overlay_link, locked_free_list, fixed_growth> fixed(10);
+    for (int i = 0; i < 10; i++) CHECK(fixed.allocate() != nullptr);
+    CHECK(fixed.allocate() == nullptr);
+}
+
+// inline_link keeps a freed object's bytes (hardening fills them on free)
+static void
+storage() {
+    Pool<item, inline_link, locked_free_list, fixed_growth, single_thread> pool(4);
+    item *p = pool.allocate();
+    p->owner = 42;
+    pool.deallocate(p);
+    CHECK(pool.allocate() == p);
+#ifndef _MEM_POOL_HARDEN_
+    CHECK(p->owner == 42);
+#endif
+}
+
+// The default configuration under threads: every object has one owner at a time
+template <class P>
+static void
+threads() {
+    const int workers = 8;
+    P pool(64);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < workers; t++) {
+        threads.emplace_back([&pool, t] {
+            std::vector<item *> held;
+            for (int r = 0; r < 20000; r++) {
+                if (held.size() < 32 && (r % 3 != 2)) {
+                    item *p = pool.allocate();
+                    CHECK(p != nullptr);
+                    p->owner = t;
+                    held.push_back(p);
+                } else if (!held.empty()) {
+                    CHECK(held.back()->owner == static_cast<uint64_t>(t));
+                    pool.deallocate(held.back());
+                    held.pop_back();
+                }
+            }
+            for (item *p : held) pool.deallocate(p);
+        });
+    }
+    for (std::thread &t : threads) t.join();
+}
+
+// 12 bytes, alignment 4: overlay_link pads the slots so the free-list links stay pointer aligned
+// (the hardened build checks every link it pops)
+struct odd_sized {
+    uint32_t words[3];
+};
+
+template <class P>
+static void
+odd_sized_slots() {
+    P pool(20);
+    std::vector<odd_sized *> objects;
+    for (int i = 0; i < 20; i++) {
+        odd_sized *p = pool.allocate();
+        CHECK(p != nullptr);
+        CHECK(reinterpret_cast<uintptr_t>(p) % alignof(void *) == 0);
+        p->words[0] = p->words[1] = p->words[2] = static_cast<uint32_t>(i);
+        objects.push_back(p);
+    }
+    for (odd_sized *p : objects) pool.deallocate(p);
+    std::set<odd_sized *> seen;
+    for (int i = 0; i < 20; i++) CHECK(seen.insert(pool.allocate()).second);
+    for (odd_sized *p : seen) pool.deallocate(p);
+}
+
+int
+main(void) {
+    growth_limits();
+    storage();
+    odd_sized_slots<Pool<odd_sized, overlay_link, locked_free_list, fixed_growth>>();
+    odd_sized_slots<Pool<odd_sized, overlay_link, locked_free_list, segmented_growth<4>>>();
+    threads<Pool<item>>();
+    threads<Pool<item, overlay_link, sharded_free_list<locked_free_list, 4>>>();
+    printf("pool_test passed\n");
+    return 0;
+}
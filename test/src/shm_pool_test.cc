@@ -0,0 +1,229 @@
+#include <set>
+#include <vector>
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <shm_pool.h>
+
+#include "check.h"
+
+// White box: the owner word layout documented in shm_pool.h
+static const uint64_t freeing_bit = uint64_t(1) << 63;
+static const uint64_t process_mask = (uint64_t(1) << 46) - 1;
+
+struct message {
+    int_fast64_t id;
+    char text[56];
+};
+
+typedef SharedMemoryPool<message> pool_t;
+typedef shared_pool_entry<message> entry_t;
+
+static std::atomic<uint64_t> &
+owner_word(message *m) {
+    return reinterpret_cast<entry_t *>(m)->owner;
+}
+
+static void
+wait_for(pid_t child) {
+    int status = 0;
+    CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Takes every slot the pool still has and checks none is handed out twice
+static std::size_t
+drain(pool_t &pool, std::vector<message *> &taken) {
+    std::set<message *> seen(taken.begin(), taken.end());
+    message *m;
+    while ((m = pool.allocate()) != nullptr) {
+        CHECK(seen.insert(m).second);
+        taken.push_back(m);
+    }
+    return taken.size();
+}
+
+static void
+release_all(pool_t &pool, std::vector<message *> &taken) {
+    for (message *m : taken) pool.deallocate(m);
+    taken.clear();
+}
+
+// Slots still owned by a process that exited go back to the free list, and only once
+static void
+dead_owner(pool_t &pool) {
+    pid_t child = fork();
+    if (child == 0) {
+        for (int i = 0; i < 10; i++) pool.allocate()->id = i;
+        _exit(0);
+    }
+    wait_for(child);
+
+    message *mine = pool.allocate();
+    CHECK(pool.owner(mine) == getpid());
+    CHECK(pool.recover_dead_owners() == 10);
+    CHECK(pool.recover_dead_owners() == 0);
+    CHECK(pool.owner(mine) == getpid());
+
+    std::vector<message *> taken { mine };
+    CHECK(drain(pool, taken) == pool.capacity());
+    release_all(pool, taken);
+}
+
+// Handing an object over: only the current owner can give it away
+static void
+adopt(pool_t &pool) {
+    int ready[2];
+    CHECK(pipe(ready) == 0);
+    pid_t child = fork();
+    if (child == 0) {
+        message *m = pool.allocate();
+        m->id = 7;
+        uint64_t handle = pool.to_handle(m);
+        if (write(ready[1], &handle, sizeof(handle)) != sizeof(handle)) _exit(1);
+        pause();
+        _exit(0);
+    }
+
+    uint64_t handle = 0;
+    CHECK(read(ready[0], &handle, sizeof(handle)) == sizeof(handle));
+    message *m = pool.from_handle(handle);
+    CHECK(m->id == 7 && pool.owner(m) == child);
+    CHECK(!pool.adopt(m, getpid()));
+    CHECK(pool.adopt(m, child));
+    CHECK(pool.owner(m) == getpid());
+
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    // Adopted, so not reclaimed with the child's slots
+    CHECK(pool.recover_dead_owners() == 0);
+    pool.deallocate(m);
+    close(ready[0]);
+    close(ready[1]);
+}
+
+// An owner word that names our own pid with a different start time is a dead process whose pid was reused
+static void
+reused_pid(pool_t &pool) {
+    message *m = pool.allocate();
+    uint64_t word = owner_word(m).load();
+    uint64_t tag = (word & process_mask) >> 22;
+    CHECK(tag != 0);
+    uint64_t other_tag = tag == 1 ? 2 : 1;
+    uint64_t other = (word & ~process_mask) | other_tag << 22 | static_cast<uint64_t>(getpid());
+    owner_word(m).store(other);
+    CHECK(pool.recover_dead_owners() == 1);
+
+    std::vector<message *> taken;
+    CHECK(drain(pool, taken) == pool.capacity());
+    release_all(pool, taken);
+}
+
+// The owner died inside deallocate(), before or after pushing the slot
+static void
+interrupted_free(pool_t &pool) {
+    pid_t child = fork();
+    if (child == 0) {
+        message *before = pool.allocate();
+        message *after = pool.allocate();
+        // Died before the push: marked, never on the free list
+        uint64_t word = owner_word(before).load();
+        owner_word(before).store(word | freeing_bit);
+        // Died after the push: on the free list, mark never cleared
+        word = owner_word(after).load();
+        pool.deallocate(after);
+        owner_word(after).store(word | freeing_bit);
+        _exit(0);
+    }
+    wait_for(child);
+
+    // Only the slot that never made it to the free list counts as recovered
+    CHECK(pool.recover_dead_owners() == 1);
+    CHECK(pool.recover_dead_owners() == 0);
+
+    std::vector<message *> taken;
+    CHECK(drain(pool, taken) == pool.capacity());
+    release_all(pool, taken);
+}
+
+// Several processes allocating and freeing while the parent keeps recovering.  Every child holds some
+// objects when it gets killed.
+static void
+stress(pool_t &pool) {
+    const int children = 4;
+    std::vector<pid_t> pids;
+    for (int c = 0; c < children; c++) {
+        pid_t child = fork();
+        if (child == 0) {
+            std::vector<message *> held;
+            for (uint64_t i = 0; ; i++) {
+                if (held.size() < 20) {
+                    message *m = pool.allocate();
+                    if (m != nullptr) {
+                        m->id = getpid();
+                        held.push_back(m);
+                    }
+                } else {
+                    std::size_t k = i % held.size();
+                    if (held[k]->id != getpid()) _exit(1);
+                    pool.deallocate(held[k]);
+                    held[k] = held.back();
+                    held.pop_back();
+                }
+            }
+        }
+        pids.push_back(child);
+    }
+
+    for (int round = 0; round < 200; round++) {
+        pool.recover_dead_owners();
+        usleep(500);
+        if (round % 50 == 49) {
+            // Replace one child, killing it wherever it happens to be
+            int c = round / 50 % children;
+            kill(pids[c], SIGKILL);
+            waitpid(pids[c], nullptr, 0);
+            pid_t child = fork();
+            if (child == 0) {
+                for (int i = 0; i < 30; i++) {
+                    message *m = pool.allocate();
+                    if (m != nullptr && i % 2 == 0) pool.deallocate(m);
+                }
+                _exit(0);
+            }
+            pids[c] = child;
+        }
+    }
+
+    for (pid_t child : pids) {
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+    }
+    pool.recover_dead_owners();
+
+    // A child killed between popping a slot and recording itself as the owner loses that slot, see
+    // recover_dead_owners().  Anything else missing, or any slot handed out twice, is a bug.
+    std::size_t kills = children * 2;
+    std::vector<message *> taken;
+    std::size_t left = drain(pool, taken);
+    if (left != pool.capacity()) fprintf(stderr, "stress: %zu slots lost to killed allocations\n", pool.capacity() - left);
+    CHECK(left <= pool.capacity() && left + kills >= pool.capacity());
+    release_all(pool, taken);
+}
+
+int
+main(void) {
+    const std::size_t capacity = 256;
+    pool_t pool(capacity);
+
+    dead_owner(pool);
+    adopt(pool);
+    reused_pid(pool);
+    interrupted_free(pool);
+    stress(pool);
+
+    printf("shm_pool_test passed\n");
+    return 0;
+}
@@ -0,0 +1,468 @@
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <thread_pool.h>
+
+#include "check.h"
+
+// Counts every operator new, so the tests can check that reused TaskGraphs don't allocate
+static std::atomic<long> allocations(0);
+
+void *
+operator new(size_t n) {
+    allocations++;
+    if (void *p = malloc(n)) return p;
+    throw std::bad_alloc();
+}
+
+// Out of line, or GCC flags the free() of operator new's memory once both are inlined
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept { free(p); }
+
+static const ThreadPool::scheduling modes[] = { ThreadPool::scheduling::shared_queue, ThreadPool::scheduling::work_stealing };
+
+// Capacity rounds up to a power of two; a full ring refuses a push and leaves the element alone
+static void
+ring_basics() {
+    mpmc_ring<std::function<void()>> ring(3);
+    CHECK(ring.capacity() == 4);
+    int calls = 0;
+    std::function<void()> fn = [&] { calls++; };
+    for (int i = 0; i < 4; i++) {
+        std::function<void()> copy = fn;
+        CHECK(ring.try_push(copy));
+    }
+    std::function<void()> rejected = fn;
+    CHECK(!ring.try_push(rejected));
+    CHECK(static_cast<bool>(rejected));
+
+    std::function<void()> out;
+    for (int i = 0; i < 4; i++) {
+        CHECK(ring.try_pop(out));
+        out();
+    }
+    CHECK(calls == 4);
+    CHECK(!ring.try_pop(out));
+}
+
+// Three producers and three consumers through a small ring: every element arrives exactly once
+static void
+ring_stress() {
+    const long per_producer = 20000;
+    mpmc_ring<long> ring(64);
+    std::atomic<long> sum(0), popped(0);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < 3; p++) {
+        threads.emplace_back([&] {
+            for (long i = 1; i <= per_producer; i++) {
+                long v = i;
+                while (!ring.try_push(v)) std::this_thread::yield();
+            }
+        });
+    }
+    for (int c = 0; c < 3; c++) {
+        threads.emplace_back([&] {
+            long v;
+            while (popped.load() < 3 * per_producer) {
+                if (ring.try_pop(v)) {
+                    sum += v;
+                    popped++;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread &t : threads) t.join();
+    CHECK(sum == 3 * per_producer * (per_producer + 1) / 2);
+}
+
+// With the only worker blocked, try_enqueue() fills the ring and then returns an invalid Future
+static void
+try_enqueue_full() {
+    ThreadPool pool(1, ThreadPool::scheduling::shared_queue, 2);
+    std::atomic<bool> started(false), release(false);
+    Future<void> blocker = pool.enqueue([&] {
+        started = true;
+        while (!release) std::this_thread::yield();
+    });
+    while (!started) std::this_thread::yield();
+
+    Future<int> a = pool.try_enqueue([] { return 1; });
+    Future<int> b = pool.try_enqueue([] { return 2; });
+    Future<int> c = pool.try_enqueue([] { return 3; });
+    CHECK(a.valid() && b.valid());
+    CHECK(!c.valid());
+
+    release = true;
+    blocker.get();
+    CHECK(a.get() == 1 && b.get() == 2);
+    CHECK(pool.try_enqueue([] { return 4; }).get() == 4);
+}
+
+// Workers spawning tasks while outside threads hammer try_enqueue; nothing is lost in either mode
+static void
+ring_pool_stress() {
+    for (ThreadPool::scheduling mode : modes) {
+        std::atomic<long> done(0);
+        std::function<void(int)> split;
+        {
+            ThreadPool pool(3, mode, 16);
+            split = [&](int depth) {
+                if (depth == 0) {
+                    done++;
+                    return;
+                }
+                pool.enqueue(split, depth - 1);
+                pool.enqueue(split, depth - 1);
+            };
+            pool.enqueue(split, 8);
+
+            std::vector<std::thread> producers;
+            for (int p = 0; p < 4; p++) {
+                producers.emplace_back([&] {
+                    for (int i = 0; i < 500; i++) {
+                        Future<int> f = pool.try_enqueue([&] { done++; return 1; });
+                        if (!f.valid()) pool.enqueue([&] { done++; });
+                    }
+                });
+            }
+            for (std::thread &t : producers) t.join();
+            CHECK(pool.enqueue([] { return 7; }).get() == 7);
+        }
+        CHECK(done == 256 + 4 * 500);
+    }
+}
+
+// try_push_bulk() reserves what fits and keeps FIFO order across calls
+static void
+ring_bulk() {
+    mpmc_ring<int> ring(8);
+    int values[20];
+    for (int i = 0; i < 20; i++) values[i] = i;
+    CHECK(ring.try_push_bulk(values, 5) == 5);
+    CHECK(ring.try_push_bulk(values + 5, 10) == 3);
+    CHECK(ring.try_push_bulk(values + 8, 1) == 0);
+    int v;
+    for (int i = 0; i < 8; i++) CHECK(ring.try_pop(v) && v == i);
+    CHECK(!ring.try_pop(v));
+}
+
+// enqueue_bulk() and submit_batch() in every mode, from outside and from inside a worker
+static void
+bulk_submit() {
+    for (ThreadPool::scheduling mode : modes) {
+        for (size_t ring : { 0, 16 }) {
+            ThreadPool pool(3, mode, ring);
+            std::vector<std::function<int()>> fns;
+            for (int i = 0; i < 1000; i++) fns.push_back([i] { return i * 3; });
+            std::vector<Future<int>> results = pool.enqueue_bulk(fns.begin(), fns.end());
+            CHECK(results.size() == 1000);
+            for (int i = 0; i < 1000; i++) CHECK(results[i].get() == i * 3);
+
+            std::atomic<int> detached(0);
+            ThreadPool::batch b = pool.submit_batch();
+            b.reserve(101);
+            std::vector<Future<std::string>> strings;
+            for (int i = 0; i < 50; i++) strings.push_back(b.add([](int x) { return std::to_string(x); }, i));
+            for (int i = 0; i < 50; i++) b.add_detached([&] { detached++; });
+            Future<int> bad = b.add([]() -> int { throw std::logic_error("batch"); });
+            CHECK(b.size() == 101);
+            b.submit();
+            CHECK(b.size() == 0);
+            for (int i = 0; i < 50; i++) CHECK(strings[i].get() == std::to_string(i));
+            CHECK_THROWS(bad.get(), std::logic_error);
+
+            Future<int> outer = pool.enqueue([&] {
+                ThreadPool::batch inner = pool.submit_batch();
+                std::vector<Future<int>> v;
+                for (int i = 0; i < 200; i++) v.push_back(inner.add([i] { return i; }));
+                inner.submit();
+                int sum = 0;
+                for (Future<int> &f : v) sum += f.get();
+                return sum;
+            });
+            CHECK(outer.get() == 199 * 200 / 2);
+
+            // A batch dropped without submit() breaks its promises
+            Future<int> orphan;
+            {
+                ThreadPool::batch lost = pool.submit_batch();
+                orphan = lost.add([] { return 1; });
+            }
+            bool broken = false;
+            try {
+                orphan.get();
+            } catch (const std::future_error &e) {
+                broken = e.code() == std::future_errc::broken_promise;
+            }
+            CHECK(broken);
+            while (detached.load() != 50) std::this_thread::yield();
+        }
+    }
+}
+
+// Every index exactly once, reductions and transforms, nesting inside workers, and the first exception
+// coming back out of parallel_for() after the loop has stopped
+static void
+parallel_loops() {
+    for (ThreadPool::scheduling mode : modes) {
+        ThreadPool pool(4, mode);
+        std::vector<int> hits(100000, 0);
+        pool.parallel_for(0, hits.size(), 64, [&](size_t i) { hits[i]++; });
+        pool.parallel_for(0, hits.size(), 0, [&](size_t i) { hits[i]++; });
+        for (int h : hits) CHECK(h == 2);
+        pool.parallel_for(5, 5, 1, [&](size_t) { CHECK(false); });
+
+        long sum = pool.parallel_reduce(0, 1000001, 1000, 0L, [](size_t i) { return static_cast<long>(i); },
+                                        [](long a, long b) { return a + b; });
+        CHECK(sum == 1000000L * 1000001 / 2);
+
+        std::vector<double> in(50000), out(50000);
+        for (size_t i = 0; i < in.size(); i++) in[i] = static_cast<double>(i);
+        CHECK(pool.parallel_transform(in.begin(), in.end(), out.begin(), 100, [](double x) { return x * 2; }) == out.end());
+        for (size_t i = 0; i < in.size(); i++) CHECK(out[i] == 2 * in[i]);
+
+        Future<long> nested = pool.enqueue([&] {
+            std::atomic<long> total(0);
+            pool.parallel_for(0, 64, 1, [&](size_t) {
+                total += pool.parallel_reduce(0, 1000, 10, 0L, [](size_t i) { return static_cast<long>(i); },
+                                              [](long a, long b) { return a + b; });
+            });
+            return total.load();
+        });
+        CHECK(nested.get() == 64L * 999 * 1000 / 2);
+
+        std::atomic<int> ran(0);
+        CHECK_THROWS(pool.parallel_for(0, 100000, 10, [&](size_t i) {
+            ran++;
+            if (i == 5000) throw std::out_of_range("parallel_for");
+        }), std::out_of_range);
+        CHECK(ran.load() < 100000);
+
+        CHECK_THROWS(pool.parallel_reduce(0, 1000, 1, 0L, [](size_t i) -> long {
+            if (i == 999) throw std::invalid_argument("map");
+            return 1;
+        }, [](long a, long b) { return a + b; }), std::invalid_argument);
+
+        // The pool is still usable after a loop threw
+        CHECK(pool.parallel_reduce(0, 100, 1, 0L, [](size_t) { return 1L; }, [](long a, long b) { return a + b; }) == 100);
+    }
+}
+
+// Dependencies hold on every run, a graph that has run once runs again without allocating, and a
+// throwing node stops its successors and comes back out of run()
+static void
+task_graph() {
+    for (ThreadPool::scheduling mode : modes) {
+        ThreadPool pool(4, mode);
+        TaskGraph g;
+        std::atomic<int> stage(0), mids(0);
+        TaskGraph::node first = g.add([&] { CHECK(mids == 0); stage = 1; });
+        std::vector<TaskGraph::node> middle;
+        for (int i = 0; i < 8; i++) middle.push_back(g.add([&] { CHECK(stage == 1); mids++; }, { first }));
+        TaskGraph::node last = g.add([&] { CHECK(mids == 8); stage = 2; });
+        for (TaskGraph::node n : middle) g.precede(n, last);
+
+        const int layers = 20, width = 16;
+        std::vector<std::atomic<int>> counts(layers);
+        std::vector<TaskGraph::node> previous;
+        for (int l = 0; l < layers; l++) {
+            std::vector<TaskGraph::node> current;
+            for (int w = 0; w < width; w++) {
+                TaskGraph::node n = g.add([&, l] {
+                    if (l != 0) CHECK(counts[l - 1] == width);
+                    counts[l]++;
+                });
+                for (TaskGraph::node p : previous) g.precede(p, n);
+                current.push_back(n);
+            }
+            previous = current;
+        }
+
+        auto run = [&] {
+            stage = 0;
+            mids = 0;
+            for (std::atomic<int> &c : counts) c = 0;
+            g.run(pool);
+            CHECK(stage == 2 && mids == 8);
+            for (std::atomic<int> &c : counts) CHECK(c == width);
+        };
+        // Warm up the per-thread task arenas first
+        for (int r = 0; r < 50; r++) run();
+        long before = allocations.load();
+        for (int r = 0; r < 200; r++) run();
+        CHECK(allocations.load() == before);
+
+        TaskGraph inner;
+        std::atomic<int> inner_runs(0);
+        TaskGraph::node x = inner.add([&] { inner_runs++; });
+        inner.add([&] { inner_runs++; }, { x });
+        pool.enqueue([&] { inner.run(pool); }).get();
+        CHECK(inner_runs == 2);
+
+        TaskGraph bad;
+        std::atomic<int> after(0);
+        TaskGraph::node thrower = bad.add([] { throw std::runtime_error("node"); });
+        bad.add([&] { after++; }, { thrower });
+        for (int r = 0; r < 3; r++) CHECK_THROWS(bad.run(pool), std::runtime_error);
+        CHECK(after == 0);
+
+        TaskGraph cycle;
+        TaskGraph::node p = cycle.add([] {});
+        TaskGraph::node q = cycle.add([] {}, { p });
+        cycle.precede(q, p);
+        CHECK_THROWS(cycle.run(pool), std::logic_error);
+        CHECK_THROWS(cycle.precede(0, 99), std::out_of_range);
+    }
+}
+
+// Copying it throws once armed, to check that a failed then() leaves the Future alone
+struct throwing_copy {
+    bool armed = false;
+    throwing_copy() {}
+    throwing_copy(const throwing_copy &other) : armed(other.armed) {
+        if (armed) throw std::runtime_error("copy");
+    }
+    int operator()(int x) const { return x; }
+};
+
+// then() chains, exceptions skipping continuations, when_all/when_any with values and exceptions
+static void
+continuations() {
+    for (ThreadPool::scheduling mode : modes) {
+        ThreadPool pool(3, mode);
+        Future<std::string> chain = pool.enqueue([] { return 20; })
+                                        .then([](int x) { return x + 1; })
+                                        .then([](int x) { return std::to_string(x * 2); });
+        CHECK(chain.get() == "42");
+
+        Future<int> ready = pool.enqueue([] { return 5; });
+        ready.wait();
+        CHECK(ready.then([](int x) { return x * 3; }).get() == 15);
+
+        std::atomic<bool> called(false);
+        Future<int> skipped = pool.enqueue([]() -> int { throw std::runtime_error("antecedent"); })
+                                  .then([&](int) { called = true; return 1; });
+        CHECK_THROWS(skipped.get(), std::runtime_error);
+        CHECK(!called);
+        CHECK_THROWS(pool.enqueue([] { return 1; }).then([](int) -> int { throw std::logic_error("then"); }).get(),
+                     std::logic_error);
+
+        Future<int> kept = pool.enqueue([] { return 9; });
+        throwing_copy fn;
+        fn.armed = true;
+        CHECK_THROWS(kept.then(fn), std::runtime_error);
+        CHECK(kept.valid());
+        CHECK(kept.get() == 9);
+
+        std::vector<Future<int>> values;
+        for (int i = 0; i < 50; i++) values.push_back(pool.enqueue([i] { std::this_thread::yield(); return i; }));
+        Future<std::vector<int>> all = when_all(values);
+        for (Future<int> &f : values) CHECK(!f.valid());
+        Future<int> sum = all.then([](std::vector<int> v) {
+            int total = 0;
+            for (size_t i = 0; i < v.size(); i++) {
+                CHECK(v[i] == static_cast<int>(i));
+                total += v[i];
+            }
+            return total;
+        });
+        CHECK(sum.get() == 49 * 50 / 2);
+
+        std::vector<Future<void>> voids;
+        std::atomic<int> count(0);
+        for (int i = 0; i < 10; i++) voids.push_back(pool.enqueue([&] { count++; }));
+        when_all(voids).then([&] { CHECK(count == 10); }).get();
+        std::vector<Future<int>> none;
+        CHECK(when_all(none).get().empty());
+
+        std::vector<Future<int>> mixed;
+        mixed.push_back(pool.enqueue([] { return 1; }));
+        mixed.push_back(pool.enqueue([]() -> int { throw std::out_of_range("when_all"); }));
+        mixed.push_back(pool.enqueue([] { return 3; }));
+        CHECK_THROWS(when_all(mixed).get(), std::out_of_range);
+
+        std::atomic<bool> go(false);
+        std::vector<Future<std::string>> any;
+        any.push_back(pool.enqueue([&] { while (!go) std::this_thread::yield(); return std::string("slow"); }));
+        any.push_back(pool.enqueue([] { return std::string("fast"); }));
+        std::pair<size_t, std::string> first = when_any(any).get();
+        CHECK(first.first == 1 && first.second == "fast");
+        go = true;
+
+        std::vector<Future<int>> failing;
+        failing.push_back(pool.enqueue([]() -> int { throw std::domain_error("when_any"); }));
+        CHECK_THROWS(when_any(failing).get(), std::domain_error);
+        std::vector<Future<int>> empty;
+        CHECK_THROWS(when_any(empty), std::invalid_argument);
+    }
+}
+
+// Inputs from one pool keep it, so then() on the combined future goes to that pool. Inputs from different
+// pools leave it without a pool, so then() on it is safe after those pools are gone
+static void
+combined_outlives_pools() {
+    {
+        ThreadPool pool(2);
+        std::vector<Future<int>> inputs;
+        for (int i = 0; i < 3; i++) inputs.push_back(pool.enqueue([i] { return i; }));
+        Future<std::vector<int>> all = when_all(inputs);
+        CHECK(all.pool() == &pool);
+        CHECK(all.then([](std::vector<int> v) { return v[0] + v[1] + v[2]; }).get() == 3);
+
+        std::vector<Future<int>> racing;
+        for (int i = 0; i < 2; i++) racing.push_back(pool.enqueue([i] { return i; }));
+        Future<std::pair<size_t, int>> first = when_any(racing);
+        CHECK(first.pool() == &pool);
+        CHECK(first.get().second < 2);
+    }
+
+    std::unique_ptr<ThreadPool> slow_pool(new ThreadPool(1));
+    std::atomic<bool> release(false);
+    Future<std::vector<int>> all;
+    {
+        ThreadPool fast_pool(1);
+        std::vector<Future<int>> inputs;
+        inputs.push_back(fast_pool.enqueue([] { return 1; }));
+        inputs.push_back(slow_pool->enqueue([&] { while (!release) std::this_thread::yield(); return 2; }));
+        all = when_all(inputs);
+    }
+    CHECK(all.pool() == nullptr);
+    Future<int> sum = all.then([](std::vector<int> v) { return v[0] + v[1]; });
+    release = true;
+    CHECK(sum.get() == 3);
+    slow_pool.reset();
+
+    Future<int> survivor;
+    {
+        ThreadPool pool(1);
+        survivor = pool.enqueue([] { return 7; });
+    }
+    CHECK(survivor.then([](int x) { return x + 1; }).get() == 8);
+}
+
+int
+main(void) {
+    ring_basics();
+    ring_stress();
+    try_enqueue_full();
+    ring_pool_stress();
+    ring_bulk();
+    bulk_submit();
+    parallel_loops();
+    task_graph();
+    continuations();
+    combined_outlives_pools();
+    printf("thread_pool_test passed\n");
+    return 0;
+}
@@ -0,0 +1,1963 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <cstdint>
+#include <cstddef>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <chrono>
+#include <algorithm>
+#include <iterator>
+#include <initializer_list>
+
+#include "memory_pool.h"
+
+// Chase-Lev 工作窃取双端队列（按 Lê 等人 "Correct and Efficient Work-Stealing for Weak Memory Models"
+// 的 C11 版本实现）。只有所属的工作线程能在底部 push/pop，其他线程只能从顶部 steal。
+// 队列里存的是指针，槽位是原子变量，窃取方读到的总是完整的值。
+// 数组满了就换一个两倍大的，旧数组可能还有窃取方在读，所以留到析构时才释放
+template<typename T>
+class work_stealing_deque {
+public:
+    explicit work_stealing_deque(size_t capacity = 256) : array(new ring(capacity)) {
+        retired.emplace_back(array.load(std::memory_order_relaxed));
+    }
+
+    work_stealing_deque(const work_stealing_deque&) = delete;
+    work_stealing_deque& operator=(const work_stealing_deque&) = delete;
+
+    // 只能由所属线程调用
+    void push(T* item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        ring* a = array.load(std::memory_order_relaxed);
+        if (b - t > static_cast<int64_t>(a->mask)) {
+            a = grow(a, t, b);
+        }
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // 只能由所属线程调用，后进先出，空时返回 nullptr
+    T* pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        ring* a = array.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            // 本来就是空的
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* item = a->get(b);
+        if (t == b) {
+            // 最后一个元素，和窃取方抢
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = nullptr;
+            }
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // 任何线程都可以调用，先进先出。空的或者和别人抢输了都返回 nullptr
+    T* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        T* item = array.load(std::memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return item;
+    }
+
+    // 只是个估计值
+    bool empty() const {
+        return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct ring {
+        const size_t mask;
+        std::unique_ptr<std::atomic<T*>[]> slots;
+
+        explicit ring(size_t capacity) : mask(capacity - 1), slots(new std::atomic<T*>[capacity]) {}
+        T* get(int64_t i) const { return slots[static_cast<size_t>(i) & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, T* item) { slots[static_cast<size_t>(i) & mask].store(item, std::memory_order_relaxed); }
+    };
+
+    ring* grow(ring* old, int64_t t, int64_t b) {
+        ring* bigger = new ring((old->mask + 1) * 2);
+        for (int64_t i = t; i < b; ++i) {
+            bigger->put(i, old->get(i));
+        }
+        retired.emplace_back(bigger);
+        array.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    // top 和 bottom 分别被窃取方和所属线程频繁修改，中间隔开一条缓存行。
+    // 用填充而不是 alignas：C++14 的 new 不保证超过 16 字节的对齐
+    std::atomic<int64_t> top{0};
+    char top_padding[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom{0};
+    char bottom_padding[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<ring*> array;
+    // 用过的所有数组（包括当前的），只有所属线程会修改
+    std::vector<std::unique_ptr<ring>> retired;
+};
+
+// Vyukov 的有界多生产者多消费者环形队列。每个格子带一个序号，生产者和消费者各自用 CAS 抢位置，
+// 抢到之后只写自己的格子，再用序号把格子交给对方，整个过程没有锁。
+// 生产者和消费者的位置各占一条缓存行，互不干扰
+template<typename T>
+class mpmc_ring {
+public:
+    // 容量向上取整到 2 的幂，至少为 2
+    explicit mpmc_ring(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) {
+            n <<= 1;
+        }
+        mask = n - 1;
+        buffer.reset(new cell[n]);
+        for (size_t i = 0; i < n; ++i) {
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~mpmc_ring() {
+        T value;
+        while (try_pop(value)) {}
+    }
+
+    mpmc_ring(const mpmc_ring&) = delete;
+    mpmc_ring& operator=(const mpmc_ring&) = delete;
+
+    // 队列满时立即返回 false，这时 value 不会被移走
+    bool try_push(T& value) {
+        cell* c;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &buffer[pos & mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (dif == 0) {
+                // 格子空着，抢这个位置
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                // 格子里还是上一圈的值没被取走：满了
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        new (&c->storage) T(std::move(value));
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 一次预留最多 n 个连续的格子（一次 CAS），依次移走 values[0..k) 并返回 k。满时返回 0
+    size_t try_push_bulk(T* values, size_t n) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        size_t count;
+        while (true) {
+            // 数一数从 pos 开始有几个格子空着，都空着的格子在抢到 pos 之前不会被别人改动
+            count = 0;
+            while (count < n && buffer[(pos + count) & mask].sequence.load(std::memory_order_acquire) == pos + count) {
+                ++count;
+            }
+            if (count != 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                    break;
+                }
+                continue;
+            }
+            size_t seq = buffer[pos & mask].sequence.load(std::memory_order_acquire);
+            if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos) < 0) {
+                return 0;
+            }
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            cell* c = &buffer[(pos + i) & mask];
+            new (&c->storage) T(std::move(values[i]));
+            c->sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    // 队列空时返回 false
+    bool try_pop(T& value) {
+        cell* c;
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            c = &buffer[pos & mask];
+            size_t seq = c->sequence.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (dif == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        T* stored = reinterpret_cast<T*>(&c->storage);
+        value = std::move(*stored);
+        stored->~T();
+        // 格子留给下一圈的生产者
+        c->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct cell {
+        std::atomic<size_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    std::unique_ptr<cell[]> buffer;
+    size_t mask;
+    char buffer_padding[64];
+    std::atomic<size_t> enqueue_pos{0};
+    char enqueue_padding[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> dequeue_pos{0};
+    char dequeue_padding[64 - sizeof(std::atomic<size_t>)];
+};
+
+// 任务用到的小块内存：结果槽、放不进 Task 的可调用对象、工作窃取队列里装箱的 Task。
+// 每个线程（工作线程和提交任务的外部线程都一样）有自己的一组按大小分级的 MemoryPool（arena），分配只在自己的
+// arena 里进行。自己释放的块先放进 arena 里的一个小缓存，不用任何原子操作；别的线程释放的（结果槽常常由取结果的
+// 线程释放）直接无锁地推回分配它的那个 MemoryPool，块头里记着是哪个，不用加锁也不用转发给所属线程。
+// 线程退出后 arena 留给之后新建的线程复用，从不销毁，所以比线程池活得更久的 Future 也能安全释放。
+// 超过最大级别的，或者池子分配失败时，退回 operator new
+class task_memory {
+public:
+    // 返回的地址按 max_align_t 对齐
+    static void* allocate(size_t bytes);
+    static void deallocate(void* p) noexcept;
+
+private:
+    static constexpr uint32_t size_classes = 3;
+    static constexpr uint32_t cache_slots = 64;
+
+    template<size_t N>
+    struct alignas(std::max_align_t) block {
+        unsigned char bytes[N];
+    };
+
+    // 一个线程的池子。cache 只有当前持有这个 arena 的线程会访问
+    struct arena {
+        MemoryPool<block<128>, 1024> small;
+        MemoryPool<block<256>, 512> medium;
+        MemoryPool<block<512>, 256> large;
+        struct {
+            void* slots[cache_slots];
+            uint32_t count = 0;
+        } cache[size_classes];
+        arena* next_free = nullptr;
+
+        void* pool_allocate(uint32_t size_class) {
+            switch (size_class) {
+            case 0: return small.allocate();
+            case 1: return medium.allocate();
+            default: return large.allocate();
+            }
+        }
+        void pool_deallocate(uint32_t size_class, void* p) noexcept {
+            switch (size_class) {
+            case 0: small.deallocate(static_cast<block<128>*>(p)); break;
+            case 1: medium.deallocate(static_cast<block<256>*>(p)); break;
+            default: large.deallocate(static_cast<block<512>*>(p)); break;
+            }
+        }
+    };
+
+    // 块头，owner 为空表示来自 operator new。按 max_align_t 对齐，后面的数据仍然对齐
+    struct alignas(std::max_align_t) header {
+        arena* owner;
+        uint32_t size_class;
+    };
+
+    // 线程第一次分配时领一个 arena，退出时交还
+    struct arena_lease {
+        arena* owned;
+        arena_lease() : owned(acquire_arena()) {}
+        ~arena_lease() { release_arena(owned); }
+    };
+
+    static arena* local_arena() {
+        static thread_local arena_lease lease;
+        return lease.owned;
+    }
+
+    // 空闲的 arena，只在线程第一次分配和退出时访问
+    static std::mutex& arenas_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static arena*& free_arenas() {
+        static arena* head = nullptr;
+        return head;
+    }
+
+    static arena* acquire_arena();
+    static void release_arena(arena* a) noexcept;
+};
+
+inline void* task_memory::allocate(size_t bytes) {
+    size_t total = bytes + sizeof(header);
+    header* h = nullptr;
+#ifndef _THREAD_POOL_HEAP_TASKS_
+    if (total <= 512) {
+        arena* a = local_arena();
+        uint32_t size_class = total <= 128 ? 0 : total <= 256 ? 1 : 2;
+        auto& cache = a->cache[size_class];
+        void* p = cache.count != 0 ? cache.slots[--cache.count] : a->pool_allocate(size_class);
+        if (p != nullptr) {
+            h = static_cast<header*>(p);
+            h->owner = a;
+            h->size_class = size_class;
+            return h + 1;
+        }
+    }
+#endif
+    h = static_cast<header*>(::operator new(total));
+    h->owner = nullptr;
+    return h + 1;
+}
+
+inline void task_memory::deallocate(void* p) noexcept {
+    header* h = static_cast<header*>(p) - 1;
+    arena* a = h->owner;
+    if (a == nullptr) {
+        ::operator delete(h);
+        return;
+    }
+    if (a == local_arena()) {
+        auto& cache = a->cache[h->size_class];
+        if (cache.count < cache_slots) {
+            cache.slots[cache.count++] = h;
+            return;
+        }
+    }
+    a->pool_deallocate(h->size_class, h);
+}
+
+inline task_memory::arena* task_memory::acquire_arena() {
+    {
+        std::lock_guard<std::mutex> lock(arenas_mutex());
+        arena* a = free_arenas();
+        if (a != nullptr) {
+            free_arenas() = a->next_free;
+            return a;
+        }
+    }
+    return new arena();
+}
+
+// 缓存里的块跟着 arena 一起交给下一个线程
+inline void task_memory::release_arena(arena* a) noexcept {
+    std::lock_guard<std::mutex> lock(arenas_mutex());
+    a->next_free = free_arenas();
+    free_arenas() = a;
+}
+
+// 只能移动的 void() 可调用对象，代替 std::function<void()>。
+// 不超过 inline_size 字节、移动不抛异常的可调用对象直接放在对象内部，不分配内存；更大的放到 task_memory 里。
+// sizeof(Task) 正好是一条缓存行
+class Task {
+public:
+    static constexpr size_t inline_size = 48;
+
+    Task() noexcept {}
+
+    template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) {
+        typedef typename std::decay<F>::type callable;
+        construct<callable>(std::forward<F>(f), std::integral_constant<bool, fits_inline<callable>()>());
+    }
+
+    Task(Task&& other) noexcept { take(other); }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    explicit operator bool() const noexcept { return ops != nullptr; }
+
+    void operator()() { ops->invoke(storage); }
+
+    void reset() noexcept {
+        if (ops != nullptr) {
+            ops->destroy(storage);
+            ops = nullptr;
+        }
+    }
+
+    template<class F>
+    static constexpr bool fits_inline() {
+        return sizeof(F) <= inline_size && alignof(F) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible<F>::value;
+    }
+
+private:
+    struct operations {
+        void (*invoke)(void* storage);
+        // 把 src 里的可调用对象搬到 dst，src 之后就是空的
+        void (*relocate)(void* dst, void* src) noexcept;
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template<class F>
+    struct inline_ops {
+        static void invoke(void* p) { (*static_cast<F*>(p))(); }
+        static void relocate(void* dst, void* src) noexcept {
+            F* from = static_cast<F*>(src);
+            new (dst) F(std::move(*from));
+            from->~F();
+        }
+        static void destroy(void* p) noexcept { static_cast<F*>(p)->~F(); }
+        static const operations* table() {
+            static const operations ops = { &invoke, &relocate, &destroy };
+            return &ops;
+        }
+    };
+
+    template<class F>
+    struct heap_ops {
+        static void invoke(void* p) { (**static_cast<F**>(p))(); }
+        static void relocate(void* dst, void* src) noexcept { *static_cast<F**>(dst) = *static_cast<F**>(src); }
+        static void destroy(void* p) noexcept {
+            F* f = *static_cast<F**>(p);
+            f->~F();
+            task_memory::deallocate(f);
+        }
+        static const operations* table() {
+            static const operations ops = { &invoke, &relocate, &destroy };
+            return &ops;
+        }
+    };
+
+    template<class F, class A>
+    void construct(A&& f, std::true_type) {
+        new (storage) F(std::forward<A>(f));
+        ops = inline_ops<F>::table();
+    }
+
+    template<class F, class A>
+    void construct(A&& f, std::false_type) {
+        void* p = task_memory::allocate(sizeof(F));
+        try {
+            *reinterpret_cast<F**>(storage) = new (p) F(std::forward<A>(f));
+        } catch (...) {
+            task_memory::deallocate(p);
+            throw;
+        }
+        ops = heap_ops<F>::table();
+    }
+
+    void take(Task& other) noexcept {
+        ops = other.ops;
+        if (ops != nullptr) {
+            ops->relocate(storage, other.storage);
+            other.ops = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    const operations* ops = nullptr;
+};
+
+// 代替 std::queue<Task>：环形数组，满了翻倍、从不缩小，稳定运行以后入队出队都不分配内存
+// （std::deque 每走过一段就要释放旧块、分配新块）。不是线程安全的，由 queue_mutex 保护
+class task_queue {
+public:
+    task_queue() : buffer(new Task[16]), mask(15) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    Task& front() { return buffer[head]; }
+
+    void emplace(Task&& task) {
+        if (count == mask + 1) {
+            grow();
+        }
+        buffer[(head + count) & mask] = std::move(task);
+        ++count;
+    }
+
+    void pop() {
+        buffer[head].reset();
+        head = (head + 1) & mask;
+        --count;
+    }
+
+private:
+    void grow() {
+        size_t capacity = (mask + 1) * 2;
+        std::unique_ptr<Task[]> bigger(new Task[capacity]);
+        for (size_t i = 0; i < count; ++i) {
+            bigger[i] = std::move(buffer[(head + i) & mask]);
+        }
+        buffer = std::move(bigger);
+        mask = capacity - 1;
+        head = 0;
+    }
+
+    std::unique_ptr<Task[]> buffer;
+    size_t mask;
+    size_t head = 0;
+    size_t count = 0;
+};
+
+class ThreadPool;
+
+// 把结果槽的后续任务交给 pool 执行；pool 为空或者已经停止时就在当前线程执行
+void submit_continuation(ThreadPool* pool, Task& task);
+
+// 结果槽里存放返回值的部分，void 没有值
+template<typename R>
+struct slot_value {
+    typename std::aligned_storage<sizeof(R), alignof(R)>::type storage;
+
+    template<class Fn> void emplace_from(Fn& fn) { new (&storage) R(fn()); }
+    R take() {
+        R* p = reinterpret_cast<R*>(&storage);
+        R result(std::move(*p));
+        p->~R();
+        return result;
+    }
+    void destroy() { reinterpret_cast<R*>(&storage)->~R(); }
+};
+
+template<>
+struct slot_value<void> {
+    template<class Fn> void emplace_from(Fn& fn) { fn(); }
+    void take() {}
+    void destroy() {}
+};
+
+// 一次性结果槽，代替 std::packaged_task 和 std::future 的共享状态：任务写一次，Future 读一次。
+// 两边各持有一个引用，最后放手的一方释放。等待的一方先自旋一会儿，结果还没好才睡在条件变量上，
+// 写结果的一方只有在有人睡着时才碰锁。
+// 也可以挂一个后续任务（Future::then、when_all、when_any），结果写好时由写结果的线程交给线程池，
+// 没有线程需要等待
+template<typename R>
+class result_slot {
+public:
+    // owner 是执行任务的线程池，后续任务也交给它
+    static result_slot* create(ThreadPool* owner = nullptr) {
+        result_slot* slot = new (task_memory::allocate(sizeof(result_slot))) result_slot();
+        slot->owner = owner;
+        return slot;
+    }
+
+    ThreadPool* pool() const { return owner; }
+
+    // 挂上后续任务，最多一个。结果写好时交给线程池；run_inline 为 true 时在写结果的线程里直接执行，
+    // 只适合很短的内部回调。结果已经好了就在当前线程执行：线程池这时可能已经析构了
+    void set_continuation(Task&& task, bool run_inline) {
+        continuation = std::move(task);
+        continuation_inline = run_inline;
+        // 和 publish() 里的 exchange 配对：后到的一方负责执行
+        if (continuation_state.exchange(continuation_set) == continuation_fired) {
+            Task ready(std::move(continuation));
+            ready();
+        }
+    }
+
+    // 执行 fn 并保存结果或异常
+    template<class Fn>
+    void run(Fn& fn) {
+        try {
+            value.emplace_from(fn);
+            publish(has_value);
+        } catch (...) {
+            exception = std::current_exception();
+            publish(has_exception);
+        }
+    }
+
+    // 任务没执行就被丢弃了（比如 try_enqueue 失败）
+    void abandon() {
+        exception = std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+        publish(has_exception);
+        release();
+    }
+
+    bool ready() const { return state.load(std::memory_order_acquire) != empty; }
+
+    void wait() {
+        for (int i = 0; i < 128 && !ready(); ++i) {
+            asm volatile("pause\n": : :"memory");
+        }
+        if (ready()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        // 先登记再检查，和 publish() 里先写 state 再检查 waiting 配对，唤醒不会丢
+        waiting.store(true);
+        condition.wait(lock, [this] { return ready(); });
+    }
+
+    // 只能调用一次
+    R get() {
+        wait();
+        if (state.load(std::memory_order_acquire) == has_exception) {
+            std::rethrow_exception(exception);
+        }
+        state.store(taken, std::memory_order_relaxed);
+        return value.take();
+    }
+
+    void release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (state.load(std::memory_order_relaxed) == has_value) {
+                value.destroy();
+            }
+            this->~result_slot();
+            task_memory::deallocate(this);
+        }
+    }
+
+private:
+    enum : uint32_t { empty, has_value, has_exception, taken };
+
+    result_slot() {}
+
+    enum : uint32_t { no_continuation, continuation_set, continuation_fired };
+
+    void publish(uint32_t result) {
+        state.store(result);
+        if (waiting.load()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            condition.notify_all();
+        }
+        // 后续任务持有 Future 那份引用，提交之后它随时可能执行完并释放这个槽，之后不能再碰成员
+        if (continuation_state.exchange(continuation_fired) == continuation_set) {
+            Task task(std::move(continuation));
+            if (continuation_inline) {
+                task();
+            } else {
+                submit_continuation(owner, task);
+            }
+        }
+    }
+
+    std::atomic<uint32_t> state{empty};
+    std::atomic<uint32_t> continuation_state{no_continuation};
+    bool continuation_inline = false;
+    ThreadPool* owner = nullptr;
+    Task continuation;
+    std::atomic<uint32_t> refs{2};
+    std::atomic<bool> waiting{false};
+    std::mutex mutex;
+    std::condition_variable condition;
+    slot_value<R> value;
+    std::exception_ptr exception;
+};
+
+// Future<R>::then(fn) 中 fn 的返回类型
+template<typename R, typename Fn>
+struct then_result {
+    typedef typename std::result_of<Fn&(R)>::type type;
+};
+
+template<typename Fn>
+struct then_result<void, Fn> {
+    typedef typename std::result_of<Fn&()>::type type;
+};
+
+// enqueue 返回的 future：只能移动，get() 只能调用一次，和 std::future 一样
+template<typename R>
+class Future {
+public:
+    Future() noexcept {}
+    explicit Future(result_slot<R>* slot) noexcept : slot(slot) {}
+
+    Future(Future&& other) noexcept : slot(other.slot) { other.slot = nullptr; }
+
+    Future& operator=(Future&& other) noexcept {
+        if (this != &other) {
+            reset();
+            slot = other.slot;
+            other.slot = nullptr;
+        }
+        return *this;
+    }
+
+    Future(const Future&) = delete;
+    Future& operator=(const Future&) = delete;
+
+    ~Future() { reset(); }
+
+    bool valid() const noexcept { return slot != nullptr; }
+    bool ready() const { return slot->ready(); }
+    void wait() const { slot->wait(); }
+
+    R get() {
+        if (slot == nullptr) {
+            throw std::future_error(std::future_errc::no_state);
+        }
+        struct releaser {
+            result_slot<R>* slot;
+            ~releaser() { slot->release(); }
+        } guard{slot};
+        slot = nullptr;
+        return guard.slot->get();
+    }
+
+    // 结果好了以后在线程池上执行 fn(结果)（R 为 void 时是 fn()），返回 fn 结果的 Future，不阻塞。
+    // 调用时结果已经好了就直接在当前线程执行 fn。
+    // 任务抛出的异常不会传给 fn，直接进入返回的 Future。调用后这个 Future 变为无效
+    template<class Fn>
+    auto then(Fn&& fn) -> Future<typename then_result<R, typename std::decay<Fn>::type>::type>;
+
+    // 执行任务的线程池，then() 的后续任务也交给它。when_all、when_any 的结果在输入都来自同一个线程池时
+    // 属于这个线程池，否则为 nullptr
+    ThreadPool* pool() const { return slot->pool(); }
+
+    // 交出结果槽的引用，when_all、when_any 用
+    result_slot<R>* release_slot() noexcept {
+        result_slot<R>* s = slot;
+        slot = nullptr;
+        return s;
+    }
+
+private:
+    void reset() {
+        if (slot != nullptr) {
+            slot->release();
+            slot = nullptr;
+        }
+    }
+
+    result_slot<R>* slot = nullptr;
+};
+
+// 带结果的任务：执行 fn，把结果写进槽里。没执行就被销毁时让 Future 得到 broken_promise
+template<typename R, typename Fn>
+class packaged_call {
+public:
+    // 构造失败时也让 Future 得到 broken_promise，调用方不用再管 slot
+    packaged_call(result_slot<R>* slot, Fn&& fn) try : slot(slot), fn(std::move(fn)) {
+    } catch (...) {
+        slot->abandon();
+    }
+
+    packaged_call(packaged_call&& other) noexcept(std::is_nothrow_move_constructible<Fn>::value)
+        : slot(other.slot), fn(std::move(other.fn)) {
+        other.slot = nullptr;
+    }
+
+    ~packaged_call() {
+        if (slot != nullptr) {
+            slot->abandon();
+        }
+    }
+
+    void operator()() {
+        slot->run(fn);
+        result_slot<R>* done = slot;
+        slot = nullptr;
+        done->release();
+    }
+
+private:
+    result_slot<R>* slot;
+    Fn fn;
+};
+
+// then() 的后续任务：从前一个结果槽取出结果交给 fn。持有前一个槽的一份引用
+template<typename R, typename Fn>
+class then_call {
+public:
+    then_call(result_slot<R>* from, Fn&& fn) try : from(from), fn(std::move(fn)) {
+    } catch (...) {
+        from->release();
+    }
+
+    then_call(then_call&& other) noexcept(std::is_nothrow_move_constructible<Fn>::value)
+        : from(other.from), fn(std::move(other.fn)) {
+        other.from = nullptr;
+    }
+
+    ~then_call() {
+        if (from != nullptr) {
+            from->release();
+        }
+    }
+
+    typename then_result<R, Fn>::type operator()() {
+        Future<R> antecedent(from);
+        from = nullptr;
+        return call(antecedent, std::is_void<R>());
+    }
+
+private:
+    typename then_result<R, Fn>::type call(Future<R>& antecedent, std::false_type) { return fn(antecedent.get()); }
+    typename then_result<R, Fn>::type call(Future<R>& antecedent, std::true_type) {
+        antecedent.get();
+        return fn();
+    }
+
+    result_slot<R>* from;
+    Fn fn;
+};
+
+class ThreadPool {
+public:
+    // 调度方式
+    //  - shared_queue：所有任务进同一个加锁的队列（默认）；
+    //  - work_stealing：每个工作线程有自己的 Chase-Lev 队列，工作线程里提交的任务放进自己的队列，
+    //    空闲的工作线程从随机挑选的其他线程那里偷任务；外部线程提交的任务先进注入队列（即 tasks）。
+    //    细粒度、会继续派生子任务的工作负载在这种方式下能随核数扩展
+    enum class scheduling { shared_queue, work_stealing };
+
+    // 构造函数，创建指定数量的工作线程。
+    // ring_capacity 不为 0 时，外部线程提交的任务改用这么大的无锁环形队列（mpmc_ring），而不是加锁的 tasks：
+    // 很多线程同时提交时不会互相阻塞在 queue_mutex 上
+    ThreadPool(size_t threads, scheduling mode = scheduling::shared_queue, size_t ring_capacity = 0);
+    // 析构函数，停止并销毁线程池（会先执行完所有已经提交的任务）
+    ~ThreadPool();
+
+    // 提交任务到任务队列
+    // F: 函数类型, Args: 函数参数类型
+    // 返回一个 Future 对象，用于获取任务的返回值（或者任务抛出的异常）。
+    // 可调用对象和参数加起来不超过 Task::inline_size 时，整个提交只从 task_memory 取一块内存（结果槽），通常不调用 malloc
+    template<class F, class... Args>
+    auto enqueue(F&& f, Args&&... args)
+    -> Future<typename std::result_of<F(Args...)>::type>;
+
+    // 和 enqueue 一样，只是环形队列满时不等待，立即返回一个无效的 Future（valid() 为 false）。
+    // 没有使用环形队列时总是成功
+    template<class F, class... Args>
+    auto try_enqueue(F&& f, Args&&... args)
+    -> Future<typename std::result_of<F(Args...)>::type>;
+
+    // 攒一批任务一起提交，见 batch
+    class batch;
+    batch submit_batch();
+
+    // 一次提交 [begin, end) 里的所有无参可调用对象（复制过去），返回每个任务的 Future，顺序和输入相同。
+    // 整批只加一次锁（或者在环形队列里一次预留一段格子），最多唤醒 min(任务数, 空闲线程数) 个线程
+    template<class It>
+    auto enqueue_bulk(It begin, It end)
+    -> std::vector<Future<typename std::result_of<typename std::iterator_traits<It>::reference()>::type>>;
+
+    // 不需要结果的任务：没有结果槽，可调用对象放得进 Task 时完全不分配内存。
+    // 任务里的异常不能抛出来，否则和 std::thread 一样调用 std::terminate
+    template<class F, class... Args>
+    void fire_and_forget(F&& f, Args&&... args);
+
+    size_t size() const { return workers.size(); }
+
+    // 当前线程在这个线程池中的编号，不是这个线程池的工作线程时返回 -1
+    int worker_index() const;
+
+    // 数据并行：对 [begin, end) 中的每个 i 调用 fn(i)，返回时全部执行完。
+    // 按懒惰二分（lazy binary splitting）切分：调用线程自己从左往右按 grain 个一块地执行，每块之间看一眼，
+    // 分出去还没人接手的子区间少于线程数，就把剩下的一半分出去，子区间也照此继续分。
+    // 有空闲线程时很快铺开，大家都忙时排队的子区间有上限、不再往下分，迭代耗时不均匀也能自动平衡。
+    // 调用线程（不管是不是工作线程）自己参与执行，等待子区间时先帮线程池执行排队的任务，
+    // 所以在任务里嵌套调用也不会多占线程或者死锁。grain 为 0 时取 (end - begin) / (8 * size())。
+    // fn 抛出的第一个异常在所有子区间结束后重新抛出，其余还没开始的块不再执行
+    template<class Fn>
+    void parallel_for(size_t begin, size_t end, size_t grain, const Fn& fn);
+
+    // 把 map(i)（i 属于 [begin, end)）用 combine 合并起来，identity 是 combine 的单位元。
+    // 和 std::reduce 一样，combine 要满足结合律和交换律，合并顺序不确定
+    template<class T, class Map, class Combine>
+    T parallel_reduce(size_t begin, size_t end, size_t grain, T identity, const Map& map, const Combine& combine);
+
+    // out[i] = fn(first[i])，要求随机访问迭代器，返回 out + (last - first)
+    template<class InputIt, class OutputIt, class Fn>
+    OutputIt parallel_transform(InputIt first, InputIt last, OutputIt out, size_t grain, const Fn& fn);
+
+private:
+    // 工作线程的容器
+    std::vector<std::thread> workers;
+    // 任务队列（work_stealing 方式下是外部线程提交任务的注入队列）
+    task_queue tasks;
+
+    // 同步机制
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    std::atomic<bool> stop;
+
+    const scheduling mode;
+    // work_stealing 方式下每个工作线程的队列
+    std::vector<std::unique_ptr<work_stealing_deque<Task>>> deques;
+    // 代替 tasks 的环形队列（可选）
+    std::unique_ptr<mpmc_ring<Task>> ring;
+    // 已经提交但还没被取走的任务数（包括所有队列），为 0 时工作线程才睡眠
+    std::atomic<size_t> pending{0};
+    // 注入队列中的任务数，不加锁就能知道要不要去拿
+    std::atomic<size_t> injected{0};
+    // 正在睡眠（或准备睡眠）的工作线程数，没有睡眠的线程时提交任务不用碰锁
+    std::atomic<size_t> idle_workers{0};
+
+    // 当前线程所属的线程池和编号
+    struct worker_context {
+        const ThreadPool* pool = nullptr;
+        size_t index = 0;
+    };
+    static worker_context& current_worker() {
+        static thread_local worker_context context;
+        return context;
+    }
+
+    // 工作线程的主循环函数（从lambda提取出来）
+    void worker_thread();
+    // work_stealing 方式或者使用环形队列时的主循环，按 pending 计数睡眠
+    void counted_worker_thread(size_t index);
+    // 上面这种主循环对应的提交和取任务。队列满并且 wait 为 false 时 schedule() 返回 false
+    bool schedule(Task& task, bool wait);
+    bool find_task(size_t index, Task& task);
+    bool take_external(Task& task);
+    // 唤醒 min(n, 空闲线程数) 个线程
+    void wake(size_t n);
+    // 一次提交一批任务，所有调度方式都走这里。成功后 tasks 被清空
+    void schedule_bulk(std::vector<Task>& tasks);
+    // 创建结果槽，把 f(args...) 包装成写结果槽的 Task，对应的 Future 放进 future
+    template<class R, class F, class... Args>
+    Task package(Future<R>& future, F&& f, Args&&... args);
+    // 按当前的调度方式提交一个任务
+    void submit(Task& task);
+    // 取一个排队的任务在当前线程执行，没有返回 false
+    bool run_one();
+
+    // TaskGraph 借用下面的提交和等待
+    friend class TaskGraph;
+    friend void submit_continuation(ThreadPool* pool, Task& task);
+
+    // 还没执行完的子任务计数。只有最后一次减到 0 要加锁，wait_helping() 返回前也拿一下锁，
+    // 所以等待的一方返回后就可以销毁它
+    struct task_latch {
+        std::atomic<size_t> count{0};
+        std::mutex mutex;
+        std::condition_variable condition;
+
+        void add() { count.fetch_add(1, std::memory_order_relaxed); }
+        void done() {
+            size_t c = count.load(std::memory_order_relaxed);
+            while (c > 1) {
+                if (count.compare_exchange_weak(c, c - 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                    return;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                condition.notify_all();
+            }
+        }
+        bool ready() const { return count.load(std::memory_order_acquire) == 0; }
+    };
+    // 等 latch 归零，期间帮忙执行排队的任务
+    void wait_helping(task_latch& latch);
+
+    // 一次并行循环的共享状态，在调用线程的栈上。Body 见 parallel_for 的实现
+    template<class Body>
+    struct split_loop {
+        const Body* prototype;
+        size_t grain;
+        // 分出去还没开始执行的子区间数，少于 max_queued 时才继续分
+        std::atomic<size_t> queued{0};
+        size_t max_queued;
+        task_latch outstanding;
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+    };
+    template<class Body>
+    void run_piece(split_loop<Body>& loop, size_t begin, size_t end);
+    template<class Body>
+    void run_split(size_t begin, size_t end, size_t grain, const Body& body);
+};
+
+// 工作线程主循环函数实现
+inline void ThreadPool::worker_thread() {
+    while(true) {
+        Task task;
+        {
+            // 1. 加锁
+            std::unique_lock<std::mutex> lock(this->queue_mutex);
+
+            // 2. 等待条件满足：队列不为空 或 线程池停止
+            this->condition.wait(lock, [this] {
+                return this->stop || !this->tasks.empty();
+            });
+
+            // 3. 如果线程池停止且任务队列为空，则线程退出
+            if(this->stop && this->tasks.empty()) {
+                return;
+            }
+
+            // 4. 从队列中取出一个任务
+            task = std::move(this->tasks.front());
+            this->tasks.pop();
+        } // 锁在这里被自动释放
+
+        // 5. 执行任务
+        task();
+    }
+}
+
+// 工作窃取方式（或使用环形队列时）的主循环：自己的队列 -> 外部提交的任务 -> 偷别人的，都没有才睡眠
+inline void ThreadPool::counted_worker_thread(size_t index) {
+    current_worker().pool = this;
+    current_worker().index = index;
+
+    while(true) {
+        Task task;
+        if (find_task(index, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(this->queue_mutex);
+        // 先登记为空闲再检查 pending，和 schedule() 里先加 pending 再检查 idle_workers 配对，
+        // 两边至少有一边能看到对方，唤醒不会丢
+        idle_workers.fetch_add(1);
+        this->condition.wait(lock, [this] {
+            return this->stop || pending.load() != 0;
+        });
+        idle_workers.fetch_sub(1);
+
+        if(this->stop && pending.load() == 0) {
+            return;
+        }
+    }
+}
+
+inline bool ThreadPool::find_task(size_t index, Task& result) {
+    // index 超出范围表示调用的不是这个线程池的工作线程，只能拿外部提交的任务或者偷
+    Task* task = index < deques.size() ? deques[index]->pop() : nullptr;
+
+    if (task == nullptr && take_external(result)) {
+        pending.fetch_sub(1);
+        return true;
+    }
+
+    if (task == nullptr && !deques.empty()) {
+        // 从随机的一个线程开始，每个线程偷一次
+        static thread_local std::minstd_rand rng(static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+        size_t start = rng() % deques.size();
+        for (size_t i = 0; i < deques.size() && task == nullptr; ++i) {
+            size_t victim = (start + i) % deques.size();
+            if (victim != index) {
+                task = deques[victim]->steal();
+            }
+        }
+    }
+
+    if (task == nullptr) {
+        return false;
+    }
+    pending.fetch_sub(1);
+    result = std::move(*task);
+    task->~Task();
+    task_memory::deallocate(task);
+    return true;
+}
+
+// 从外部提交的任务里取一个：环形队列或者注入队列
+inline bool ThreadPool::take_external(Task& task) {
+    if (ring) {
+        return ring->try_pop(task);
+    }
+    if (injected.load(std::memory_order_relaxed) == 0) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(this->queue_mutex);
+    if (this->tasks.empty()) {
+        return false;
+    }
+    task = std::move(this->tasks.front());
+    this->tasks.pop();
+    injected.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+inline bool ThreadPool::schedule(Task& task, bool wait) {
+    worker_context& self = current_worker();
+    if (self.pool == this && !deques.empty()) {
+        // 工作线程派生的任务放进自己的队列，不碰任何锁
+        pending.fetch_add(1);
+        deques[self.index]->push(new (task_memory::allocate(sizeof(Task))) Task(std::move(task)));
+    } else if (ring) {
+        if(stop) {
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        // 先加 pending 再入队，取走任务的线程减的时候不会减到 0 以下
+        pending.fetch_add(1);
+        while (!ring->try_push(task)) {
+            if (!wait) {
+                pending.fetch_sub(1);
+                return false;
+            }
+            // 满了：工作线程自己帮忙执行一个，免得所有工作线程都卡在提交上；其他线程让出 CPU 等待
+            Task other;
+            if (self.pool == this && take_external(other)) {
+                pending.fetch_sub(1);
+                other();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    } else {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if(stop) {
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        tasks.emplace(std::move(task));
+        injected.fetch_add(1, std::memory_order_relaxed);
+        pending.fetch_add(1);
+    }
+
+    wake(1);
+    return true;
+}
+
+inline void ThreadPool::schedule_bulk(std::vector<Task>& batch) {
+    size_t n = batch.size();
+    if (n == 0) {
+        return;
+    }
+
+    worker_context& self = current_worker();
+    if (mode == scheduling::shared_queue && !ring) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            if(stop) {
+                throw std::runtime_error("enqueue on stopped ThreadPool");
+            }
+            for (Task& task : batch) {
+                tasks.emplace(std::move(task));
+            }
+        }
+        // 这种主循环不记录空闲线程数，notify 时没有线程在等也不会进内核
+        if (n >= workers.size()) {
+            condition.notify_all();
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                condition.notify_one();
+            }
+        }
+        batch.clear();
+        return;
+    }
+
+    if (self.pool == this && !deques.empty()) {
+        pending.fetch_add(n);
+        size_t pushed = 0;
+        try {
+            for (; pushed < n; ++pushed) {
+                deques[self.index]->push(new (task_memory::allocate(sizeof(Task))) Task(std::move(batch[pushed])));
+            }
+        } catch (...) {
+            pending.fetch_sub(n - pushed);
+            wake(pushed);
+            throw;
+        }
+    } else if (ring) {
+        if(stop) {
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        pending.fetch_add(n);
+        size_t pushed = 0;
+        while ((pushed += ring->try_push_bulk(&batch[pushed], n - pushed)) < n) {
+            // 放进去的先让工作线程开始干，剩下的和 schedule() 一样等空位
+            wake(pushed);
+            Task other;
+            if (self.pool == this && take_external(other)) {
+                pending.fetch_sub(1);
+                other();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    } else {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if(stop) {
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        for (Task& task : batch) {
+            tasks.emplace(std::move(task));
+        }
+        injected.fetch_add(n, std::memory_order_relaxed);
+        pending.fetch_add(n);
+    }
+
+    wake(n);
+    batch.clear();
+}
+
+inline void ThreadPool::wake(size_t n) {
+    size_t idle = idle_workers.load();
+    if (idle != 0 && n != 0) {
+        // 持有锁再通知：睡眠的线程检查完条件、真正睡下之前一直拿着锁
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        if (n >= idle) {
+            condition.notify_all();
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                condition.notify_one();
+            }
+        }
+    }
+}
+
+inline int ThreadPool::worker_index() const {
+    const worker_context& self = current_worker();
+    return self.pool == this ? static_cast<int>(self.index) : -1;
+}
+
+// 构造函数实现
+inline ThreadPool::ThreadPool(size_t threads, scheduling mode, size_t ring_capacity) : stop(false), mode(mode) {
+    if (mode == scheduling::work_stealing) {
+        for(size_t i = 0; i < threads; ++i) {
+            deques.emplace_back(new work_stealing_deque<Task>());
+        }
+    }
+    if (ring_capacity != 0) {
+        ring.reset(new mpmc_ring<Task>(ring_capacity));
+    }
+    for(size_t i = 0; i < threads; ++i) {
+        // 使用成员函数替代lambda表达式
+        if (mode == scheduling::work_stealing || ring) {
+            workers.emplace_back(&ThreadPool::counted_worker_thread, this, i);
+        } else {
+            workers.emplace_back(&ThreadPool::worker_thread, this);
+        }
+    }
+}
+
+// 析构函数实现
+inline ThreadPool::~ThreadPool() {
+    {
+        // 1. 加锁，设置停止标志
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        stop = true;
+    }
+
+    // 2. 唤醒所有等待的线程
+    condition.notify_all();
+
+    // 3. 等待所有线程执行完毕
+    for(std::thread &worker: workers) {
+        worker.join();
+    }
+}
+
+template<class R, class F, class... Args>
+inline Task ThreadPool::package(Future<R>& future, F&& f, Args&&... args) {
+    typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)) call_type;
+    call_type call = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+    result_slot<R>* slot = result_slot<R>::create(this);
+    future = Future<R>(slot);
+    // 从这里开始任务那一份引用归 packaged_call 管，出了异常也由它放掉
+    return Task(packaged_call<R, call_type>(slot, std::move(call)));
+}
+
+// 任务提交函数实现
+template<class F, class... Args>
+auto ThreadPool::enqueue(F&& f, Args&&... args)
+-> Future<typename std::result_of<F(Args...)>::type> {
+
+    // 使用 std::result_of 获取函数 f 的返回类型
+    using return_type = typename std::result_of<F(Args...)>::type;
+    static_assert(!std::is_reference<return_type>::value, "Tasks returning references are not supported.");
+
+    // 结果槽由任务和 Future 共同持有
+    Future<return_type> res;
+    Task task = package(res, std::forward<F>(f), std::forward<Args>(args)...);
+
+    if (mode == scheduling::work_stealing || ring) {
+        schedule(task, true);
+        return res;
+    }
+
+    {
+        // 1. 加锁
+        std::unique_lock<std::mutex> lock(queue_mutex);
+
+        // 不允许在线程池停止后继续添加任务
+        if(stop) {
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+
+        // 2. 将任务放入队列
+        tasks.emplace(std::move(task));
+    }
+
+    // 3. 唤醒一个等待的线程
+    condition.notify_one();
+    return res;
+}
+
+template<class F, class... Args>
+auto ThreadPool::try_enqueue(F&& f, Args&&... args)
+-> Future<typename std::result_of<F(Args...)>::type> {
+    if (!ring) {
+        return enqueue(std::forward<F>(f), std::forward<Args>(args)...);
+    }
+
+    using return_type = typename std::result_of<F(Args...)>::type;
+    Future<return_type> res;
+    Task task = package(res, std::forward<F>(f), std::forward<Args>(args)...);
+
+    // 失败时 task 析构，结果槽随之释放
+    if (!schedule(task, false)) {
+        return Future<return_type>();
+    }
+    return res;
+}
+
+template<class F, class... Args>
+void ThreadPool::fire_and_forget(F&& f, Args&&... args) {
+    Task task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    submit(task);
+}
+
+inline void ThreadPool::submit(Task& task) {
+    if (mode == scheduling::work_stealing || ring) {
+        schedule(task, true);
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if(stop) {
+            throw std::runtime_error("enqueue on stopped ThreadPool");
+        }
+        tasks.emplace(std::move(task));
+    }
+    condition.notify_one();
+}
+
+inline bool ThreadPool::run_one() {
+    Task task;
+    if (mode == scheduling::shared_queue && !ring) {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (tasks.empty()) {
+            return false;
+        }
+        task = std::move(tasks.front());
+        tasks.pop();
+    } else {
+        const worker_context& self = current_worker();
+        if (!find_task(self.pool == this ? self.index : deques.size(), task)) {
+            return false;
+        }
+    }
+    task();
+    return true;
+}
+
+inline void ThreadPool::wait_helping(task_latch& latch) {
+    while (!latch.ready()) {
+        if (run_one()) {
+            continue;
+        }
+        // 没有能帮忙的任务：睡到计数归零，不过隔一会儿回来看看，期间可能又有子任务排进队列
+        std::unique_lock<std::mutex> lock(latch.mutex);
+        latch.condition.wait_for(lock, std::chrono::milliseconds(1), [&latch] { return latch.ready(); });
+    }
+    // 最后一个 done() 可能还没放开锁
+    std::lock_guard<std::mutex> lock(latch.mutex);
+}
+
+// 执行一个子区间：每块之前先看要不要把剩下的一半分出去
+template<class Body>
+void ThreadPool::run_piece(split_loop<Body>& loop, size_t begin, size_t end) {
+    try {
+        Body body(*loop.prototype);
+        while (begin < end && !loop.failed.load(std::memory_order_relaxed)) {
+            if (end - begin >= 2 * loop.grain && loop.queued.load(std::memory_order_relaxed) < loop.max_queued) {
+                size_t mid = begin + (end - begin) / 2;
+                loop.queued.fetch_add(1, std::memory_order_relaxed);
+                loop.outstanding.add();
+                split_loop<Body>* shared = &loop;
+                Task piece([this, shared, mid, end] {
+                    shared->queued.fetch_sub(1, std::memory_order_relaxed);
+                    run_piece(*shared, mid, end);
+                    shared->outstanding.done();
+                });
+                try {
+                    submit(piece);
+                    end = mid;
+                } catch (...) {
+                    // 提交不了（线程池正在停止）就自己做完
+                    loop.queued.fetch_sub(1, std::memory_order_relaxed);
+                    loop.outstanding.done();
+                }
+                continue;
+            }
+            size_t chunk_end = std::min(end, begin + loop.grain);
+            body.run(begin, chunk_end);
+            begin = chunk_end;
+        }
+        if (!loop.failed.load(std::memory_order_relaxed)) {
+            body.finish();
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(loop.outstanding.mutex);
+        if (!loop.error) {
+            loop.error = std::current_exception();
+        }
+        loop.failed.store(true, std::memory_order_relaxed);
+    }
+}
+
+// Body 由每个子区间复制一份：run(b, e) 依次处理相连的几块，finish() 在这个子区间做完后调用一次
+template<class Body>
+void ThreadPool::run_split(size_t begin, size_t end, size_t grain, const Body& body) {
+    if (begin >= end) {
+        return;
+    }
+    if (grain == 0) {
+        grain = std::max<size_t>(1, (end - begin) / (8 * std::max<size_t>(1, size())));
+    }
+    split_loop<Body> loop;
+    loop.prototype = &body;
+    loop.grain = grain;
+    loop.max_queued = std::max<size_t>(1, size());
+
+    run_piece(loop, begin, end);
+    wait_helping(loop.outstanding);
+    if (loop.error) {
+        std::rethrow_exception(loop.error);
+    }
+}
+
+template<class Fn>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, const Fn& fn) {
+    struct body {
+        const Fn* fn;
+        void run(size_t b, size_t e) {
+            for (size_t i = b; i < e; ++i) {
+                (*fn)(i);
+            }
+        }
+        void finish() {}
+    };
+    run_split(begin, end, grain, body{&fn});
+}
+
+template<class T, class Map, class Combine>
+T ThreadPool::parallel_reduce(size_t begin, size_t end, size_t grain, T identity, const Map& map, const Combine& combine) {
+    struct total {
+        T value;
+        std::mutex mutex;
+    } result{identity, {}};
+
+    // 每个子区间先在自己的 acc 上累积，做完再合并进 result
+    struct body {
+        const Map* map;
+        const Combine* combine;
+        total* result;
+        T acc;
+        void run(size_t b, size_t e) {
+            for (size_t i = b; i < e; ++i) {
+                acc = (*combine)(std::move(acc), (*map)(i));
+            }
+        }
+        void finish() {
+            std::lock_guard<std::mutex> lock(result->mutex);
+            result->value = (*combine)(std::move(result->value), std::move(acc));
+        }
+    };
+    run_split(begin, end, grain, body{&map, &combine, &result, identity});
+    return std::move(result.value);
+}
+
+template<class InputIt, class OutputIt, class Fn>
+OutputIt ThreadPool::parallel_transform(InputIt first, InputIt last, OutputIt out, size_t grain, const Fn& fn) {
+    size_t n = static_cast<size_t>(last - first);
+    parallel_for(0, n, grain, [&](size_t i) { out[i] = fn(first[i]); });
+    return out + n;
+}
+
+// submit_batch() 返回的批量提交器：add() 把任务攒在本地，submit() 一次交给线程池（见 enqueue_bulk）。
+// 没有 submit() 就销毁的任务不会执行，它们的 Future 得到 broken_promise
+class ThreadPool::batch {
+public:
+    explicit batch(ThreadPool& pool) : pool(&pool) {}
+
+    batch(batch&&) = default;
+    batch& operator=(batch&&) = default;
+
+    // 和 ThreadPool::enqueue 一样，只是先不提交
+    template<class F, class... Args>
+    auto add(F&& f, Args&&... args)
+    -> Future<typename std::result_of<F(Args...)>::type> {
+        using return_type = typename std::result_of<F(Args...)>::type;
+        static_assert(!std::is_reference<return_type>::value, "Tasks returning references are not supported.");
+        Future<return_type> res;
+        tasks.push_back(pool->package(res, std::forward<F>(f), std::forward<Args>(args)...));
+        return res;
+    }
+
+    // 和 ThreadPool::fire_and_forget 一样，只是先不提交
+    template<class F, class... Args>
+    void add_detached(F&& f, Args&&... args) {
+        tasks.emplace_back(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    }
+
+    void reserve(size_t n) { tasks.reserve(n); }
+    size_t size() const { return tasks.size(); }
+
+    // 提交攒下的所有任务，之后可以接着 add() 下一批
+    void submit() { pool->schedule_bulk(tasks); }
+
+private:
+    ThreadPool* pool;
+    std::vector<Task> tasks;
+};
+
+inline ThreadPool::batch ThreadPool::submit_batch() {
+    return batch(*this);
+}
+
+template<class It>
+auto ThreadPool::enqueue_bulk(It begin, It end)
+-> std::vector<Future<typename std::result_of<typename std::iterator_traits<It>::reference()>::type>> {
+    using return_type = typename std::result_of<typename std::iterator_traits<It>::reference()>::type;
+    std::vector<Future<return_type>> futures;
+    batch tasks(*this);
+    for (; begin != end; ++begin) {
+        futures.push_back(tasks.add(*begin));
+    }
+    tasks.submit();
+    return futures;
+}
+
+// 任务依赖图：先用 add()/precede() 建好，之后可以在线程池上反复 run()。
+// 每个节点有一个原子的剩余前驱计数，节点执行完给后继减一，减到 0 的后继就绪：第一个就绪的后继直接在当前线程
+// 接着执行，其余的提交给线程池。执行期间没有线程阻塞在等待上，调用 run() 的线程自己也执行节点，
+// 等待时帮线程池执行排队的任务。
+// 图本身在 run() 时不分配内存：计数就在节点里，提交的 Task 放得进内联存储（工作窃取方式下装箱用的是
+// task_memory 的线程缓存）。同一个图不能同时 run() 两次，run() 期间也不能修改
+class TaskGraph {
+public:
+    typedef size_t node;
+
+    TaskGraph() {}
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    // 添加一个节点，fn 是 void() 可调用对象，每次 run() 调用一次
+    template<class F>
+    node add(F&& fn);
+
+    // 添加一个依赖 deps 中所有节点的节点
+    template<class F>
+    node add(F&& fn, std::initializer_list<node> deps);
+
+    // after 在 before 执行完之后才执行
+    void precede(node before, node after);
+
+    size_t size() const { return nodes.size(); }
+
+    // 执行整个图，返回时所有节点都执行完了。节点抛出的第一个异常在结束后重新抛出，
+    // 之后就绪的节点不再执行。图里有环时抛出 std::logic_error
+    void run(ThreadPool& pool);
+
+private:
+    struct node_state {
+        Task work;
+        std::vector<node> successors;
+        size_t predecessors = 0;
+        std::atomic<size_t> remaining{0};
+    };
+
+    // 检查有没有环并找出根节点，只在图改过之后的第一次 run() 做
+    void prepare();
+    // 执行 index，然后顺着就绪的后继一直执行下去
+    void execute(node index);
+    void spawn(node index);
+
+    std::vector<std::unique_ptr<node_state>> nodes;
+    std::vector<node> roots;
+    bool prepared = false;
+
+    // 本次 run() 的状态
+    ThreadPool* pool = nullptr;
+    ThreadPool::task_latch unfinished;
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+};
+
+template<class F>
+TaskGraph::node TaskGraph::add(F&& fn) {
+    std::unique_ptr<node_state> state(new node_state());
+    state->work = Task(std::forward<F>(fn));
+    nodes.push_back(std::move(state));
+    prepared = false;
+    return nodes.size() - 1;
+}
+
+template<class F>
+TaskGraph::node TaskGraph::add(F&& fn, std::initializer_list<node> deps) {
+    for (node dep : deps) {
+        if (dep >= nodes.size()) {
+            throw std::out_of_range("TaskGraph: no such node");
+        }
+    }
+    node n = add(std::forward<F>(fn));
+    for (node dep : deps) {
+        precede(dep, n);
+    }
+    return n;
+}
+
+inline void TaskGraph::precede(node before, node after) {
+    if (before >= nodes.size() || after >= nodes.size()) {
+        throw std::out_of_range("TaskGraph: no such node");
+    }
+    nodes[before]->successors.push_back(after);
+    nodes[after]->predecessors++;
+    prepared = false;
+}
+
+inline void TaskGraph::prepare() {
+    // Kahn 拓扑排序：能排完就没有环
+    roots.clear();
+    std::vector<size_t> remaining(nodes.size());
+    std::vector<node> ready;
+    for (node i = 0; i < nodes.size(); ++i) {
+        remaining[i] = nodes[i]->predecessors;
+        if (remaining[i] == 0) {
+            roots.push_back(i);
+            ready.push_back(i);
+        }
+    }
+    size_t visited = 0;
+    while (!ready.empty()) {
+        node n = ready.back();
+        ready.pop_back();
+        ++visited;
+        for (node s : nodes[n]->successors) {
+            if (--remaining[s] == 0) {
+                ready.push_back(s);
+            }
+        }
+    }
+    if (visited != nodes.size()) {
+        throw std::logic_error("TaskGraph: dependency cycle");
+    }
+    prepared = true;
+}
+
+inline void TaskGraph::run(ThreadPool& pool) {
+    if (!prepared) {
+        prepare();
+    }
+    if (nodes.empty()) {
+        return;
+    }
+
+    for (auto& n : nodes) {
+        n->remaining.store(n->predecessors, std::memory_order_relaxed);
+    }
+    unfinished.count.store(nodes.size(), std::memory_order_relaxed);
+    failed.store(false, std::memory_order_relaxed);
+    error = nullptr;
+    this->pool = &pool;
+
+    // 第一个根在调用线程上执行，其余的交给线程池
+    for (size_t i = 1; i < roots.size(); ++i) {
+        spawn(roots[i]);
+    }
+    execute(roots[0]);
+    pool.wait_helping(unfinished);
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+inline void TaskGraph::execute(node index) {
+    while (true) {
+        node_state& n = *nodes[index];
+        if (!failed.load(std::memory_order_relaxed)) {
+            try {
+                n.work();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(unfinished.mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        const node none = nodes.size();
+        node next = none;
+        for (node s : n.successors) {
+            if (nodes[s]->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                if (next == none) {
+                    next = s;
+                } else {
+                    spawn(s);
+                }
+            }
+        }
+        // 最后一个 done() 之后 run() 就可能返回，不能再碰图
+        unfinished.done();
+        if (next == none) {
+            return;
+        }
+        index = next;
+    }
+}
+
+inline void TaskGraph::spawn(node index) {
+    Task task([this, index] { execute(index); });
+    try {
+        pool->submit(task);
+    } catch (...) {
+        // 线程池正在停止，提交不了就自己执行
+        execute(index);
+    }
+}
+
+inline void submit_continuation(ThreadPool* pool, Task& task) {
+    if (pool != nullptr) {
+        try {
+            pool->submit(task);
+            return;
+        } catch (...) {
+            // 线程池正在停止：task 还在，下面就地执行
+        }
+    }
+    task();
+}
+
+template<typename R>
+template<class Fn>
+auto Future<R>::then(Fn&& fn) -> Future<typename then_result<R, typename std::decay<Fn>::type>::type> {
+    typedef typename std::decay<Fn>::type fn_type;
+    typedef typename then_result<R, fn_type>::type result_type;
+    static_assert(!std::is_reference<result_type>::value, "Continuations returning references are not supported.");
+    if (slot == nullptr) {
+        throw std::future_error(std::future_errc::no_state);
+    }
+
+    // 先复制（移动）fn：这一步抛异常时 Future 还持有自己的引用
+    fn_type f(std::forward<Fn>(fn));
+    result_slot<R>* from = slot;
+    ThreadPool* pool = from->pool();
+    // 从这里开始 Future 这份引用归 then_call 管
+    slot = nullptr;
+    then_call<R, fn_type> call(from, std::move(f));
+
+    result_slot<result_type>* to = result_slot<result_type>::create(pool);
+    Future<result_type> res(to);
+    from->set_continuation(Task(packaged_call<result_type, then_call<R, fn_type>>(to, std::move(call))), false);
+    return res;
+}
+
+// when_all 的结果：所有结果按输入顺序放进 vector，void 就没有结果
+template<typename R>
+struct when_all_result {
+    typedef std::vector<R> type;
+};
+
+template<>
+struct when_all_result<void> {
+    typedef void type;
+};
+
+// when_any 的结果：最先完成的输入的下标和它的结果，void 只有下标
+template<typename R>
+struct when_any_result {
+    typedef std::pair<size_t, R> type;
+};
+
+template<>
+struct when_any_result<void> {
+    typedef size_t type;
+};
+
+// when_all、when_any 的共享状态：持有所有输入结果槽的引用和输出槽任务那一份引用。
+// 每个输入完成时在写结果的线程里调一次 arrive()，最后到达的一方释放整个状态。
+// 输入都来自同一个线程池时，输出槽也属于它，挂在结果上的 then() 交给这个线程池，和单个 Future 一样。
+// 输入来自不同的线程池（或者没有输入）时，哪一个都不一定比结果活得久，输出槽不属于任何线程池：
+// 挂在结果上的 then() 在写出结果的线程里直接执行
+template<typename R, typename Value>
+class combine_state {
+public:
+    explicit combine_state(std::vector<Future<R>>& futures) : remaining(futures.size()) {
+        ThreadPool* shared = futures.empty() ? nullptr : futures[0].pool();
+        for (auto& f : futures) {
+            if (!f.valid()) {
+                throw std::future_error(std::future_errc::no_state);
+            }
+            if (f.pool() != shared) {
+                shared = nullptr;
+            }
+        }
+        inputs.reserve(futures.size());
+        out = result_slot<Value>::create(shared);
+        for (auto& f : futures) {
+            inputs.push_back(f.release_slot());
+        }
+    }
+
+    virtual ~combine_state() {
+        for (result_slot<R>* input : inputs) {
+            input->release();
+        }
+        out->release();
+    }
+
+    combine_state(const combine_state&) = delete;
+    combine_state& operator=(const combine_state&) = delete;
+
+    // 给每个输入挂上回调。返回之后 this 可能已经被释放
+    Future<Value> start() {
+        Future<Value> res(out);
+        size_t n = inputs.size();
+        if (n == 0) {
+            all_completed();
+            delete this;
+            return res;
+        }
+        // 最后一个回调执行完就会释放 this，所以先复制一份
+        std::vector<result_slot<R>*> slots(inputs);
+        for (size_t i = 0; i < n; ++i) {
+            slots[i]->set_continuation(Task([this, i] { arrive(i); }), true);
+        }
+        return res;
+    }
+
+protected:
+    // 第 index 个输入完成了
+    virtual void completed(size_t index) = 0;
+    // 所有输入都完成了
+    virtual void all_completed() {}
+
+    std::vector<result_slot<R>*> inputs;
+    result_slot<Value>* out = nullptr;
+
+private:
+    void arrive(size_t index) {
+        completed(index);
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            all_completed();
+            delete this;
+        }
+    }
+
+    std::atomic<size_t> remaining;
+};
+
+template<typename R>
+class when_all_state : public combine_state<R, typename when_all_result<R>::type> {
+public:
+    typedef typename when_all_result<R>::type value_type;
+    using combine_state<R, value_type>::combine_state;
+
+protected:
+    void completed(size_t) override {}
+
+    // 按顺序取出每个结果，遇到的第一个异常进入 out
+    void all_completed() override {
+        auto collect = [this]() { return collect_all(std::is_void<R>()); };
+        this->out->run(collect);
+    }
+
+private:
+    value_type collect_all(std::false_type) {
+        value_type values;
+        values.reserve(this->inputs.size());
+        for (result_slot<R>* input : this->inputs) {
+            values.push_back(input->get());
+        }
+        return values;
+    }
+    void collect_all(std::true_type) {
+        for (result_slot<void>* input : this->inputs) {
+            input->get();
+        }
+    }
+};
+
+template<typename R>
+class when_any_state : public combine_state<R, typename when_any_result<R>::type> {
+public:
+    typedef typename when_any_result<R>::type value_type;
+    using combine_state<R, value_type>::combine_state;
+
+protected:
+    // 第一个完成的输入的结果（或者异常）进入 out，其余的结果到时候随状态一起丢弃
+    void completed(size_t index) override {
+        if (!claimed.exchange(true)) {
+            auto collect = [this, index]() { return collect_one(index, std::is_void<R>()); };
+            this->out->run(collect);
+        }
+    }
+
+private:
+    value_type collect_one(size_t index, std::false_type) { return value_type(index, this->inputs[index]->get()); }
+    value_type collect_one(size_t index, std::true_type) {
+        this->inputs[index]->get();
+        return index;
+    }
+
+    std::atomic<bool> claimed{false};
+};
+
+// 所有输入都完成后完成的 Future，不阻塞。输入必须有效，调用后全部变为无效
+template<typename R>
+Future<typename when_all_result<R>::type> when_all(std::vector<Future<R>>& futures) {
+    return (new when_all_state<R>(futures))->start();
+}
+
+// 任意一个输入完成后完成的 Future，不阻塞。futures 不能为空，输入必须有效，调用后全部变为无效
+template<typename R>
+Future<typename when_any_result<R>::type> when_any(std::vector<Future<R>>& futures) {
+    if (futures.empty()) {
+        throw std::invalid_argument("when_any: no futures");
+    }
+    return (new when_any_state<R>(futures))->start();
+}
+#endif